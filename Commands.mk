@@ -32,6 +32,11 @@ define cmd-ld
       -Wl,--as-needed $(addprefix -l, $(4))
 endef
 
+define cmd-ldbin
+  $(call cmd-print,  LD      $(strip $(1)))
+  $(Q)gcc $(LDFLAGS) $(2) -o $(1) -Wl,--as-needed $(addprefix -l, $(3))
+endef
+
 define cmd-ln
   $(call cmd-print,  LN      $(strip $(1)))
   $(Q)rm $(1) 2> '/dev/null' ; ln -s $(2) $(1)
@@ -0,0 +1,755 @@
+#include <deluge.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#ifndef DELUGE_VERSION
+#  define DELUGE_VERSION  "unknown"
+#endif
+
+#define DEFAULT_SIZES     "1024,65536,1048576"
+#define DEFAULT_STATIONS  "1,2,4"
+#define DEFAULT_THREADS   "1,4"
+#define DEFAULT_DEPTH     2
+#define DEFAULT_JOBS      256   /* per submitting thread */
+#define DEFAULT_WINDOW    8     /* jobs in flight per submitting thread */
+#define MAX_LIST          32
+
+
+struct options
+{
+	size_t       sizes[MAX_LIST];
+	size_t       nsize;
+	size_t       stations[MAX_LIST];
+	size_t       nstations;
+	size_t       threads[MAX_LIST];
+	size_t       nthreads;
+	size_t       depth;
+	size_t       njob;
+	size_t       window;
+	const char  *output;
+	const char  *label;
+	unsigned int selections[MAX_LIST];   /* device types, 0 for all */
+	size_t       nselection;
+	const char  *platform;
+};
+
+/*
+ * One sweep point, measured with `nthread` threads submitting `njob` jobs of
+ * `nelem` elements each to a context of `nstation` stations on the devices
+ * of the `selection` types.
+ */
+struct run
+{
+	unsigned int selection;
+	struct deluge_device_info *devices;   /* of the created context */
+	size_t       ndevice;
+	size_t       nelem;
+	size_t       nstation;      /* asked to deluge_highway_alloc() */
+	size_t       nalloc;        /* actually allocated */
+	size_t       nthread;
+	size_t       njob;
+	int          status;
+	uint64_t     elapsed;       /* nanoseconds */
+	uint64_t    *latencies;     /* of every job, in nanoseconds */
+};
+
+struct submitter;
+
+struct pending
+{
+	struct submitter  *owner;
+	uint64_t           start;
+	uint64_t          *latency;     /* may be NULL */
+};
+
+/*
+ * A thread submitting jobs, with at most `window` of them in flight so the
+ * latencies measure the stations rather than the queue.
+ */
+struct submitter
+{
+	deluge_highway_t   highway;
+	const uint64_t    *elems;
+	size_t             nelem;
+	size_t             njob;
+	size_t             window;
+	struct pending    *pendings;
+	pthread_t          thread;
+	int                started;
+	pthread_mutex_t    lock;
+	pthread_cond_t     cond;
+	size_t             inflight;
+	int                status;
+};
+
+
+static uint64_t get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void job_done(int status, uint64_t sum[5] __attribute__ ((unused)),
+		     void *user)
+{
+	struct pending *pending = user;
+	struct submitter *this = pending->owner;
+
+	if (pending->latency != NULL)
+		*pending->latency = get_time() - pending->start;
+
+	pthread_mutex_lock(&this->lock);
+	if ((status != DELUGE_SUCCESS) && (this->status == DELUGE_SUCCESS))
+		this->status = status;
+	this->inflight -= 1;
+	pthread_cond_signal(&this->cond);
+	pthread_mutex_unlock(&this->lock);
+}
+
+static void *submitter_main(void *uthis)
+{
+	struct submitter *this = uthis;
+	struct pending *pending;
+	size_t i;
+	int err;
+
+	for (i = 0; i < this->njob; i++) {
+		pthread_mutex_lock(&this->lock);
+		while (this->inflight >= this->window)
+			pthread_cond_wait(&this->cond, &this->lock);
+		this->inflight += 1;
+		pthread_mutex_unlock(&this->lock);
+
+		pending = &this->pendings[i];
+		pending->start = get_time();
+
+		err = deluge_highway_schedule(this->highway, this->elems,
+					      this->nelem, job_done, pending);
+		if (err != DELUGE_SUCCESS) {
+			pthread_mutex_lock(&this->lock);
+			this->status = err;
+			this->inflight -= 1;
+			pthread_mutex_unlock(&this->lock);
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&this->lock);
+	while (this->inflight > 0)
+		pthread_cond_wait(&this->cond, &this->lock);
+	pthread_mutex_unlock(&this->lock);
+
+	return NULL;
+}
+
+/*
+ * Submit `njob` jobs from each of `nthread` threads and wait for all of them.
+ * Store the latency of every job in `latencies` if not `NULL`.
+ * Return the time from the first submission to the last completion.
+ */
+static int submit_round(deluge_highway_t highway, const uint64_t *elems,
+			size_t nelem, size_t nthread, size_t njob,
+			size_t window, uint64_t *latencies, uint64_t *elapsed)
+{
+	struct submitter *subs;
+	uint64_t start;
+	size_t i, j;
+	int err;
+
+	subs = calloc(nthread, sizeof (*subs));
+	if (subs == NULL)
+		return DELUGE_FAILURE;
+
+	for (i = 0; i < nthread; i++) {
+		subs[i].pendings = calloc(njob, sizeof (*subs[i].pendings));
+		if (subs[i].pendings == NULL) {
+			err = DELUGE_FAILURE;
+			goto err_subs;
+		}
+
+		for (j = 0; j < njob; j++) {
+			subs[i].pendings[j].owner = &subs[i];
+			if (latencies != NULL)
+				subs[i].pendings[j].latency =
+					&latencies[i * njob + j];
+		}
+
+		subs[i].highway = highway;
+		subs[i].elems = elems;
+		subs[i].nelem = nelem;
+		subs[i].njob = njob;
+		subs[i].window = window;
+		subs[i].inflight = 0;
+		subs[i].status = DELUGE_SUCCESS;
+		pthread_mutex_init(&subs[i].lock, NULL);
+		pthread_cond_init(&subs[i].cond, NULL);
+	}
+
+	start = get_time();
+
+	/* a thread which cannot start submits from here */
+	for (i = 0; i < nthread; i++) {
+		subs[i].started = (pthread_create(&subs[i].thread, NULL,
+						  submitter_main,
+						  &subs[i]) == 0);
+		if (!subs[i].started)
+			submitter_main(&subs[i]);
+	}
+
+	err = DELUGE_SUCCESS;
+
+	for (i = 0; i < nthread; i++) {
+		if (subs[i].started)
+			pthread_join(subs[i].thread, NULL);
+		if (subs[i].status != DELUGE_SUCCESS)
+			err = subs[i].status;
+	}
+
+	*elapsed = get_time() - start;
+
+	i = nthread;
+ err_subs:
+	while (i-- > 0) {
+		free(subs[i].pendings);
+		pthread_cond_destroy(&subs[i].cond);
+		pthread_mutex_destroy(&subs[i].lock);
+	}
+	free(subs);
+	return err;
+}
+
+/*
+ * Every run has its own deluge context, since the stations of a destroyed
+ * highway context give their devices back only once their last job is done.
+ */
+static void bench_run(const struct options *opts, const uint64_t *elems,
+		      struct run *run)
+{
+	uint64_t key[4] = { 1, 2, 3, 4 };
+	struct deluge_options sel;
+	deluge_highway_t highway;
+	uint64_t warmup;
+	deluge_t deluge;
+	size_t i;
+	int err;
+
+	run->status = DELUGE_SUCCESS;
+	run->devices = NULL;
+	run->ndevice = 0;
+	run->nalloc = 0;
+	run->elapsed = 0;
+
+	run->latencies = calloc(run->nthread * run->njob,
+				sizeof (*run->latencies));
+	if (run->latencies == NULL) {
+		run->status = DELUGE_FAILURE;
+		return;
+	}
+
+	memset(&sel, 0, sizeof (sel));
+	sel.types = run->selection;
+	sel.platform = opts->platform;
+
+	err = deluge_create_with_options(&deluge, &sel);
+	if (err != DELUGE_SUCCESS)
+		goto err;
+
+	run->devices = calloc(deluge_device_count(deluge),
+			      sizeof (*run->devices));
+	if (run->devices == NULL) {
+		err = DELUGE_FAILURE;
+		goto err_deluge;
+	}
+
+	for (i = 0; i < deluge_device_count(deluge); i++) {
+		err = deluge_describe_device(deluge, i, &run->devices[i]);
+		if (err != DELUGE_SUCCESS)
+			goto err_deluge;
+		run->ndevice += 1;
+	}
+
+	err = deluge_highway_create(deluge, &highway, key);
+	if (err != DELUGE_SUCCESS)
+		goto err_deluge;
+
+	err = deluge_highway_set_depth(highway, opts->depth);
+	if (err != DELUGE_SUCCESS)
+		goto err_highway;
+
+	run->nalloc = deluge_highway_space(highway);
+	if (run->nalloc > run->nstation)
+		run->nalloc = run->nstation;
+
+	if (run->nalloc == 0) {
+		err = DELUGE_NODEV;
+		goto err_highway;
+	}
+
+	err = deluge_highway_alloc(highway, run->nalloc);
+	if (err != DELUGE_SUCCESS)
+		goto err_highway;
+
+	/* fill every slot once so the kernels and buffers are warm */
+	err = submit_round(highway, elems, run->nelem, 1,
+			   run->nalloc * opts->depth, opts->window, NULL,
+			   &warmup);
+	if (err != DELUGE_SUCCESS)
+		goto err_highway;
+
+	err = submit_round(highway, elems, run->nelem, run->nthread,
+			   run->njob, opts->window, run->latencies,
+			   &run->elapsed);
+ err_highway:
+	deluge_highway_destroy(highway);
+ err_deluge:
+	deluge_destroy(deluge);
+ err:
+	run->status = err;
+}
+
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Get the `permille` percentile of the `n` sorted values of `arr`.
+ */
+static uint64_t percentile(const uint64_t *arr, size_t n, size_t permille)
+{
+	size_t idx;
+
+	if (n == 0)
+		return 0;
+
+	idx = (n * permille + 999) / 1000;
+	if (idx > 0)
+		idx -= 1;
+
+	return arr[idx];
+}
+
+/*
+ * Measure `run` and sort its latencies for the percentiles of the report.
+ */
+static void measure(const struct options *opts, const uint64_t *elems,
+		    struct run *run)
+{
+	bench_run(opts, elems, run);
+
+	if (run->latencies != NULL)
+		qsort(run->latencies, run->nthread * run->njob,
+		      sizeof (*run->latencies), compare_u64);
+
+	fprintf(stderr, "devices %zu elements %zu stations %zu/%zu "
+		"threads %zu: status %d, %.3f s\n", run->ndevice, run->nelem,
+		run->nalloc, run->nstation, run->nthread, run->status,
+		run->elapsed / 1e9);
+}
+
+static void print_string(FILE *out, const char *str)
+{
+	fputc('"', out);
+
+	for (; *str != '\0'; str++) {
+		if ((*str == '"') || (*str == '\\'))
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char) *str);
+		else
+			fputc(*str, out);
+	}
+
+	fputc('"', out);
+}
+
+static const char *device_type_name(unsigned int flag)
+{
+	switch (flag) {
+	case DELUGE_DEVICE_CPU:          return "cpu";
+	case DELUGE_DEVICE_GPU:          return "gpu";
+	case DELUGE_DEVICE_ACCELERATOR:  return "accelerator";
+	case DELUGE_DEVICE_HOST:         return "host";
+	default:                         return "other";
+	}
+}
+
+static void print_selection(FILE *out, unsigned int types)
+{
+	unsigned int flag;
+	const char *sep;
+
+	if (types == 0) {
+		fprintf(out, "\"all\"");
+		return;
+	}
+
+	fputc('"', out);
+	for (flag = 1, sep = ""; flag <= types; flag <<= 1) {
+		if ((types & flag) == 0)
+			continue;
+		fprintf(out, "%s%s", sep, device_type_name(flag));
+		sep = ",";
+	}
+	fputc('"', out);
+}
+
+/*
+ * Print the devices of the context a run was measured on, which are the ones
+ * its selection actually found.
+ */
+static void print_devices(FILE *out, const struct run *run)
+{
+	const struct deluge_device_info *info;
+	size_t i;
+
+	fprintf(out, "\"devices\": [");
+
+	for (i = 0; i < run->ndevice; i++) {
+		info = &run->devices[i];
+
+		fprintf(out, "%s{ \"type\": \"%s\", \"name\": ",
+			(i == 0) ? " " : ", ", device_type_name(info->type));
+		print_string(out, info->name);
+		fprintf(out, ", \"vendor\": ");
+		print_string(out, info->vendor);
+		fprintf(out, ", \"driver\": ");
+		print_string(out, info->driver);
+		fprintf(out, ", \"gmem\": %zu }", info->gmem);
+	}
+
+	fprintf(out, " ]");
+}
+
+static void print_run(FILE *out, const struct run *run, int last)
+{
+	size_t n = run->nthread * run->njob;
+	double secs, elems;
+
+	secs = run->elapsed / 1e9;
+	elems = (double) n * run->nelem;
+
+	fprintf(out, "    { \"selection\": ");
+	print_selection(out, run->selection);
+	fprintf(out, ", ");
+	print_devices(out, run);
+	fprintf(out, ", \"elements\": %zu, \"stations\": %zu, "
+		"\"allocated\": %zu, \"threads\": %zu, \"jobs\": %zu, "
+		"\"status\": %d", run->nelem, run->nstation, run->nalloc,
+		run->nthread, n, run->status);
+
+	if ((run->status == DELUGE_SUCCESS) && (run->elapsed > 0)) {
+		fprintf(out, ", \"seconds\": %.6f, "
+			"\"elements_per_second\": %.0f, "
+			"\"gigabytes_per_second\": %.3f, "
+			"\"latency_ns\": { \"p50\": %lu, \"p99\": %lu, "
+			"\"p999\": %lu, \"max\": %lu }", secs, elems / secs,
+			elems * sizeof (uint64_t) / secs / 1e9,
+			(unsigned long) percentile(run->latencies, n, 500),
+			(unsigned long) percentile(run->latencies, n, 990),
+			(unsigned long) percentile(run->latencies, n, 999),
+			(unsigned long) run->latencies[n - 1]);
+	}
+
+	fprintf(out, " }%s\n", last ? "" : ",");
+}
+
+static void print_report(FILE *out, const struct options *opts,
+			 const struct run *runs, size_t nrun)
+{
+	size_t i;
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"library\": \"deluge\",\n");
+	fprintf(out, "  \"version\": \"%s\",\n", DELUGE_VERSION);
+	fprintf(out, "  \"label\": ");
+	print_string(out, opts->label);
+	fprintf(out, ",\n");
+	fprintf(out, "  \"depth\": %zu,\n", opts->depth);
+	fprintf(out, "  \"window\": %zu,\n", opts->window);
+	fprintf(out, "  \"runs\": [\n");
+
+	for (i = 0; i < nrun; i++)
+		print_run(out, &runs[i], i == (nrun - 1));
+
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+}
+
+
+static int parse_list(const char *str, size_t *arr, size_t *len)
+{
+	char *end;
+
+	*len = 0;
+
+	while (*str != '\0') {
+		if (*len == MAX_LIST)
+			return -1;
+
+		arr[*len] = strtoul(str, &end, 0);
+		if ((end == str) || (arr[*len] == 0))
+			return -1;
+
+		*len += 1;
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+
+		str = end;
+	}
+
+	return (*len == 0) ? -1 : 0;
+}
+
+static int parse_size(const char *str, size_t *dst)
+{
+	char *end;
+
+	*dst = strtoul(str, &end, 0);
+
+	return ((end == str) || (*end != '\0') || (*dst == 0)) ? -1 : 0;
+}
+
+static int parse_types(const char *str, unsigned int *dst)
+{
+	static const struct { const char *name; unsigned int flag; } types[] = {
+		{ "cpu",         DELUGE_DEVICE_CPU },
+		{ "gpu",         DELUGE_DEVICE_GPU },
+		{ "accelerator", DELUGE_DEVICE_ACCELERATOR },
+		{ "other",       DELUGE_DEVICE_OTHER },
+		{ "host",        DELUGE_DEVICE_HOST }
+	};
+	size_t i, len;
+
+	*dst = 0;
+
+	if (strcmp(str, "all") == 0)
+		return 0;
+
+	while (*str != '\0') {
+		len = strcspn(str, ",");
+
+		for (i = 0; i < (sizeof (types) / sizeof (*types)); i++)
+			if ((strlen(types[i].name) == len) &&
+			    (strncmp(str, types[i].name, len) == 0))
+				break;
+		if (i == (sizeof (types) / sizeof (*types)))
+			return -1;
+
+		*dst |= types[i].flag;
+
+		str += len;
+		if (*str == ',')
+			str++;
+	}
+
+	return (*dst == 0) ? -1 : 0;
+}
+
+static void usage(FILE *out, const char *prog)
+{
+	fprintf(out, "Usage: %s [options]\n"
+		"Measure the deluge highway hash sum throughput and latency\n"
+		"over every combination of device selection, job size,\n"
+		"station count and submitting threads, and print the results\n"
+		"as JSON.\n"
+		"\n"
+		"  -n LIST   elements per job (default " DEFAULT_SIZES ")\n"
+		"  -s LIST   stations to allocate (default " DEFAULT_STATIONS
+		")\n"
+		"  -t LIST   submitting threads (default " DEFAULT_THREADS
+		")\n"
+		"  -d DEPTH  jobs in the pipeline of a station (default %d)\n"
+		"  -j JOBS   jobs per thread (default %d)\n"
+		"  -w JOBS   jobs in flight per thread (default %d)\n"
+		"  -D TYPES  device kinds among cpu, gpu, accelerator, other\n"
+		"            and host, or all (default all), repeat to sweep\n"
+		"            over several device selections\n"
+		"  -P NAME   OpenCL platforms with NAME in their name\n"
+		"  -l LABEL  label of the run in the report\n"
+		"  -o FILE   write the report to FILE instead of stdout\n"
+		"  -h        print this message\n"
+		"\n"
+		"Stations go to the devices in discovery order, the host\n"
+		"device last.\n", prog, DEFAULT_DEPTH,
+		DEFAULT_JOBS, DEFAULT_WINDOW);
+}
+
+static int parse_options(int argc, char **argv, struct options *opts)
+{
+	unsigned int *types;
+	int c;
+
+	parse_list(DEFAULT_SIZES, opts->sizes, &opts->nsize);
+	parse_list(DEFAULT_STATIONS, opts->stations, &opts->nstations);
+	parse_list(DEFAULT_THREADS, opts->threads, &opts->nthreads);
+	opts->depth = DEFAULT_DEPTH;
+	opts->njob = DEFAULT_JOBS;
+	opts->window = DEFAULT_WINDOW;
+	opts->output = NULL;
+	opts->label = "";
+	opts->nselection = 0;
+	opts->platform = NULL;
+
+	while ((c = getopt(argc, argv, "n:s:t:d:j:w:D:P:l:o:h")) != -1) {
+		switch (c) {
+		case 'n':
+			if (parse_list(optarg, opts->sizes, &opts->nsize) < 0)
+				goto err;
+			break;
+		case 's':
+			if (parse_list(optarg, opts->stations,
+				       &opts->nstations) < 0)
+				goto err;
+			break;
+		case 't':
+			if (parse_list(optarg, opts->threads,
+				       &opts->nthreads) < 0)
+				goto err;
+			break;
+		case 'd':
+			if (parse_size(optarg, &opts->depth) < 0)
+				goto err;
+			break;
+		case 'j':
+			if (parse_size(optarg, &opts->njob) < 0)
+				goto err;
+			break;
+		case 'w':
+			if (parse_size(optarg, &opts->window) < 0)
+				goto err;
+			break;
+		case 'D':
+			if (opts->nselection == MAX_LIST)
+				goto err;
+			types = &opts->selections[opts->nselection];
+			if (parse_types(optarg, types) < 0)
+				goto err;
+			opts->nselection += 1;
+			break;
+		case 'P':
+			opts->platform = optarg;
+			break;
+		case 'l':
+			opts->label = optarg;
+			break;
+		case 'o':
+			opts->output = optarg;
+			break;
+		case 'h':
+			usage(stdout, argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			goto err;
+		}
+	}
+
+	if (optind != argc)
+		goto err;
+
+	if (opts->nselection == 0) {
+		opts->selections[0] = 0;
+		opts->nselection = 1;
+	}
+
+	return 0;
+ err:
+	usage(stderr, argv[0]);
+	return -1;
+}
+
+
+int main(int argc, char **argv)
+{
+	size_t i, d, s, t, n, nrun, maxelem;
+	struct options opts;
+	struct run *runs, *run;
+	uint64_t *elems, x;
+	FILE *out;
+	int ret;
+
+	if (parse_options(argc, argv, &opts) < 0)
+		return EXIT_FAILURE;
+
+	ret = EXIT_FAILURE;
+
+	maxelem = 0;
+	for (i = 0; i < opts.nsize; i++)
+		if (opts.sizes[i] > maxelem)
+			maxelem = opts.sizes[i];
+
+	elems = malloc(maxelem * sizeof (*elems));
+	if (elems == NULL) {
+		perror("malloc");
+		goto err;
+	}
+
+	/* splitmix64, any input hashes at the same speed */
+	for (i = 0, x = 0; i < maxelem; i++) {
+		x += 0x9e3779b97f4a7c15ull;
+		elems[i] = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	}
+
+	nrun = opts.nselection * opts.nsize * opts.nstations * opts.nthreads;
+	runs = calloc(nrun, sizeof (*runs));
+	if (runs == NULL) {
+		perror("calloc");
+		goto err_elems;
+	}
+
+	run = runs;
+	for (d = 0; d < opts.nselection; d++)
+		for (n = 0; n < opts.nsize; n++)
+			for (s = 0; s < opts.nstations; s++)
+				for (t = 0; t < opts.nthreads; t++, run++) {
+					run->selection = opts.selections[d];
+					run->nelem = opts.sizes[n];
+					run->nstation = opts.stations[s];
+					run->nthread = opts.threads[t];
+					run->njob = opts.njob;
+					measure(&opts, elems, run);
+				}
+
+	if (opts.output != NULL) {
+		out = fopen(opts.output, "w");
+		if (out == NULL) {
+			perror(opts.output);
+			goto err_runs;
+		}
+	} else {
+		out = stdout;
+	}
+
+	print_report(out, &opts, runs, nrun);
+
+	if ((out != stdout) && (fclose(out) != 0)) {
+		perror(opts.output);
+		goto err_runs;
+	}
+
+	ret = EXIT_SUCCESS;
+ err_runs:
+	for (i = 0; i < nrun; i++) {
+		free(runs[i].latencies);
+		free(runs[i].devices);
+	}
+	free(runs);
+ err_elems:
+	free(elems);
+ err:
+	return ret;
+}
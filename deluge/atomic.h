@@ -32,5 +32,78 @@ static inline uint64_t atomic_sub_uint64(atomic_uint64_t *dest, uint64_t val)
 	return __atomic_sub_fetch(&dest->val, val, __ATOMIC_SEQ_CST);
 }
 
+static inline uint64_t atomic_swap_uint64(atomic_uint64_t *dest, uint64_t val)
+{
+	return __atomic_exchange_n(&dest->val, val, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Set `dest` to `val` if it holds `*expected`, otherwise load it in
+ * `*expected`. Return non zero on success.
+ */
+static inline int atomic_cas_uint64(atomic_uint64_t *dest, uint64_t *expected,
+				    uint64_t val)
+{
+	return __atomic_compare_exchange(&dest->val, expected, &val, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+
+
+/*
+ * A pointer with a modification counter, updated at once so a compare and swap
+ * fails on a pointer which changed and then came back (ABA).
+ */
+typedef union
+{
+	struct
+	{
+		void     *ptr;
+		uint64_t  tag;
+	};
+	unsigned __int128 raw;
+} tagged_ptr_t;
+
+typedef struct
+{
+	tagged_ptr_t val;
+} atomic_tagged_ptr_t;
+
+static inline void atomic_store_tagged(atomic_tagged_ptr_t *dest, void *ptr,
+				       uint64_t tag)
+{
+	__atomic_store_n(&dest->val.tag, tag, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&dest->val.ptr, ptr, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The two halves are loaded apart, a torn value only makes the next compare
+ * and swap fail.
+ */
+static inline tagged_ptr_t atomic_load_tagged(atomic_tagged_ptr_t *src)
+{
+	tagged_ptr_t ret;
+
+	ret.tag = __atomic_load_n(&src->val.tag, __ATOMIC_SEQ_CST);
+	ret.ptr = __atomic_load_n(&src->val.ptr, __ATOMIC_SEQ_CST);
+
+	return ret;
+}
+
+#if defined (__x86_64__)
+__attribute__ ((target ("cx16")))
+#endif
+static inline int atomic_cas_tagged(atomic_tagged_ptr_t *dest,
+				    tagged_ptr_t expected, void *ptr)
+{
+	tagged_ptr_t val;
+
+	val.ptr = ptr;
+	val.tag = expected.tag + 1;
+
+	return __sync_bool_compare_and_swap(&dest->val.raw, expected.raw,
+					    val.raw);
+}
+
 
 #endif
@@ -0,0 +1,217 @@
+#include <deluge.h>
+#include "deluge/atomic.h"
+#include "deluge/cache.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define CACHE_MAGIC    0x3130454843414344ull    /* "DCACHE01" */
+
+
+/*
+ * Number of the next temporary file of the process, so the threads storing
+ * the same entry at once do not write the same file.
+ */
+static atomic_uint64_t ntmp;
+
+
+struct cache_header
+{
+	uint64_t magic;
+	uint64_t keylen;
+	uint64_t datalen;
+	uint64_t checksum;
+};
+
+
+uint64_t cache_hash(uint64_t seed, const void *data, size_t len)
+{
+	const unsigned char *ptr = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		seed ^= ptr[i];
+		seed *= 0x100000001b3ull;
+	}
+
+	return seed;
+}
+
+static char *get_cache_dir(void)
+{
+	const char *base, *sub;
+	char *ret;
+
+	if ((base = getenv("DELUGE_CACHE_DIR")) != NULL) {
+		if (base[0] == '\0')
+			return NULL;
+		sub = "";
+	} else if (((base = getenv("XDG_CACHE_HOME")) != NULL) &&
+		   (base[0] != '\0')) {
+		sub = "/deluge";
+	} else if (((base = getenv("HOME")) != NULL) && (base[0] != '\0')) {
+		sub = "/.cache/deluge";
+	} else {
+		return NULL;
+	}
+
+	ret = malloc(strlen(base) + strlen(sub) + 1);
+	if (ret == NULL)
+		return NULL;
+
+	strcpy(ret, base);
+	strcat(ret, sub);
+
+	return ret;
+}
+
+static int make_dirs(char *path)
+{
+	char *ptr;
+
+	for (ptr = path + 1; *ptr != '\0'; ptr++) {
+		if (*ptr != '/')
+			continue;
+
+		*ptr = '\0';
+		if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) {
+			*ptr = '/';
+			return DELUGE_FAILURE;
+		}
+		*ptr = '/';
+	}
+
+	if ((mkdir(path, 0755) != 0) && (errno != EEXIST))
+		return DELUGE_FAILURE;
+
+	return DELUGE_SUCCESS;
+}
+
+static char *get_cache_path(const char *key, const char *suffix)
+{
+	char *dir, *ret;
+	size_t len;
+
+	dir = get_cache_dir();
+	if (dir == NULL)
+		return NULL;
+
+	len = strlen(dir) + 1 + 16 + strlen(suffix) + 1;
+	ret = malloc(len);
+	if (ret != NULL)
+		snprintf(ret, len, "%s/%016lx%s", dir, (unsigned long)
+			 cache_hash(CACHE_HASH_SEED, key, strlen(key)),
+			 suffix);
+
+	free(dir);
+
+	return ret;
+}
+
+int cache_load(const char *key, void **data, size_t *len)
+{
+	struct cache_header header;
+	int ret = DELUGE_FAILURE;
+	char *path, *buf;
+	size_t keylen;
+	FILE *file;
+
+	path = get_cache_path(key, ".bin");
+	if (path == NULL)
+		goto out;
+
+	file = fopen(path, "rb");
+	if (file == NULL)
+		goto out_path;
+
+	if (fread(&header, sizeof (header), 1, file) != 1)
+		goto out_file;
+
+	keylen = strlen(key);
+	if ((header.magic != CACHE_MAGIC) || (header.keylen != keylen))
+		goto out_file;
+	if (header.datalen > (SIZE_MAX - keylen - 1))
+		goto out_file;
+
+	buf = malloc(keylen + header.datalen + 1);
+	if (buf == NULL)
+		goto out_file;
+
+	if (fread(buf, 1, keylen + header.datalen, file) !=
+	    (keylen + header.datalen))
+		goto out_buf;
+	if (fgetc(file) != EOF)
+		goto out_buf;
+	if (memcmp(buf, key, keylen) != 0)
+		goto out_buf;
+	if (cache_hash(CACHE_HASH_SEED, buf + keylen, header.datalen) !=
+	    header.checksum)
+		goto out_buf;
+
+	memmove(buf, buf + keylen, header.datalen);
+
+	*data = buf;
+	*len = header.datalen;
+	buf = NULL;
+
+	ret = DELUGE_SUCCESS;
+ out_buf:
+	free(buf);
+ out_file:
+	fclose(file);
+ out_path:
+	free(path);
+ out:
+	return ret;
+}
+
+void cache_store(const char *key, const void *data, size_t len)
+{
+	struct cache_header header;
+	char *path, *tmp, *sep;
+	char suffix[32];
+	FILE *file;
+	int ok;
+
+	path = get_cache_path(key, ".bin");
+	if (path == NULL)
+		return;
+
+	snprintf(suffix, sizeof (suffix), ".tmp.%ld.%lu", (long) getpid(),
+		 (unsigned long) atomic_add_uint64(&ntmp, 1));
+	tmp = get_cache_path(key, suffix);
+	if (tmp == NULL)
+		goto out_path;
+
+	sep = strrchr(tmp, '/');
+	*sep = '\0';
+	ok = (make_dirs(tmp) == DELUGE_SUCCESS);
+	*sep = '/';
+	if (!ok)
+		goto out_tmp;
+
+	file = fopen(tmp, "wb");
+	if (file == NULL)
+		goto out_tmp;
+
+	header.magic = CACHE_MAGIC;
+	header.keylen = strlen(key);
+	header.datalen = len;
+	header.checksum = cache_hash(CACHE_HASH_SEED, data, len);
+
+	ok = (fwrite(&header, sizeof (header), 1, file) == 1);
+	ok = ok && (fwrite(key, 1, header.keylen, file) == header.keylen);
+	ok = ok && (fwrite(data, 1, len, file) == len);
+	ok = (fclose(file) == 0) && ok;
+
+	if (!ok || (rename(tmp, path) != 0))
+		unlink(tmp);
+ out_tmp:
+	free(tmp);
+ out_path:
+	free(path);
+}
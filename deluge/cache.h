@@ -0,0 +1,41 @@
+#ifndef _DELUGE_CACHE_H_
+#define _DELUGE_CACHE_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Persistent cache of binary blobs indexed by string keys.
+ * The cache lives in `$DELUGE_CACHE_DIR` if set, otherwise in
+ * `$XDG_CACHE_HOME/deluge` or `$HOME/.cache/deluge`. Setting
+ * `DELUGE_CACHE_DIR` to an empty string disables the cache.
+ * The cache is best effort: errors are not reported and a corrupt entry is a
+ * cache miss.
+ */
+
+
+/*
+ * Hash `len` bytes of `data` with 64-bit FNV-1a, starting from `seed`.
+ * Start with `CACHE_HASH_SEED` then chain the result to hash many buffers.
+ */
+#define CACHE_HASH_SEED  0xcbf29ce484222325ull
+
+uint64_t cache_hash(uint64_t seed, const void *data, size_t len);
+
+/*
+ * Load the blob stored under `key`.
+ * Return `DELUGE_SUCCESS` and set `data` to a malloc'ed copy of the blob of
+ * size `len` in case of hit. Return `DELUGE_FAILURE` otherwise.
+ */
+int cache_load(const char *key, void **data, size_t *len);
+
+/*
+ * Store `len` bytes of `data` under `key`.
+ * Replace any previous blob atomically.
+ */
+void cache_store(const char *key, const void *data, size_t len);
+
+
+#endif
@@ -4,33 +4,187 @@
 #include "deluge/device.h"
 #include "deluge/error.h"
 #include "deluge/highway.h"
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 
+/*
+ * Set `*match` to whether the name of the platform `plid` contains `name`.
+ */
+static int match_platform(cl_platform_id plid, const char *name, int *match)
+{
+	cl_int clret;
+	size_t size;
+	char *str;
+	int err;
+
+	*match = 0;
+
+	clret = clGetPlatformInfo(plid, CL_PLATFORM_NAME, 0, NULL, &size);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err;
+	}
+
+	str = malloc(size + 1);
+	if (str == NULL) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	clret = clGetPlatformInfo(plid, CL_PLATFORM_NAME, size, str, NULL);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err_str;
+	}
+
+	str[size] = '\0';
+	*match = (strstr(str, name) != NULL);
+
+	free(str);
+
+	return DELUGE_SUCCESS;
+ err_str:
+	free(str);
+ err:
+	return err;
+}
+
+static unsigned int device_type_flag(cl_device_type type)
+{
+	if ((type & CL_DEVICE_TYPE_GPU) != 0)
+		return DELUGE_DEVICE_GPU;
+	if ((type & CL_DEVICE_TYPE_CPU) != 0)
+		return DELUGE_DEVICE_CPU;
+	if ((type & CL_DEVICE_TYPE_ACCELERATOR) != 0)
+		return DELUGE_DEVICE_ACCELERATOR;
+	return DELUGE_DEVICE_OTHER;
+}
+
+/*
+ * Set `*match` to whether the OpenCL device `devid` passes the filters of
+ * `options`, querying only what these filters need.
+ */
+static int match_device(cl_device_id devid,
+			const struct deluge_options *options, int *match)
+{
+	cl_device_type type;
+	cl_ulong gmem;
+	cl_int clret;
+	size_t size;
+	char *str;
+	int err;
+
+	*match = 0;
+
+	if (options->types != 0) {
+		clret = clGetDeviceInfo(devid, CL_DEVICE_TYPE, sizeof (type),
+					&type, NULL);
+		if (clret != CL_SUCCESS) {
+			err = deluge_cl_error(clret);
+			goto err;
+		}
+
+		if ((options->types & device_type_flag(type)) == 0)
+			return DELUGE_SUCCESS;
+	}
+
+	if (options->min_gmem != 0) {
+		clret = clGetDeviceInfo(devid, CL_DEVICE_GLOBAL_MEM_SIZE,
+					sizeof (gmem), &gmem, NULL);
+		if (clret != CL_SUCCESS) {
+			err = deluge_cl_error(clret);
+			goto err;
+		}
+
+		if (gmem < options->min_gmem)
+			return DELUGE_SUCCESS;
+	}
+
+	if (options->vendor != NULL) {
+		clret = clGetDeviceInfo(devid, CL_DEVICE_VENDOR, 0, NULL,
+					&size);
+		if (clret != CL_SUCCESS) {
+			err = deluge_cl_error(clret);
+			goto err;
+		}
+
+		str = malloc(size + 1);
+		if (str == NULL) {
+			err = deluge_c_error();
+			goto err;
+		}
+
+		clret = clGetDeviceInfo(devid, CL_DEVICE_VENDOR, size, str,
+					NULL);
+		if (clret != CL_SUCCESS) {
+			free(str);
+			err = deluge_cl_error(clret);
+			goto err;
+		}
+
+		str[size] = '\0';
+		if (strstr(str, options->vendor) == NULL) {
+			free(str);
+			return DELUGE_SUCCESS;
+		}
+
+		free(str);
+	}
+
+	*match = 1;
+
+	return DELUGE_SUCCESS;
+ err:
+	return err;
+}
+
+/*
+ * Initialize in `dest` the devices of the platform `plid` which pass the
+ * filters of `options`, at most `len` of them.
+ */
 static ssize_t discover_platform_devices(struct deluge *this,
 					 struct device *dest, size_t len,
-					 cl_platform_id plid)
+					 cl_platform_id plid,
+					 const struct deluge_options *options)
 {
 	cl_device_id *devids;
 	cl_uint i, ndevid;
 	cl_int clret;
 	size_t done;
-	int ret;
+	int ret, match;
+
+	clret = clGetDeviceIDs(plid, CL_DEVICE_TYPE_ALL, 0, NULL, &ndevid);
+	if (clret != CL_SUCCESS) {
+		deluge_cl_error(clret);
+		goto err;
+	}
 
-	devids = malloc(len * sizeof (*devids));
-	if (devids == NULL) {
+	/* the filters apply to every device before the first `len` are kept */
+	devids = malloc(ndevid * sizeof (*devids));
+	if ((devids == NULL) && (ndevid > 0)) {
 		deluge_c_error();
 		goto err;
 	}
 
-	clret = clGetDeviceIDs(plid, CL_DEVICE_TYPE_ALL, len, devids, &ndevid);
-	if (clret != CL_SUCCESS) {
-		deluge_cl_error(clret);
-		goto err_devids;
+	if (ndevid > 0) {
+		clret = clGetDeviceIDs(plid, CL_DEVICE_TYPE_ALL, ndevid, devids,
+				       NULL);
+		if (clret != CL_SUCCESS) {
+			deluge_cl_error(clret);
+			goto err_devids;
+		}
 	}
 
 	done = 0;
-	for (i = 0; i < ndevid; i++) {
+	for (i = 0; (i < ndevid) && (done < len); i++) {
+		ret = match_device(devids[i], options, &match);
+		if (ret != DELUGE_SUCCESS)
+			goto err_list;
+		if (!match)
+			continue;
+
 		ret = init_device(&dest[done], this, devids[i]);
 		if (ret != DELUGE_SUCCESS)
 			goto err_list;
@@ -49,35 +203,40 @@ static ssize_t discover_platform_devices(struct deluge *this,
 	return -1;
 }
 
-static int discover_devices(struct deluge *this)
+static int discover_devices(struct deluge *this,
+			    const struct deluge_options *options)
 {
 	cl_uint i, nplid, ndevid;
 	cl_platform_id *plids;
 	struct device *devs;
-	size_t len, cap;
+	size_t len, cap, left;
 	cl_int clret;
 	ssize_t ret;
-	int err;
+	int err, match;
 
 	clret = clGetPlatformIDs(0, NULL, &nplid);
-	if (clret != CL_SUCCESS) {
+	if (clret == CL_PLATFORM_NOT_FOUND_KHR) {
+		nplid = 0;      /* no OpenCL driver, use the host device only */
+	} else if (clret != CL_SUCCESS) {
 		err = deluge_cl_error(clret);
 		goto err;
 	}
 
 	plids = malloc(nplid * sizeof (*plids));
-	if (plids == NULL) {
+	if ((plids == NULL) && (nplid > 0)) {
 		err = deluge_c_error();
 		goto err;
 	}
 
-	clret = clGetPlatformIDs(nplid, plids, NULL);
-	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
-		goto err_plids;
+	if (nplid > 0) {
+		clret = clGetPlatformIDs(nplid, plids, NULL);
+		if (clret != CL_SUCCESS) {
+			err = deluge_cl_error(clret);
+			goto err_plids;
+		}
 	}
 
-	cap = 0;
+	cap = 1;       /* the host device */
 	for (i = 0; i < nplid; i++) {
 		clret = clGetDeviceIDs(plids[i], CL_DEVICE_TYPE_ALL, 0, NULL,
 				       &ndevid);
@@ -95,9 +254,24 @@ static int discover_devices(struct deluge *this)
 		goto err_plids;
 	}
 
+	left = SIZE_MAX;
+	if (options->max_devices != 0)
+		left = options->max_devices;
+
 	len = 0;
-	for (i = 0; i < nplid; i++) {
-		ret = discover_platform_devices(this, devs+len, cap, plids[i]);
+	for (i = 0; (i < nplid) && (left > 0); i++) {
+		if (options->platform != NULL) {
+			err = match_platform(plids[i], options->platform,
+					     &match);
+			if (err != DELUGE_SUCCESS)
+				goto err_list;
+			if (!match)
+				continue;
+		}
+
+		ret = discover_platform_devices(this, devs + len,
+						(cap < left) ? cap : left,
+						plids[i], options);
 
 		if (ret < 0) {
 			err = DELUGE_FAILURE;
@@ -105,9 +279,27 @@ static int discover_devices(struct deluge *this)
 		} else {
 			len += (size_t) ret;
 			cap -= (size_t) ret;
+			left -= (size_t) ret;
 		}
 	}
 
+	/*
+	 * The host device comes last so it is used when no OpenCL device
+	 * exists, or next to them once they are full.
+	 */
+	if ((options->types == 0) ||
+	    ((options->types & DELUGE_DEVICE_HOST) != 0)) {
+		err = init_host_device(&devs[len], this);
+		if (err != DELUGE_SUCCESS)
+			goto err_list;
+		len += 1;
+	}
+
+	if (len == 0) {
+		err = DELUGE_NODEV;
+		goto err_list;
+	}
+
 	this->devices = realloc(devs, len * sizeof (*devs));
 	this->ndevice = len;
 
@@ -124,11 +316,12 @@ static int discover_devices(struct deluge *this)
 	return err;
 }
 
-static int init_deluge(struct deluge *this)
+static int init_deluge(struct deluge *this,
+		       const struct deluge_options *options)
 {
 	int err;
 
-	err = discover_devices(this);
+	err = discover_devices(this, options);
 	if (err != DELUGE_SUCCESS)
 		goto err_discover;
 
@@ -166,16 +359,28 @@ void release_deluge(struct deluge *this)
 
 int deluge_create(deluge_t *deluge)
 {
+	return deluge_create_with_options(deluge, NULL);
+}
+
+int deluge_create_with_options(deluge_t *deluge,
+			       const struct deluge_options *options)
+{
+	struct deluge_options all;
 	struct deluge *this;
 	int err;
 
+	if (options == NULL) {
+		memset(&all, 0, sizeof (all));
+		options = &all;
+	}
+
 	this = malloc(sizeof (struct deluge));
 	if (this == NULL) {
 		err = deluge_c_error();
 		goto err;
 	}
 
-	err = init_deluge(this);
+	err = init_deluge(this, options);
 	if (err != DELUGE_SUCCESS)
 		goto err_this;
 
@@ -193,3 +398,67 @@ void deluge_destroy(deluge_t deluge)
 {
 	release_deluge(deluge);
 }
+
+size_t deluge_device_count(deluge_t deluge)
+{
+	return deluge->ndevice;
+}
+
+static int copy_device_string(const struct device *dev, cl_device_info param,
+			      char *dest, size_t size)
+{
+	char *str;
+
+	str = get_device_string(dev, param);
+	if (str == NULL)
+		return DELUGE_FAILURE;
+
+	strncpy(dest, str, size - 1);
+	dest[size - 1] = '\0';
+
+	free(str);
+
+	return DELUGE_SUCCESS;
+}
+
+int deluge_describe_device(deluge_t deluge, size_t idx,
+			   struct deluge_device_info *info)
+{
+	const struct device *dev;
+	int err;
+
+	if (idx >= deluge->ndevice)
+		return DELUGE_NODEV;
+
+	dev = &deluge->devices[idx];
+
+	memset(info, 0, sizeof (*info));
+	info->gmem = dev->total_gmem;
+
+	if (is_host_device(dev)) {
+		info->type = DELUGE_DEVICE_HOST;
+		strcpy(info->name, "host");
+		return DELUGE_SUCCESS;
+	}
+
+	info->type = device_type_flag(dev->devtype);
+
+	err = copy_device_string(dev, CL_DEVICE_NAME, info->name,
+				 sizeof (info->name));
+	if (err != DELUGE_SUCCESS)
+		goto err;
+
+	err = copy_device_string(dev, CL_DEVICE_VENDOR, info->vendor,
+				 sizeof (info->vendor));
+	if (err != DELUGE_SUCCESS)
+		goto err;
+
+	err = copy_device_string(dev, CL_DRIVER_VERSION, info->driver,
+				 sizeof (info->driver));
+	if (err != DELUGE_SUCCESS)
+		goto err;
+
+	return DELUGE_SUCCESS;
+ err:
+	return err;
+}
@@ -3,9 +3,16 @@
 #include "deluge/device.h"
 #include "deluge/error.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 
-#define AVPROG_HIGHWAY   0x01
+#define BUILD_NONE       0      /* states of the highway program build */
+#define BUILD_RUNNING    1
+#define BUILD_DONE       2
+#define BUILD_FAILED     3
+
+#define RATE_SHIFT       3      /* weight of a new sample is 1 / 2^shift */
 
 
 static void __debug(const char *errinfo,
@@ -47,37 +54,128 @@ int init_device(struct device *this, struct deluge *root, cl_device_id devid)
 		this->total_lmem = val;
 	}
 
-	this->ctx = clCreateContext(NULL, 1, &devid, __debug, this, &clret);
-	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
+	err = pthread_mutex_init(&this->lock, NULL);
+	if (err != 0) {
+		err = deluge_c_error();
 		goto err;
 	}
 
-	err = pthread_mutex_init(&this->lock, NULL);
+	err = pthread_cond_init(&this->built, NULL);
 	if (err != 0) {
 		err = deluge_c_error();
-		goto err_ctx;
+		goto err_lock;
 	}
 
 	this->root = root;
 	this->devid = devid;
+	this->ctx = NULL;
 	this->used_gmem = 0;
 	this->used_lmem = 0;
-	this->avprogs = 0;
+	this->hwstate = BUILD_NONE;
+	this->hwerr = DELUGE_SUCCESS;
+	this->hwlog = NULL;
+	atomic_store_uint64(&this->rate, 0);
 
 	return DELUGE_SUCCESS;
- err_ctx:
-	clReleaseContext(this->ctx);
+ err_lock:
+	pthread_mutex_destroy(&this->lock);
+ err:
+	return err;
+}
+
+int init_host_device(struct device *this, struct deluge *root)
+{
+	long pages, pagesize, nthread;
+	int err;
+
+	pages = sysconf(_SC_PHYS_PAGES);
+	pagesize = sysconf(_SC_PAGESIZE);
+	nthread = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if ((pages <= 0) || (pagesize <= 0) || (nthread <= 0)) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	err = pthread_mutex_init(&this->lock, NULL);
+	if (err != 0) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	err = pthread_cond_init(&this->built, NULL);
+	if (err != 0) {
+		err = deluge_c_error();
+		goto err_lock;
+	}
+
+	this->root = root;
+	this->devid = NULL;
+	this->ctx = NULL;
+	this->devtype = CL_DEVICE_TYPE_CPU;
+	this->total_gmem = (size_t) pages * (size_t) pagesize;
+	this->total_lmem = (size_t) nthread;
+	this->used_gmem = 0;
+	this->used_lmem = 0;
+	this->hwstate = BUILD_NONE;
+	this->hwerr = DELUGE_SUCCESS;
+	this->hwlog = NULL;
+	atomic_store_uint64(&this->rate, 0);
+
+	return DELUGE_SUCCESS;
+ err_lock:
+	pthread_mutex_destroy(&this->lock);
  err:
 	return err;
 }
 
 void finlz_device(struct device *this)
 {
-	if (has_device_highway(this))
+	if (this->hwstate == BUILD_DONE)
 		finlz_highway_program(&this->highway);
+	free(this->hwlog);
+	pthread_cond_destroy(&this->built);
 	pthread_mutex_destroy(&this->lock);
-	clReleaseContext(this->ctx);
+	if (this->ctx != NULL)
+		clReleaseContext(this->ctx);
+}
+
+int is_host_device(const struct device *this)
+{
+	return (this->devid == NULL);
+}
+
+char *get_device_string(const struct device *this, cl_device_info param)
+{
+	cl_int clret;
+	size_t size;
+	char *ret;
+
+	clret = clGetDeviceInfo(this->devid, param, 0, NULL, &size);
+	if (clret != CL_SUCCESS) {
+		deluge_cl_error(clret);
+		goto err;
+	}
+
+	ret = malloc(size + 1);
+	if (ret == NULL) {
+		deluge_c_error();
+		goto err;
+	}
+
+	clret = clGetDeviceInfo(this->devid, param, size, ret, NULL);
+	if (clret != CL_SUCCESS) {
+		deluge_cl_error(clret);
+		goto err_ret;
+	}
+
+	ret[size] = '\0';
+
+	return ret;
+ err_ret:
+	free(ret);
+ err:
+	return NULL;
 }
 
 size_t get_device_gmem(struct device *this)
@@ -138,30 +236,150 @@ void free_on_device(struct device *this, size_t gmem, size_t lmem)
 	pthread_mutex_unlock(&this->lock);
 }
 
-int has_device_highway(const struct device *this)
+void update_device_rate(struct device *this, uint64_t nelem, uint64_t nsec)
+{
+	uint64_t old, new, sample;
+
+	if (nsec == 0)
+		nsec = 1;
+
+	sample = (uint64_t) (((unsigned __int128) nelem * 1000000000) / nsec);
+	if (sample == 0)
+		sample = 1;
+
+	old = atomic_load_uint64(&this->rate);
+
+	do {
+		if (old == 0)
+			new = sample;
+		else
+			new = old - (old >> RATE_SHIFT) + (sample >> RATE_SHIFT);
+	} while (!atomic_cas_uint64(&this->rate, &old, new));
+}
+
+uint64_t get_device_rate(struct device *this)
 {
-	return ((this->avprogs & AVPROG_HIGHWAY) != 0);
+	return atomic_load_uint64(&this->rate);
 }
 
-static void set_device_highway(struct device *this)
+int has_device_highway(struct device *this)
 {
-	this->avprogs |= AVPROG_HIGHWAY;
+	int ret;
+
+	pthread_mutex_lock(&this->lock);
+	ret = (this->hwstate == BUILD_DONE);
+	pthread_mutex_unlock(&this->lock);
+
+	return ret;
 }
 
-int init_device_highway(struct device *this)
+/*
+ * The OpenCL context is created by the first program built on the device, so
+ * the devices a process never uses cost no context.
+ */
+static int init_device_context(struct device *this)
 {
-	int err;
+	cl_int clret;
 
-	if (has_device_highway(this))
+	if (is_host_device(this) || (this->ctx != NULL))
 		return DELUGE_SUCCESS;
 
-	err = init_highway_program(&this->highway, this);
+	this->ctx = clCreateContext(NULL, 1, &this->devid, __debug, this,
+				    &clret);
+	if (clret != CL_SUCCESS) {
+		this->ctx = NULL;
+		return deluge_cl_error(clret);
+	}
+
+	return DELUGE_SUCCESS;
+}
+
+static int build_device_highway(struct device *this)
+{
+	int err;
+
+	err = init_device_context(this);
 	if (err != DELUGE_SUCCESS)
-		goto err;
+		return err;
 
-	set_device_highway(this);
+	return init_highway_program(&this->highway, this);
+}
+
+static void end_device_highway(struct device *this, int err, char *log)
+{
+	pthread_mutex_lock(&this->lock);
+	this->hwstate = (err == DELUGE_SUCCESS) ? BUILD_DONE : BUILD_FAILED;
+	this->hwerr = err;
+	free(this->hwlog);
+	this->hwlog = log;
+	pthread_cond_broadcast(&this->built);
+	pthread_mutex_unlock(&this->lock);
+}
+
+static void *build_device_main(void *uthis)
+{
+	struct device *this = uthis;
+	struct deluge *root = this->root;
+	int err;
+
+	/* the errors go to the threads waiting for the build */
+	deluge_capture_errors();
+	err = build_device_highway(this);
+	end_device_highway(this, err, deluge_release_errors());
+
+	/* may free the device */
+	release_deluge(root);
+
+	return NULL;
+}
+
+void start_device_highway(struct device *this)
+{
+	pthread_t thread;
+
+	pthread_mutex_lock(&this->lock);
+	if ((this->hwstate == BUILD_RUNNING) || (this->hwstate == BUILD_DONE)) {
+		pthread_mutex_unlock(&this->lock);
+		return;
+	}
+	this->hwstate = BUILD_RUNNING;
+	pthread_mutex_unlock(&this->lock);
+
+	/* the host device has nothing to compile */
+	if (!is_host_device(this)) {
+		retain_deluge(this->root);
+		if (pthread_create(&thread, NULL, build_device_main,
+				   this) == 0) {
+			pthread_detach(thread);
+			return;
+		}
+		release_deluge(this->root);
+	}
+
+	/* a build which cannot have a thread runs from here */
+	end_device_highway(this, build_device_highway(this), NULL);
+}
+
+int wait_device_highway(struct device *this)
+{
+	int err;
+
+	pthread_mutex_lock(&this->lock);
+
+	if (this->hwstate == BUILD_NONE) {
+		pthread_mutex_unlock(&this->lock);
+		start_device_highway(this);
+		pthread_mutex_lock(&this->lock);
+	}
+
+	while (this->hwstate == BUILD_RUNNING)
+		pthread_cond_wait(&this->built, &this->lock);
+
+	err = this->hwerr;
+	if ((err != DELUGE_SUCCESS) && (this->hwlog != NULL))
+		deluge_raise_errors(this->hwlog);
+
+	pthread_mutex_unlock(&this->lock);
 
-	return DELUGE_SUCCESS;
- err:
 	return err;
 }
@@ -2,6 +2,7 @@
 #define _DELUGE_DEVICE_H_
 
 
+#include "deluge/atomic.h"
 #include "deluge/highway.h"
 #include "deluge/opencl.h"
 #include <pthread.h>
@@ -19,17 +20,36 @@ struct device
 	size_t total_gmem;
 	size_t total_lmem;
 	pthread_mutex_t lock;
+	pthread_cond_t built;   /* signaled when the highway build ends */
 	size_t used_gmem;
 	size_t used_lmem;
-	uint8_t avprogs;
+	int hwstate;            /* of the highway build, protected by lock */
+	int hwerr;              /* of the last highway build */
+	char *hwlog;            /* errors of the last background build */
 	struct highway_program highway;
+	atomic_uint64_t rate;   /* elements per second of one station */
 };
 
 int init_device(struct device *this, struct deluge *parent, 
 		cl_device_id devid);
 
+/*
+ * Initialize the host device.
+ * The host device runs the compute stations on CPU threads, without OpenCL.
+ * Its local memory counts the hardware threads available to the stations.
+ */
+int init_host_device(struct device *this, struct deluge *parent);
+
 void finlz_device(struct device *this);
 
+int is_host_device(const struct device *this);
+
+/*
+ * Get an OpenCL device information string.
+ * Return a malloc'ed string or `NULL` in case of error.
+ */
+char *get_device_string(const struct device *this, cl_device_info param);
+
 
 size_t get_device_gmem(struct device *this);
 
@@ -40,9 +60,37 @@ int alloc_on_device(struct device *this, size_t gmem, size_t lmem);
 void free_on_device(struct device *this, size_t gmem, size_t lmem);
 
 
-int has_device_highway(const struct device *this);
-
-int init_device_highway(struct device *this);
+/*
+ * Account `nelem` elements hashed by one station in `nsec` nanoseconds in the
+ * moving average of the device throughput.
+ */
+void update_device_rate(struct device *this, uint64_t nelem, uint64_t nsec);
+
+/*
+ * Get the throughput of one station of the device in elements per second, or
+ * `0` if it has not been measured yet.
+ */
+uint64_t get_device_rate(struct device *this);
+
+
+/*
+ * Get whether the highway program of the device is built, without waiting.
+ */
+int has_device_highway(struct device *this);
+
+/*
+ * Start building the highway program of the device on a thread of its own,
+ * unless it is built or being built. A failed build starts again.
+ */
+void start_device_highway(struct device *this);
+
+/*
+ * Wait for the highway program of the device, building it from this thread
+ * if nobody started it.
+ * Return the status of the build, whose errors are reported again from this
+ * thread if it failed in the background.
+ */
+int wait_device_highway(struct device *this);
 
 
 #endif
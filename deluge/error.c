@@ -7,10 +7,25 @@
 
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 
+/*
+ * The errors of the calling thread while it captures them.
+ */
+static __thread FILE *capture = NULL;
+static __thread char *capture_buf = NULL;
+static __thread size_t capture_size = 0;
+
+
+static FILE *error_output(void)
+{
+	return (capture != NULL) ? capture : stderr;
+}
+
+
 static void print_error_log(const char *srcname, cl_program prog,
 			    cl_device_id devid)
 {
@@ -44,7 +59,7 @@ static void print_error_log(const char *srcname, cl_program prog,
 
         buf[size] = '\0';
 
-	fprintf(stderr, "%s: %s", srcname, buf);
+	fprintf(error_output(), "%s: %s", srcname, buf);
 
 	free(buf);
 }
@@ -52,13 +67,14 @@ static void print_error_log(const char *srcname, cl_program prog,
 
 int __deluge_c_error(const char *filename, int linenum)
 {
-	fprintf(stderr, "%s:%d: %s\n", filename, linenum, strerror(errno));
+	fprintf(error_output(), "%s:%d: %s\n", filename, linenum,
+		strerror(errno));
 	return DELUGE_FAILURE;
 }
 
 int __deluge_cl_error(const char *filename, int linenum, cl_int clret)
 {
-	fprintf(stderr, "%s:%d: %s\n", filename, linenum,
+	fprintf(error_output(), "%s:%d: %s\n", filename, linenum,
 		opencl_errstr(clret));
 	return DELUGE_FAILURE;
 }
@@ -67,7 +83,7 @@ int __deluge_cl_compile_error(const char *filename, int linenum, cl_int clret,
 			      const char *srcname, cl_program prog,
 			      cl_device_id devid)
 {
-	fprintf(stderr, "%s:%d: %s\n", filename, linenum,
+	fprintf(error_output(), "%s:%d: %s\n", filename, linenum,
 		opencl_errstr(clret));
 	if (clret == CL_COMPILE_PROGRAM_FAILURE)
 		print_error_log(srcname, prog, devid);
@@ -82,13 +98,50 @@ int __deluge_cl_link_error(const char *filename, int linenum, cl_int clret,
 			   size_t nsrc __attribute__ ((unused)),
 			   cl_device_id devid)
 {
-	fprintf(stderr, "%s:%d: %s\n", filename, linenum,
+	fprintf(error_output(), "%s:%d: %s\n", filename, linenum,
 		opencl_errstr(clret));
 	if (clret == CL_LINK_PROGRAM_FAILURE)
 		print_error_log(srcnames[0], prog, devid);
 	return DELUGE_FAILURE;
 }
 
+void deluge_capture_errors(void)
+{
+	if (capture != NULL)
+		return;
+
+	/* the errors are printed as usual if they cannot be kept */
+	capture = open_memstream(&capture_buf, &capture_size);
+}
+
+char *deluge_release_errors(void)
+{
+	char *ret;
+
+	if (capture == NULL)
+		return NULL;
+
+	fclose(capture);
+	capture = NULL;
+
+	ret = capture_buf;
+	capture_buf = NULL;
+
+	if ((ret != NULL) && (capture_size == 0)) {
+		free(ret);
+		ret = NULL;
+	}
+
+	return ret;
+}
+
+int deluge_raise_errors(const char *log)
+{
+	if (log != NULL)
+		fputs(log, error_output());
+	return DELUGE_FAILURE;
+}
+
 
 #else
 
@@ -128,5 +181,19 @@ int __deluge_cl_link_error(const char *filename __attribute__ ((unused)),
 	return DELUGE_FAILURE;
 }
 
+void deluge_capture_errors(void)
+{
+}
+
+char *deluge_release_errors(void)
+{
+	return NULL;
+}
+
+int deluge_raise_errors(const char *log __attribute__ ((unused)))
+{
+	return DELUGE_FAILURE;
+}
+
 
 #endif
@@ -33,4 +33,23 @@ int __deluge_cl_link_error(const char *filename, int linenum, cl_int clret,
 			   cl_program *srcs, size_t nsrc, cl_device_id devid);
 
 
+/*
+ * Keep the errors of the calling thread in memory instead of printing them,
+ * so a thread working for another one can hand its errors over.
+ */
+void deluge_capture_errors(void);
+
+/*
+ * Stop capturing the errors of the calling thread.
+ * Return them as a malloc'ed string, or `NULL` if there was none.
+ */
+char *deluge_release_errors(void);
+
+/*
+ * Report from the calling thread the errors `log` captured by another one.
+ * Return `DELUGE_FAILURE`.
+ */
+int deluge_raise_errors(const char *log);
+
+
 #endif
@@ -1,21 +1,60 @@
 #include <deluge.h>
+#include "deluge/cache.h"
 #include "deluge/deluge.h"
 #include "deluge/device.h"
 #include "deluge/error.h"
 #include "deluge/highway.h"
+#include "deluge/host.h"
+#include "deluge/lfqueue.h"
 #include "deluge/list.h"
 #include "deluge/opencl.h"
+#include "deluge/ring.h"
 #include "deluge/uint.h"
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 
 #define ARRAY_SIZE(_arr)  (sizeof (_arr) / sizeof (*(_arr)))
 
 #define COMPILE_OPTIONS   "-Werror -cl-std=CL3.0"
+#define SUBGROUP_OPTIONS  COMPILE_OPTIONS " -DSUBGROUP_REDUCE"
 
 #define HASHSUM_KNAME     "hash_sum"
 #define HASHSUM_MAXLEN    (1ul << 18)
+#define HASHSUM_INSIZE    (HASHSUM_MAXLEN * sizeof (uint64_t))
+
+#define HASHBYTES_KNAME   "hash_sum_bytes"
+
+#define HASHBATCH_KNAME   "hash_sum_batch"
+#define HASHBATCH_MAXSET  1024  /* sets of a job, any output holds their sums */
+
+#define REDUCE_KNAME      "reduce_sum"
+
+#define HASHKEYS_KNAME    "hash_sum_keys"
+#define KEYS_MAX          64    /* states fit any constant buffer */
+
+#define ACCUMULATE_KNAME  "accumulate_sum"
+
+#define DEFAULT_DEPTH     2
+
+#define RESULT_RING_SIZE  1024
+
+#define JOB_ALIGN         64    /* cache line */
+#define JOB_STRIDE        ((sizeof (struct job) + JOB_ALIGN - 1) & \
+			   ~(JOB_ALIGN - 1))
+#define JOBS_PER_SLOT     16    /* pool growth per allocated slot */
+#define JOB_CACHE_SIZE    31
+#define JOB_NCACHE        64    /* threads with a job cache */
+
+#define SLICE_MINLEN      4096  /* shorter slices cost more than they save */
+
+#define TUNE_WG_MIN       32    /* smallest work-group size tried */
+#define TUNE_WI_NELEM_MAX 32    /* most elements per work-item tried */
+#define TUNE_ROUNDS       3     /* timed launches of each pair */
 
 
 struct __source
@@ -25,44 +64,250 @@ struct __source
 	const char *end;
 };
 
-struct station
+/*
+ * A slot input buffer lent to the user.
+ * The `elems` mapping is valid from the acquisition of the buffer until its
+ * submission or release.
+ */
+struct deluge_highway_buffer
 {
-	struct highway_program  *prog;
-	cl_command_queue         queue;
-	cl_kernel                hashsum;
-	cl_mem                   initial;
+	struct slot             *slot;
+	struct job              *job;
+	uint64_t                *elems;
+};
+
+/*
+ * A set of buffers holding one job of a station.
+ * A station has as many slots as jobs in its pipeline.
+ */
+struct slot
+{
+	struct station          *station;
+	cl_kernel                hashsum[HIGHWAY_NWIDTH]; /* built on demand */
+	cl_kernel                hashbytes;
+	cl_kernel                hashbatch;
+	cl_kernel                hashkeys;
+	cl_kernel                reduce;
+	cl_kernel                accumulate;
 	cl_mem                   input;
 	cl_mem                   output;
-	uint320_t               *partsums;
+	uint320_t                sum;
+	uint64_t               (*ksums)[5]; /* of a `JOB_KEYS` job */
+	uint64_t                *hostbuf;   /* host device only */
+	struct deluge_highway_buffer buffer;
+	struct lf_qnode         *qnode;     /* owned while not free */
+};
+
+/*
+ * The default width hash sum kernel of a program built for a single key.
+ */
+struct highway_keyed
+{
+	struct list      list;
+	uint64_t         key[4];
+	cl_program       prog;     /* `NULL` if it does not fit the slots */
+};
+
+/*
+ * A compute station pipelines the jobs of its slots.
+ * The input upload, the kernel and the output readback of a job are enqueued
+ * on three in-order queues, chained with events, so the transfers of a job
+ * overlap with the kernel of another.
+ */
+struct station
+{
+	struct highway_program  *prog;
+	cl_program               keyed;     /* default width, `NULL` if none */
+	cl_command_queue         upload;
+	cl_command_queue         compute;
+	cl_command_queue         readback;
+	cl_mem                   initial;   /* states of every width and key */
+	size_t                   nkey;
+	size_t                   depth;
+	struct slot             *slots;
 	struct list              stqueue;
+	atomic_uint64_t          done;      /* completion time of the last job */
+	void                   (*profiler)(const struct deluge_highway_profile *,
+					   void *);
+	void                    *profiler_user;
+	struct host_worker       worker;    /* host device only */
+	highway_t               *states;    /* host device only */
+};
+
+enum job_kind
+{
+	JOB_WORDS,              /* fixed size elements */
+	JOB_BYTES,              /* byte strings */
+	JOB_BATCH,              /* sets of elements summed apart */
+	JOB_KEYS,               /* fixed size elements under every key */
 };
 
 struct job
 {
-	const uint64_t *input;
+	enum job_kind kind;
+	size_t width;           /* width of the elements or strings state */
+	const void *input;      /* elements or string offsets */
+	const uint8_t *bytes;   /* strings of a `JOB_BYTES` job */
 	size_t ninput;
-	size_t npart;
+	const void *removed;    /* elements subtracted from the sum */
+	size_t nremoved;
+	struct deluge_highway_set *sets;  /* of a `JOB_BATCH` job */
+	uint320_t *sums;        /* one per set of a `JOB_BATCH` job */
 	void *user;
 	void (*cb)(int, uint64_t[5], void *);
+	void (*kcb)(int, uint64_t (*)[5], void *);  /* of a `JOB_KEYS` job */
+	struct stream_chunk *chunk;  /* of a streamed job */
 	struct list queue;
 	struct deluge_highway *dispatch;
-	struct station *station;
+	struct slot *slot;
+	struct dispatch_device *target;   /* device to run on if it is idle */
+	uint64_t start;         /* launch time in nanoseconds */
+	int mapped;             /* input is the mapped slot buffer */
+	int status;             /* failure of a partly launched job */
+	struct lf_qnode *qnode; /* owned while not queued */
+	struct lf_node pool;    /* in the dispatcher pool */
 	cl_event wrev;
+	cl_event hsev;          /* hash kernel before a reduce */
 	cl_event exev;
 	cl_event rdev;
+	struct host_task task;
+};
+
+/*
+ * The running sum of a stream on one device, left in device memory.
+ */
+struct stream_device
+{
+	cl_mem            acc;      /* `NULL` until a job runs on the device */
+	cl_event          last;     /* last addition to `acc` */
+};
+
+/*
+ * A stream adds the sums of its jobs to a running sum on the device which ran
+ * them, so that the sums are only read back by a snapshot. The jobs of the
+ * host device add to `sum` instead.
+ */
+struct deluge_highway_stream
+{
+	struct deluge_highway  *dispatch;
+	pthread_mutex_t         lock;
+	pthread_cond_t          cond;
+	size_t                  pending;  /* jobs not completed */
+	int                     status;   /* first failure */
+	uint320_t               sum;
+	struct stream_device   *devs;     /* one per device of the root */
+};
+
+/*
+ * An appended chunk, split in `pending` jobs.
+ */
+struct stream_chunk
+{
+	struct deluge_highway_stream *stream;
+	size_t pending;         /* protected by the stream lock */
+	int status;
+	void *user;
+	void (*cb)(int, void *);
+};
+
+struct merge
+{
+	struct deluge_highway *dispatch;
+	pthread_mutex_t lock;
+	size_t pending;
+	int status;
+	uint320_t sum;
+	uint64_t (*ksums)[5];   /* of the slices of a `JOB_KEYS` job */
+	size_t nkey;
+	void *user;
+	void (*cb)(int, uint64_t[5], void *);
+	void (*kcb)(int, uint64_t (*)[5], void *);
+};
+
+/*
+ * A chunk of jobs, each `JOB_STRIDE` bytes after the previous one.
+ */
+struct job_slab
+{
+	struct job_slab  *next;
+};
+
+/*
+ * The free jobs kept by one thread, used without synchronization.
+ */
+struct job_cache
+{
+	size_t            njob;
+	struct job       *jobs[JOB_CACHE_SIZE];
+} __attribute__ ((aligned (JOB_ALIGN)));
+
+/*
+ * The free slots of the stations of one device.
+ */
+struct dispatch_device
+{
+	struct device    *dev;
+	struct lf_queue   freeslots;
+	atomic_uint64_t   nstation;
 };
 
+/*
+ * The dispatcher hands the free slots to the jobs without lock.
+ * The `balance` is the number of free slots minus the number of queued jobs.
+ * A job which decrements it from a positive value owns a free slot, otherwise
+ * it queues. A slot which increments it from a negative value owns a queued
+ * job, otherwise it becomes free. The owner of a slot or job may briefly wait
+ * for it to be pushed by the thread which counted it.
+ */
 struct deluge_highway
 {
 	struct deluge    *root;
-	uint64_t          key[4];
-	pthread_mutex_t   qlock;
-	int               stopping;
-	struct list       stidle;
-	struct list       stbusy;
-	struct list       jobqueue;
+	uint64_t        (*keys)[4];
+	size_t            nkey;
+	pthread_mutex_t   lock;      /* protects the new stations settings */
+	size_t            depth;     /* depth of the new stations */
+	int               specialized; /* new stations use a keyed program */
+	unsigned int      widths;    /* scheduled, built by the new stations */
+	void            (*profiler)(const struct deluge_highway_profile *,
+				    void *);  /* of the new stations */
+	void             *profiler_user;
+	struct list       stations;
+	atomic_uint64_t   stopping;
+	atomic_uint64_t   refcnt;    /* busy slots, plus one until destroyed */
+	atomic_uint64_t   balance;   /* signed */
+	struct dispatch_device *devs;  /* one per device of the root */
+	atomic_uint64_t   maxlens[HIGHWAY_NWIDTH]; /* `0` to size again */
+	struct lf_queue   jobqueue;
+	struct ring       results;   /* of the jobs without callback */
+	struct lf_stack   jobpool;
+	struct job_slab  *slabs;     /* protected by lock */
+	struct job_cache  caches[JOB_NCACHE];
 };
 
+/*
+ * Index of the job cache of the current thread in every dispatcher, from 1,
+ * or above `JOB_NCACHE` if the thread has none.
+ * An index goes back to `free_indexes` when its thread exits, along with the
+ * jobs its caches still hold, so that the threads of a pool restarting its
+ * workers keep having caches.
+ */
+static __thread uint64_t thread_index;
+
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+static pthread_key_t index_key;
+static int index_key_valid;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t free_indexes[JOB_NCACHE];  /* protected by index_lock */
+static size_t nfree_index;                 /* protected by index_lock */
+static uint64_t nthread;                   /* protected by index_lock */
+
+
+static struct dispatch_device *get_dispatch_device(struct deluge_highway *this,
+						   const struct device *dev)
+{
+	return &this->devs[dev - this->root->devices];
+}
+
 
 extern const char _binary_deluge_highway_cl_start[];
 extern const char _binary_deluge_highway_cl_end[];
@@ -112,7 +357,11 @@ static const struct __source __sources[] = {
 };
 
 
-static void release_station(struct deluge_highway *this, struct station *s);
+static void release_slot(struct deluge_highway *this, struct slot *slot);
+static struct job *take_job(struct deluge_highway *this);
+static void put_dispatch(struct deluge_highway *this);
+static void merge_slice(int status, uint64_t result[5], void *umerge);
+static void merge_keys_slice(int status, uint64_t (*sums)[5], void *umerge);
 
 
 static int init_source(struct device *dev, const char **ns, cl_program *ps,
@@ -135,48 +384,275 @@ static int init_source(struct device *dev, const char **ns, cl_program *ps,
 	return DELUGE_SUCCESS;
 }
 
-static int init_program_cost(struct highway_program *this)
+static int get_kernel_wg_size(cl_program prog, struct device *dev,
+			      const char *kname, size_t *wg_size)
 {
-	cl_kernel hashsum;
+	cl_kernel kern;
 	cl_int clret;
 	int err;
 
-	hashsum = clCreateKernel(this->prog, HASHSUM_KNAME, &clret);
+	kern = clCreateKernel(prog, kname, &clret);
 	if (clret != CL_SUCCESS) {
 		err = deluge_cl_error(clret);
 		goto err;
 	}
 
-	this->hashsum_wg_size = 0;
+	*wg_size = 0;
 
-	clret = clGetKernelWorkGroupInfo(hashsum, this->dev->devid,
+	clret = clGetKernelWorkGroupInfo(kern, dev->devid,
 					 CL_KERNEL_WORK_GROUP_SIZE,
-					 sizeof (this->hashsum_wg_size),
-					 &this->hashsum_wg_size, NULL);
+					 sizeof (*wg_size), wg_size, NULL);
 	if (clret != CL_SUCCESS) {
 		err = deluge_cl_error(clret);
-		goto err_hashsum;
+		goto err_kernel;
 	}
 
-	this->hashsum_wg_max = HASHSUM_MAXLEN / this->hashsum_wg_size;
-	if ((this->hashsum_wg_max * this->hashsum_wg_size) < HASHSUM_MAXLEN)
-		this->hashsum_wg_max += 1;
-
-	this->hashsum_gmem_input_size = HASHSUM_MAXLEN * sizeof (uint64_t);
-	this->hashsum_gmem_output_size =
-		this->hashsum_wg_max * sizeof (uint320_t);
-	this->hashsum_lmem_size = this->hashsum_wg_size * sizeof (uint320_t);
-
-	clReleaseKernel(hashsum);
+	clReleaseKernel(kern);
 
 	return DELUGE_SUCCESS;
- err_hashsum:
-	clReleaseKernel(hashsum);
+ err_kernel:
+	clReleaseKernel(kern);
  err:
 	return err;
 }
 
-int init_highway_program(struct highway_program *this, struct device *dev)
+/*
+ * Number of partial sums the reduction of `kern` keeps in local memory for a
+ * work-group of `wg_size` work-items: one per work-item or one per sub-group.
+ */
+static size_t get_lmem_count(const struct highway_program *this,
+			     cl_kernel kern, size_t wg_size)
+{
+	cl_int clret;
+	size_t ret;
+
+	if (!this->subgroups)
+		return wg_size;
+
+	clret = clGetKernelSubGroupInfo(kern, this->dev->devid,
+					CL_KERNEL_SUB_GROUP_COUNT_FOR_NDRANGE,
+					sizeof (wg_size), &wg_size,
+					sizeof (ret), &ret, NULL);
+	if (clret != CL_SUCCESS)
+		return wg_size;    /* there are never more sub-groups */
+
+	return ret;
+}
+
+static int get_kernel_lmem_count(const struct highway_program *this,
+				 const char *kname, size_t wg_size,
+				 size_t *count)
+{
+	cl_kernel kern;
+	cl_int clret;
+
+	*count = 0;
+
+	kern = clCreateKernel(this->prog, kname, &clret);
+	if (clret != CL_SUCCESS)
+		return deluge_cl_error(clret);
+
+	*count = get_lmem_count(this, kern, wg_size);
+
+	clReleaseKernel(kern);
+
+	return DELUGE_SUCCESS;
+}
+
+/*
+ * Shrink `wg_size` until the hash sum kernel of `prog` reduces in the local
+ * memory of a slot.
+ */
+static size_t fit_lmem_wg_size(const struct highway_program *this,
+			       cl_program prog, size_t wg_size)
+{
+	size_t lmem_count = this->hashsum_lmem_size / sizeof (uint320_t);
+	cl_kernel kern;
+	cl_int clret;
+
+	if (!this->subgroups)
+		goto clamp;
+
+	kern = clCreateKernel(prog, HASHSUM_KNAME, &clret);
+	if (clret != CL_SUCCESS)
+		goto clamp;
+
+	while ((wg_size > lmem_count) &&
+	       (get_lmem_count(this, kern, wg_size) > lmem_count))
+		wg_size /= 2;
+
+	clReleaseKernel(kern);
+
+	return wg_size;
+ clamp:
+	if (wg_size > lmem_count)
+		wg_size = lmem_count;
+	return wg_size;
+}
+
+static size_t get_wg_max(size_t wg_size)
+{
+	size_t ret;
+
+	ret = HASHSUM_MAXLEN / wg_size;
+	if ((ret * wg_size) < HASHSUM_MAXLEN)
+		ret += 1;
+
+	return ret;
+}
+
+/*
+ * Set the work-group size and the job length of a variant.
+ * The slot buffers are sized by the default variant, so a variant with
+ * smaller work-groups holds less elements per job.
+ */
+static void init_variant_cost(const struct highway_program *this,
+			      struct highway_variant *variant, size_t width,
+			      size_t wg_size, size_t wi_nelem)
+{
+	size_t maxlen;
+
+	wg_size = fit_lmem_wg_size(this, variant->prog, wg_size);
+
+	maxlen = HASHSUM_INSIZE / HIGHWAY_WIDTH_SIZE(width);
+	if (maxlen > HASHSUM_MAXLEN)
+		maxlen = HASHSUM_MAXLEN;
+	if (maxlen > (this->hashsum_wg_max * wg_size * wi_nelem))
+		maxlen = this->hashsum_wg_max * wg_size * wi_nelem;
+
+	variant->wg_size = wg_size;
+	variant->wi_nelem = wi_nelem;
+	variant->maxlen = maxlen;
+}
+
+/*
+ * The kernels of a slot share its buffers which are sized for the most
+ * demanding of them. A job of byte strings holds less than `HASHSUM_MAXLEN`
+ * strings since their offsets alone fill the input buffer.
+ */
+static int init_program_cost(struct highway_program *this)
+{
+	const char *knames[] = {
+		HASHSUM_KNAME, HASHBYTES_KNAME, HASHBATCH_KNAME, REDUCE_KNAME,
+		HASHKEYS_KNAME
+	};
+	size_t wg_size, wg_max, count, lmem_count, i;
+	size_t wg_sizes[ARRAY_SIZE(knames)];
+	int err;
+
+	err = get_kernel_wg_size(this->prog, this->dev, HASHSUM_KNAME,
+				 &this->hashsum_wg_size);
+	if (err != DELUGE_SUCCESS)
+		return err;
+
+	err = get_kernel_wg_size(this->prog, this->dev, HASHBYTES_KNAME,
+				 &this->hashbytes_wg_size);
+	if (err != DELUGE_SUCCESS)
+		return err;
+
+	err = get_kernel_wg_size(this->prog, this->dev, HASHBATCH_KNAME,
+				 &this->hashbatch_wg_size);
+	if (err != DELUGE_SUCCESS)
+		return err;
+
+	err = get_kernel_wg_size(this->prog, this->dev, REDUCE_KNAME,
+				 &this->reduce_wg_size);
+	if (err != DELUGE_SUCCESS)
+		return err;
+
+	err = get_kernel_wg_size(this->prog, this->dev, HASHKEYS_KNAME,
+				 &this->hashkeys_wg_size);
+	if (err != DELUGE_SUCCESS)
+		return err;
+
+	this->hashsum_wg_max = get_wg_max(this->hashsum_wg_size);
+	this->hashbytes_wg_max = get_wg_max(this->hashbytes_wg_size);
+
+	wg_size = this->hashsum_wg_size;
+	if (this->hashbytes_wg_size > wg_size)
+		wg_size = this->hashbytes_wg_size;
+	if (this->hashbatch_wg_size > wg_size)
+		wg_size = this->hashbatch_wg_size;
+	if (this->hashkeys_wg_size > wg_size)
+		wg_size = this->hashkeys_wg_size;
+
+	wg_max = this->hashsum_wg_max;
+	if (this->hashbytes_wg_max > wg_max)
+		wg_max = this->hashbytes_wg_max;
+
+	if (this->reduce_wg_size > wg_size)
+		this->reduce_wg_size = wg_size;
+
+	wg_sizes[0] = this->hashsum_wg_size;
+	wg_sizes[1] = this->hashbytes_wg_size;
+	wg_sizes[2] = this->hashbatch_wg_size;
+	wg_sizes[3] = this->reduce_wg_size;
+	wg_sizes[4] = this->hashkeys_wg_size;
+
+	lmem_count = 1;
+
+	for (i = 0; i < ARRAY_SIZE(knames); i++) {
+		err = get_kernel_lmem_count(this, knames[i], wg_sizes[i],
+					    &count);
+		if (err != DELUGE_SUCCESS)
+			return err;
+		if (count > lmem_count)
+			lmem_count = count;
+	}
+
+	/* the output holds a sum per set of a batch job too */
+	if (wg_max < HASHBATCH_MAXSET)
+		wg_max = HASHBATCH_MAXSET;
+
+	this->hashsum_gmem_input_size = HASHSUM_INSIZE;
+	this->hashsum_gmem_output_size = wg_max * sizeof (uint320_t);
+	this->hashsum_lmem_size = lmem_count * sizeof (uint320_t);
+
+	return DELUGE_SUCCESS;
+}
+
+/*
+ * The host stations hash straight from the caller memory and only need room
+ * for their result. Each of them occupies one hardware thread, which the host
+ * device accounts as local memory.
+ */
+static int init_host_program(struct highway_program *this, struct device *dev)
+{
+	struct highway_variant *variant;
+	size_t w;
+
+	this->dev = dev;
+	this->prog = NULL;
+	this->options = NULL;
+	list_init(&this->keyed);
+	this->subgroups = 0;
+	this->hashsum_wg_size = 1;
+	this->hashsum_wg_max = 1;
+	this->hashbytes_wg_size = 1;
+	this->hashbytes_wg_max = 1;
+	this->hashbatch_wg_size = 1;
+	this->hashkeys_wg_size = 1;
+	this->reduce_wg_size = 1;
+	this->hashsum_gmem_input_size = 0;
+	this->hashsum_gmem_output_size = sizeof (uint320_t);
+	this->hashsum_lmem_size = 1;
+
+	for (w = 0; w < HIGHWAY_NWIDTH; w++) {
+		variant = &this->variants[w];
+		variant->prog = NULL;
+		variant->wg_size = 1;
+		variant->wi_nelem = 1;
+		variant->maxlen = HASHSUM_INSIZE / HIGHWAY_WIDTH_SIZE(w);
+		if (variant->maxlen > HASHSUM_MAXLEN)
+			variant->maxlen = HASHSUM_MAXLEN;
+		atomic_store_uint64(&variant->ready, 1);
+	}
+
+	return DELUGE_SUCCESS;
+}
+
+static int build_program(cl_program *prog, struct device *dev,
+			 const char *options)
 {
 	const char *header_names[ARRAY_SIZE(__headers)];
 	const char *source_names[ARRAY_SIZE(__sources)];
@@ -202,7 +678,7 @@ int init_highway_program(struct highway_program *this, struct device *dev)
 
 	for (i = 0; i < ARRAY_SIZE(sources); i++) {
 		clret = clCompileProgram(sources[i], 1, &dev->devid,
-					 COMPILE_OPTIONS, ARRAY_SIZE(headers),
+					 options, ARRAY_SIZE(headers),
 					 headers, header_names, NULL, NULL);
 		if (clret != CL_SUCCESS) {
 			err = deluge_cl_compile_error(clret, source_names[i],
@@ -211,30 +687,22 @@ int init_highway_program(struct highway_program *this, struct device *dev)
 		}
 	}
 
-	this->prog = clLinkProgram(dev->ctx, 1, &dev->devid, NULL,
-				   ARRAY_SIZE(sources), sources, NULL, NULL,
-				   &clret);
+	*prog = clLinkProgram(dev->ctx, 1, &dev->devid, NULL,
+			      ARRAY_SIZE(sources), sources, NULL, NULL,
+			      &clret);
 	if (clret != CL_SUCCESS) {
-		err = deluge_cl_link_error(clret, this->prog, source_names,
+		err = deluge_cl_link_error(clret, *prog, source_names,
 					   sources, ARRAY_SIZE(sources),
 					   dev->devid);
 		goto err_all_sources;
 	}
 
-	this->dev = dev;
-
-	err = init_program_cost(this);
-	if (err != DELUGE_SUCCESS)
-		goto err_prog;
-
 	for (i = 0; i < ARRAY_SIZE(sources); i++)
 		clReleaseProgram(sources[i]);
 	for (i = 0; i < ARRAY_SIZE(headers); i++)
 		clReleaseProgram(headers[i]);
 
 	return DELUGE_SUCCESS;
- err_prog:
-	clReleaseProgram(this->prog);
  err_all_sources:
 	i = ARRAY_SIZE(__sources);
  err_sources:
@@ -247,573 +715,3915 @@ int init_highway_program(struct highway_program *this, struct device *dev)
 	return err;
 }
 
-void finlz_highway_program(struct highway_program *this)
+/*
+ * Get the key of the program binary in the persistent cache.
+ * A binary depends on the device, its driver, the compile options and the
+ * embedded sources.
+ * Return a malloc'ed string or `NULL` if the program cannot be cached.
+ */
+static char *get_program_key(struct device *dev, const char *options)
 {
-	clReleaseProgram(this->prog);
+	char *name, *driver, *key;
+	uint64_t srchash;
+	size_t i, len;
+
+	srchash = CACHE_HASH_SEED;
+	for (i = 0; i < ARRAY_SIZE(__headers); i++)
+		srchash = cache_hash(srchash, __headers[i].start,
+				     __headers[i].end - __headers[i].start);
+	for (i = 0; i < ARRAY_SIZE(__sources); i++)
+		srchash = cache_hash(srchash, __sources[i].start,
+				     __sources[i].end - __sources[i].start);
+
+	key = NULL;
+
+	name = get_device_string(dev, CL_DEVICE_NAME);
+	if (name == NULL)
+		goto out;
+
+	driver = get_device_string(dev, CL_DRIVER_VERSION);
+	if (driver == NULL)
+		goto out_name;
+
+	len = strlen(name) + strlen(driver) + strlen(options) + 64;
+	key = malloc(len);
+	if (key == NULL)
+		goto out_driver;
+
+	snprintf(key, len, "highway\n%s\n%s\n%s\n%016lx", name, driver,
+		 options, (unsigned long) srchash);
+ out_driver:
+	free(driver);
+ out_name:
+	free(name);
+ out:
+	return key;
 }
 
-static size_t get_program_capacity(const struct highway_program *this)
+/*
+ * Load the program binary from the persistent cache.
+ * Check that the program is usable so a stale or corrupt entry falls back to
+ * a build from source.
+ */
+static int load_program(cl_program *prog, struct device *dev, const char *key)
 {
-	size_t dev_gmem, dev_lmem;
-	size_t gcap, lcap;
+	const unsigned char *text;
+	cl_kernel hashsum;
+	void *binary;
+	cl_int clret;
+	size_t size;
+	int err;
 
-	dev_gmem = get_device_gmem(this->dev);
-	gcap = dev_gmem / (this->hashsum_gmem_input_size +
-			   this->hashsum_gmem_output_size);
+	err = cache_load(key, &binary, &size);
+	if (err != DELUGE_SUCCESS)
+		goto err;
 
-	dev_lmem = get_device_lmem(this->dev);
-	lcap = dev_lmem / this->hashsum_lmem_size;
+	text = binary;
+	*prog = clCreateProgramWithBinary(dev->ctx, 1, &dev->devid, &size,
+					  &text, NULL, &clret);
+	free(binary);
+	if (clret != CL_SUCCESS) {
+		err = DELUGE_FAILURE;
+		goto err;
+	}
 
-	if (gcap < lcap)
-		return gcap;
+	clret = clBuildProgram(*prog, 1, &dev->devid, NULL, NULL, NULL);
+	if (clret != CL_SUCCESS) {
+		err = DELUGE_FAILURE;
+		goto err_prog;
+	}
 
-	return lcap;
+	hashsum = clCreateKernel(*prog, HASHSUM_KNAME, &clret);
+	if (clret != CL_SUCCESS) {
+		err = DELUGE_FAILURE;
+		goto err_prog;
+	}
+
+	clReleaseKernel(hashsum);
+
+	return DELUGE_SUCCESS;
+ err_prog:
+	clReleaseProgram(*prog);
+ err:
+	return err;
 }
 
-static int alloc_program(const struct highway_program *this)
+static void store_program(cl_program prog, const char *key)
 {
-	size_t gmem, lmem;
+	unsigned char *binary;
+	cl_int clret;
+	size_t size;
 
-	gmem = this->hashsum_gmem_input_size + this->hashsum_gmem_output_size;
-	lmem = this->hashsum_lmem_size;
+	clret = clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES,
+				 sizeof (size), &size, NULL);
+	if ((clret != CL_SUCCESS) || (size == 0))
+		return;
+
+	binary = malloc(size);
+	if (binary == NULL)
+		return;
 
-	return alloc_on_device(this->dev, gmem, lmem);
+	clret = clGetProgramInfo(prog, CL_PROGRAM_BINARIES,
+				 sizeof (binary), &binary, NULL);
+	if (clret == CL_SUCCESS)
+		cache_store(key, binary, size);
+
+	free(binary);
 }
 
-static void free_program(const struct highway_program *this)
+/*
+ * Get the program built with `options` from the persistent cache or build it
+ * and store it in the cache.
+ */
+static int get_program(cl_program *prog, struct device *dev,
+		       const char *options)
 {
-	size_t gmem, lmem;
+	char *key;
+	int err;
 
-	gmem = this->hashsum_gmem_input_size + this->hashsum_gmem_output_size;
-	lmem = this->hashsum_lmem_size;
+	key = get_program_key(dev, options);
+
+	if ((key == NULL) || (load_program(prog, dev, key) != DELUGE_SUCCESS)) {
+		err = build_program(prog, dev, options);
+		if (err != DELUGE_SUCCESS)
+			goto err;
 
-	return free_on_device(this->dev, gmem, lmem);
+		if (key != NULL)
+			store_program(*prog, key);
+	}
+
+	free(key);
+
+	return DELUGE_SUCCESS;
+ err:
+	free(key);
+	return err;
 }
 
+static uint64_t get_time(void)
+{
+	struct timespec ts;
 
-static void reset_state(highway_t *st, const uint256_t *restrict key)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static cl_command_queue create_queue(struct device *dev, int profiling,
+				     int *err)
 {
-        uint32_t half0, half1;
-        int i;
+	cl_queue_properties props[] = {
+		CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0
+	};
+	cl_command_queue ret;
+	cl_int clret;
 
-	st->mul0[0] = 0xdbe6d5d5fe4cce2full;
-        st->mul0[1] = 0xa4093822299f31d0ull;
-        st->mul0[2] = 0x13198a2e03707344ull;
-        st->mul0[3] = 0x243f6a8885a308d3ull;
-        st->mul1[0] = 0x3bd39e10cb0ef593ull;
-        st->mul1[1] = 0xc0acf169b5f18a8cull;
-        st->mul1[2] = 0xbe5466cf34e90c6cull;
-        st->mul1[3] = 0x452821e638d01377ull;
+	ret = clCreateCommandQueueWithProperties(dev->ctx, dev->devid,
+						profiling ? props : NULL,
+						&clret);
+	if (clret != CL_SUCCESS)
+		*err = deluge_cl_error(clret);
+	else
+		*err = DELUGE_SUCCESS;
 
-        st->v0[0] = (st->mul0[0] ^ key->arr[0]) + 0x800000008;
-        st->v0[1] = (st->mul0[1] ^ key->arr[1]) + 0x800000008;
-	st->v0[2] = (st->mul0[2] ^ key->arr[2]) + 0x800000008;
-	st->v0[3] = (st->mul0[3] ^ key->arr[3]) + 0x800000008;
+	return ret;
+}
 
-	st->v1[0] = st->mul1[0] ^ ((key->arr[0] >> 32) | (key->arr[0] << 32));
-        st->v1[1] = st->mul1[1] ^ ((key->arr[1] >> 32) | (key->arr[1] << 32));
-        st->v1[2] = st->mul1[2] ^ ((key->arr[2] >> 32) | (key->arr[2] << 32));
-        st->v1[3] = st->mul1[3] ^ ((key->arr[3] >> 32) | (key->arr[3] << 32));
+/*
+ * Launch parameters of the hash sum kernel of a program variant.
+ */
+struct tuning
+{
+	uint64_t        wg_size;
+	uint64_t        wi_nelem;   /* elements hashed by each work-item */
+};
 
-        for (i = 0; i < 4; ++i) {
-                half0 = st->v1[i] & 0xffffffff;
-                half1 = (st->v1[i] >> 32);
-                st->v1[i] = (half0 << 8) | (half0 >> 24);
-                st->v1[i] |= (uint64_t) ((half1 << 8) | (half1 >> 24)) << 32;
-        }
+/*
+ * Time launches of the hash sum `kern` over `n` elements with `wg_size`
+ * work-items per work-group hashing `wi_nelem` elements each.
+ * Return the best time in nanoseconds or `UINT64_MAX` in case of error.
+ */
+static uint64_t time_hash_sum(cl_command_queue queue, cl_kernel kern,
+			      uint64_t n, size_t wg_size, size_t wi_nelem)
+{
+	uint64_t start, elapsed, best;
+	size_t gsize, i;
+	cl_int clret;
+
+	gsize = (n + wi_nelem - 1) / wi_nelem;
+	gsize = ((gsize + wg_size - 1) / wg_size) * wg_size;
+
+	best = UINT64_MAX;
+
+	/* the first round only warms up */
+	for (i = 0; i <= TUNE_ROUNDS; i++) {
+		start = get_time();
+
+		clret = clEnqueueNDRangeKernel(queue, kern, 1, NULL, &gsize,
+					       &wg_size, 0, NULL, NULL);
+		if (clret == CL_SUCCESS)
+			clret = clFinish(queue);
+		if (clret != CL_SUCCESS)
+			return UINT64_MAX;
+
+		elapsed = get_time() - start;
+		if ((i > 0) && (elapsed < best))
+			best = elapsed;
+	}
+
+	return best;
 }
 
-static int init_station(struct station *this, struct highway_program *prog,
-			const uint64_t key[4])
+/*
+ * Time a full job of the hash sum kernel of `prog` with every work-group size
+ * from the one in `best` down to `TUNE_WG_MIN` by halves, and every power of
+ * two of elements per work-item up to `TUNE_WI_NELEM_MAX`. Keep the fastest
+ * pair in `best`. The pairs needing more partial sums than a slot holds are
+ * skipped so the tuning never shrinks the jobs.
+ */
+static int tune_hash_sum(struct highway_program *this, cl_program prog,
+			 size_t width, struct tuning *best)
 {
-	struct device *dev = prog->dev;
-	highway_t initial;
-	uint256_t key256;
+	size_t wg_size, wi_nelem, lmem_count, size = HIGHWAY_WIDTH_SIZE(width);
+	struct device *dev = this->dev;
+	cl_mem input, initial, output;
+	uint64_t n, nsub, elapsed, fastest;
+	cl_command_queue queue;
+	cl_kernel kern;
 	cl_int clret;
 	int err;
 
-	uint256_init_le64(&key256, key);
-	reset_state(&initial, &key256);
+	n = HASHSUM_INSIZE / size;
+	if (n > HASHSUM_MAXLEN)
+		n = HASHSUM_MAXLEN;
+	nsub = 0;
 
-	this->hashsum = clCreateKernel(prog->prog, HASHSUM_KNAME, &clret);
+	queue = create_queue(dev, 0, &err);
+	if (err != DELUGE_SUCCESS)
+		goto err;
+
+	kern = clCreateKernel(prog, HASHSUM_KNAME, &clret);
 	if (clret != CL_SUCCESS) {
 		err = deluge_cl_error(clret);
-		goto err;
+		goto err_queue;
 	}
 
-	this->initial = clCreateBuffer(dev->ctx,
-				       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-				       sizeof (initial), &initial, &clret);
+	/* the hash cost does not depend on the input, left uninitialized */
+	input = clCreateBuffer(dev->ctx, CL_MEM_READ_ONLY, n * size, NULL,
+			       &clret);
 	if (clret != CL_SUCCESS) {
 		err = deluge_cl_error(clret);
-		goto err_hashsum;
+		goto err_kernel;
 	}
 
-	this->input = clCreateBuffer(dev->ctx, CL_MEM_READ_ONLY,
-				     prog->hashsum_gmem_input_size, NULL,
-				     &clret);
+	initial = clCreateBuffer(dev->ctx, CL_MEM_READ_ONLY,
+				 HIGHWAY_NWIDTH * sizeof (highway_t), NULL,
+				 &clret);
 	if (clret != CL_SUCCESS) {
 		err = deluge_cl_error(clret);
-		goto err_initial;
+		goto err_input;
 	}
 
-	this->output = clCreateBuffer(dev->ctx, CL_MEM_WRITE_ONLY,
-				      prog->hashsum_gmem_output_size, NULL,
-				      &clret);
+	output = clCreateBuffer(dev->ctx, CL_MEM_WRITE_ONLY,
+				this->hashsum_gmem_output_size, NULL, &clret);
 	if (clret != CL_SUCCESS) {
 		err = deluge_cl_error(clret);
-		goto err_input;
+		goto err_initial;
 	}
 
-	this->queue = clCreateCommandQueueWithProperties(dev->ctx, dev->devid,
-							 NULL, &clret);
+	clret = clSetKernelArg(kern, 0, sizeof (n), &n);
+	if (clret == CL_SUCCESS)
+		clret = clSetKernelArg(kern, 1, sizeof (input), &input);
+	if (clret == CL_SUCCESS)
+		clret = clSetKernelArg(kern, 2, sizeof (initial), &initial);
+	if (clret == CL_SUCCESS)
+		clret = clSetKernelArg(kern, 3, sizeof (output), &output);
+	if (clret == CL_SUCCESS)
+		clret = clSetKernelArg(kern, 4, this->hashsum_lmem_size, NULL);
+	if (clret == CL_SUCCESS)
+		clret = clSetKernelArg(kern, 5, sizeof (nsub), &nsub);
 	if (clret != CL_SUCCESS) {
 		err = deluge_cl_error(clret);
 		goto err_output;
 	}
 
-	this->partsums = malloc(prog->hashsum_gmem_output_size);
-	if (this->partsums == NULL) {
+	lmem_count = this->hashsum_lmem_size / sizeof (uint320_t);
+	fastest = UINT64_MAX;
+
+	for (wg_size = best->wg_size; wg_size >= TUNE_WG_MIN; wg_size /= 2) {
+		if (get_lmem_count(this, kern, wg_size) > lmem_count)
+			continue;
+
+		for (wi_nelem = 1; wi_nelem <= TUNE_WI_NELEM_MAX;
+		     wi_nelem *= 2) {
+			if (((n + wg_size * wi_nelem - 1) /
+			     (wg_size * wi_nelem)) > this->hashsum_wg_max)
+				continue;
+
+			elapsed = time_hash_sum(queue, kern, n, wg_size,
+						wi_nelem);
+			if (elapsed < fastest) {
+				fastest = elapsed;
+				best->wg_size = wg_size;
+				best->wi_nelem = wi_nelem;
+			}
+		}
+	}
+
+	err = DELUGE_SUCCESS;
+ err_output:
+	clReleaseMemObject(output);
+ err_initial:
+	clReleaseMemObject(initial);
+ err_input:
+	clReleaseMemObject(input);
+ err_kernel:
+	clReleaseKernel(kern);
+ err_queue:
+	clReleaseCommandQueue(queue);
+ err:
+	return err;
+}
+
+/*
+ * Get the launch parameters of the hash sum kernel of `prog` from the
+ * persistent cache or tune them and store them in the cache. The parameters
+ * default to the largest work-group with one element per work-item, which is
+ * also what a failed tuning keeps.
+ */
+static void get_tuning(struct highway_program *this, cl_program prog,
+		       size_t width, const char *options, size_t wg_size,
+		       struct tuning *tuning)
+{
+	struct tuning cached;
+	char *pkey, *key;
+	void *blob;
+	size_t len;
+
+	tuning->wg_size = wg_size;
+	tuning->wi_nelem = 1;
+
+	key = NULL;
+
+	pkey = get_program_key(this->dev, options);
+	if (pkey != NULL) {
+		len = strlen(pkey) + sizeof ("\ntuning");
+		key = malloc(len);
+		if (key != NULL)
+			snprintf(key, len, "%s\ntuning", pkey);
+		free(pkey);
+	}
+
+	if ((key != NULL) && (cache_load(key, &blob, &len) == DELUGE_SUCCESS)) {
+		if (len == sizeof (cached))
+			memcpy(&cached, blob, sizeof (cached));
+		free(blob);
+
+		if ((len == sizeof (cached)) && (cached.wg_size > 0) &&
+		    (cached.wg_size <= wg_size) && (cached.wi_nelem > 0) &&
+		    (cached.wi_nelem <= TUNE_WI_NELEM_MAX)) {
+			*tuning = cached;
+			goto out;
+		}
+	}
+
+	if ((tune_hash_sum(this, prog, width, tuning) == DELUGE_SUCCESS) &&
+	    (key != NULL))
+		cache_store(key, tuning, sizeof (*tuning));
+ out:
+	free(key);
+}
+
+static int has_extension(const char *exts, const char *name)
+{
+	size_t len = strlen(name);
+	const char *pos;
+
+	for (pos = strstr(exts, name); pos != NULL; pos = strstr(pos + 1, name))
+		if (((pos == exts) || (pos[-1] == ' ')) &&
+		    ((pos[len] == ' ') || (pos[len] == '\0')))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * The sub-group reduction needs the sub-groups and their shuffles. If the
+ * driver still fails to build it, the programs reduce in local memory.
+ */
+static int get_default_program(struct highway_program *this)
+{
+	char *exts;
+
+	exts = get_device_string(this->dev, CL_DEVICE_EXTENSIONS);
+	if (exts != NULL) {
+		this->subgroups = has_extension(exts, "cl_khr_subgroups") &&
+			has_extension(exts, "cl_khr_subgroup_shuffle");
+		free(exts);
+	}
+
+	if (this->subgroups) {
+		this->options = SUBGROUP_OPTIONS;
+		if (get_program(&this->prog, this->dev, this->options) ==
+		    DELUGE_SUCCESS)
+			return DELUGE_SUCCESS;
+		this->subgroups = 0;
+	}
+
+	this->options = COMPILE_OPTIONS;
+	return get_program(&this->prog, this->dev, this->options);
+}
+
+int init_highway_program(struct highway_program *this, struct device *dev)
+{
+	struct highway_variant *variant;
+	struct tuning tuning;
+	size_t w;
+	int err;
+
+	err = pthread_mutex_init(&this->lock, NULL);
+	if (err != 0) {
 		err = deluge_c_error();
-		goto err_queue;
+		goto err;
 	}
 
-	clret = clSetKernelArg(this->hashsum, 1, sizeof (this->input),
-			       &this->input);
-	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
-		goto err_partsums;
+	if (is_host_device(dev))
+		return init_host_program(this, dev);
+
+	this->dev = dev;
+	this->subgroups = 0;
+	list_init(&this->keyed);
+
+	err = get_default_program(this);
+	if (err != DELUGE_SUCCESS)
+		goto err_lock;
+
+	err = init_program_cost(this);
+	if (err != DELUGE_SUCCESS)
+		goto err_prog;
+
+	for (w = 0; w < HIGHWAY_NWIDTH; w++) {
+		variant = &this->variants[w];
+		variant->prog = NULL;
+		variant->wg_size = 0;
+		variant->wi_nelem = 0;
+		variant->maxlen = 0;
+		atomic_store_uint64(&variant->ready, 0);
 	}
 
-	clret = clSetKernelArg(this->hashsum, 2, sizeof (this->initial),
-			       &this->initial);
-	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
-		goto err_partsums;
+	get_tuning(this, this->prog, HIGHWAY_DEFAULT_WIDTH, this->options,
+		   this->hashsum_wg_size, &tuning);
+
+	variant = &this->variants[HIGHWAY_DEFAULT_WIDTH];
+	variant->prog = this->prog;
+	init_variant_cost(this, variant, HIGHWAY_DEFAULT_WIDTH,
+			  tuning.wg_size, tuning.wi_nelem);
+	atomic_store_uint64(&variant->ready, 1);
+
+	return DELUGE_SUCCESS;
+ err_prog:
+	clReleaseProgram(this->prog);
+ err_lock:
+	pthread_mutex_destroy(&this->lock);
+ err:
+	return err;
+}
+
+void finlz_highway_program(struct highway_program *this)
+{
+	struct highway_keyed *keyed;
+	struct list *elem;
+	size_t w;
+
+	while ((elem = list_pop(&this->keyed)) != NULL) {
+		keyed = list_item(elem, struct highway_keyed, list);
+		if (keyed->prog != NULL)
+			clReleaseProgram(keyed->prog);
+		free(keyed);
 	}
 
-	clret = clSetKernelArg(this->hashsum, 3, sizeof (this->output),
-			       &this->output);
-	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
-		goto err_partsums;
+	for (w = 0; w < HIGHWAY_NWIDTH; w++) {
+		if (w == HIGHWAY_DEFAULT_WIDTH)
+			continue;
+		if (this->variants[w].prog != NULL)
+			clReleaseProgram(this->variants[w].prog);
 	}
 
-	clret = clSetKernelArg(this->hashsum, 4, prog->hashsum_lmem_size,
-			       NULL);
-	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
-		goto err_partsums;
+	if (this->prog != NULL)
+		clReleaseProgram(this->prog);
+
+	pthread_mutex_destroy(&this->lock);
+}
+
+int init_highway_variant(struct highway_program *this, size_t width)
+{
+	struct highway_variant *variant = &this->variants[width];
+	char options[sizeof (SUBGROUP_OPTIONS) + 32];
+	struct tuning tuning;
+	cl_program prog;
+	size_t wg_size;
+	int err;
+
+	/* the builds and tunings hold the lock, the jobs only wait on first use */
+	if (atomic_load_uint64(&variant->ready))
+		return DELUGE_SUCCESS;
+
+	pthread_mutex_lock(&this->lock);
+
+	if (atomic_load_uint64(&variant->ready)) {
+		err = DELUGE_SUCCESS;
+		goto out;
 	}
 
-	this->prog = prog;
-	list_init(&this->stqueue);
+	snprintf(options, sizeof (options), "%s -DELEM_SIZE=%lu",
+		 this->options, HIGHWAY_WIDTH_SIZE(width));
+
+	err = get_program(&prog, this->dev, options);
+	if (err != DELUGE_SUCCESS)
+		goto out;
+
+	err = get_kernel_wg_size(prog, this->dev, HASHSUM_KNAME, &wg_size);
+	if (err != DELUGE_SUCCESS) {
+		clReleaseProgram(prog);
+		goto out;
+	}
+
+	get_tuning(this, prog, width, options, wg_size, &tuning);
+
+	variant->prog = prog;
+	init_variant_cost(this, variant, width, tuning.wg_size,
+			  tuning.wi_nelem);
+	atomic_store_uint64(&variant->ready, 1);
+ out:
+	pthread_mutex_unlock(&this->lock);
+	return err;
+}
+
+static size_t get_program_capacity(const struct highway_program *this,
+				   size_t depth)
+{
+	size_t dev_gmem, dev_lmem;
+	size_t gcap, lcap;
+
+	dev_gmem = get_device_gmem(this->dev);
+	gcap = dev_gmem / (depth * (this->hashsum_gmem_input_size +
+				    this->hashsum_gmem_output_size));
+
+	dev_lmem = get_device_lmem(this->dev);
+	lcap = dev_lmem / this->hashsum_lmem_size;
+
+	if (gcap < lcap)
+		return gcap;
+
+	return lcap;
+}
+
+/*
+ * The kernels of a station run one at a time so the local memory is reserved
+ * once while each slot needs its own global memory buffers.
+ */
+static int alloc_program(const struct highway_program *this, size_t depth)
+{
+	size_t gmem, lmem;
+
+	gmem = this->hashsum_gmem_input_size + this->hashsum_gmem_output_size;
+	lmem = this->hashsum_lmem_size;
+
+	return alloc_on_device(this->dev, depth * gmem, lmem);
+}
+
+static void free_program(const struct highway_program *this, size_t depth)
+{
+	size_t gmem, lmem;
+
+	gmem = this->hashsum_gmem_input_size + this->hashsum_gmem_output_size;
+	lmem = this->hashsum_lmem_size;
+
+	return free_on_device(this->dev, depth * gmem, lmem);
+}
+
+
+static void reset_state(highway_t *st, const uint256_t *restrict key)
+{
+	st->mul0[0] = 0xdbe6d5d5fe4cce2full;
+        st->mul0[1] = 0xa4093822299f31d0ull;
+        st->mul0[2] = 0x13198a2e03707344ull;
+        st->mul0[3] = 0x243f6a8885a308d3ull;
+        st->mul1[0] = 0x3bd39e10cb0ef593ull;
+        st->mul1[1] = 0xc0acf169b5f18a8cull;
+        st->mul1[2] = 0xbe5466cf34e90c6cull;
+        st->mul1[3] = 0x452821e638d01377ull;
+
+        st->v0[0] = st->mul0[0] ^ key->arr[0];
+        st->v0[1] = st->mul0[1] ^ key->arr[1];
+	st->v0[2] = st->mul0[2] ^ key->arr[2];
+	st->v0[3] = st->mul0[3] ^ key->arr[3];
+
+	st->v1[0] = st->mul1[0] ^ ((key->arr[0] >> 32) | (key->arr[0] << 32));
+        st->v1[1] = st->mul1[1] ^ ((key->arr[1] >> 32) | (key->arr[1] << 32));
+        st->v1[2] = st->mul1[2] ^ ((key->arr[2] >> 32) | (key->arr[2] << 32));
+        st->v1[3] = st->mul1[3] ^ ((key->arr[3] >> 32) | (key->arr[3] << 32));
+}
+
+/*
+ * Apply the length dependent part of the remainder update of a `size` bytes
+ * input to a reset state, so the `hash_sum` kernel only updates the state
+ * with the element packet.
+ */
+static void prepare_state(highway_t *st, size_t size)
+{
+        uint32_t half0, half1;
+	uint64_t count;
+        int i;
+
+	count = size & 31;
+	if (count == 0)
+		return;
+
+        for (i = 0; i < 4; ++i) {
+		st->v0[i] += (count << 32) + count;
+
+                half0 = st->v1[i] & 0xffffffff;
+                half1 = (st->v1[i] >> 32);
+                st->v1[i] = (half0 << count) | (half0 >> (32 - count));
+                st->v1[i] |= (uint64_t) ((half1 << count) |
+					 (half1 >> (32 - count))) << 32;
+        }
+}
+
+static void zipper_merge_and_add(const uint64_t v1, const uint64_t v0,
+				 uint64_t *restrict add1,
+				 uint64_t *restrict add0)
+{
+	*add0 += (((v0 & 0xff000000ull) | (v1 & 0xff00000000ull)) >> 24) |
+		(((v0 & 0xff0000000000ull) |
+		  (v1 & 0xff000000000000ull)) >> 16) |
+		(v0 & 0xff0000ull) | ((v0 & 0xff00ull) << 32) |
+		((v1 & 0xff00000000000000ull) >> 8) | (v0 << 56);
+	*add1 += (((v1 & 0xff000000ull) | (v0 & 0xff00000000ull)) >> 24) |
+		(v1 & 0xff0000ull) | ((v1 & 0xff0000000000ull) >> 16) |
+		((v1 & 0xff00ull) << 24) |
+		((v0 & 0xff000000000000ull) >> 8) |
+		((v1 & 0xffull) << 48) | (v0 & 0xff00000000000000ull);
+}
+
+/*
+ * Apply to a prepared state the part of the first update that does not depend
+ * on an element of the default width, whose packet only fills the lane 0.
+ * The lane 1 stops before its zipper merge with the lane 0, as expected by
+ * `update_first()` in the kernel.
+ */
+static void prepare_first_update(highway_t *st)
+{
+	int i;
+
+	for (i = 1; i < 4; i++) {
+		st->v1[i] += st->mul0[i];
+		st->mul0[i] ^= (st->v1[i] & 0xffffffff) * (st->v0[i] >> 32);
+		st->v0[i] += st->mul1[i];
+		st->mul1[i] ^= (st->v0[i] & 0xffffffff) * (st->v1[i] >> 32);
+	}
+
+	zipper_merge_and_add(st->v1[3], st->v1[2], &st->v0[3], &st->v0[2]);
+	zipper_merge_and_add(st->v0[3], st->v0[2], &st->v1[3], &st->v1[2]);
+}
+
+static int append_words(char *dst, size_t len, const uint64_t words[4],
+			const char *sep)
+{
+	return snprintf(dst, len, "{0x%016lxul,0x%016lxul,0x%016lxul,"
+			"0x%016lxul}%s", (unsigned long) words[0],
+			(unsigned long) words[1], (unsigned long) words[2],
+			(unsigned long) words[3], sep);
+}
+
+/*
+ * Compile options of the default width program built for `key`, which gets
+ * its first update state as the `KEY_FIRST` initializer.
+ */
+static char *get_keyed_options(const struct highway_program *this,
+			       const uint64_t key[4])
+{
+	highway_t first;
+	uint256_t key256;
+	size_t len, pos;
+	char *ret;
+
+	uint256_init_le64(&key256, key);
+	reset_state(&first, &key256);
+	prepare_state(&first, HIGHWAY_WIDTH_SIZE(HIGHWAY_DEFAULT_WIDTH));
+	prepare_first_update(&first);
+
+	len = strlen(this->options) + 64 + 4 * 4 * 24;
+	ret = malloc(len);
+	if (ret == NULL) {
+		deluge_c_error();
+		return NULL;
+	}
+
+	pos = snprintf(ret, len, "%s -DKEY_FIRST={", this->options);
+	pos += append_words(ret + pos, len - pos, first.v0, ",");
+	pos += append_words(ret + pos, len - pos, first.v1, ",");
+	pos += append_words(ret + pos, len - pos, first.mul0, ",");
+	pos += append_words(ret + pos, len - pos, first.mul1, "}");
+
+	return ret;
+}
+
+/*
+ * Build the default width program for `key`. It runs with the launch
+ * parameters of the default variant, so it is dropped if its kernel cannot
+ * run as many work-items in the local memory of a slot.
+ * Its options hold a state derived from the key, so it bypasses the persistent
+ * cache whose entries store their options in readable files.
+ */
+static int build_keyed_program(struct highway_program *this,
+			       const uint64_t key[4], cl_program *dst)
+{
+	const struct highway_variant *variant;
+	size_t wg_size;
+	cl_program prog;
+	char *options;
+	int err;
+
+	variant = &this->variants[HIGHWAY_DEFAULT_WIDTH];
+
+	options = get_keyed_options(this, key);
+	if (options == NULL) {
+		err = DELUGE_FAILURE;
+		goto err;
+	}
+
+	err = build_program(&prog, this->dev, options);
+	if (err != DELUGE_SUCCESS)
+		goto err_options;
+
+	err = get_kernel_wg_size(prog, this->dev, HASHSUM_KNAME, &wg_size);
+	if (err != DELUGE_SUCCESS)
+		goto err_prog;
+
+	if ((wg_size < variant->wg_size) ||
+	    (fit_lmem_wg_size(this, prog, variant->wg_size) <
+	     variant->wg_size)) {
+		clReleaseProgram(prog);
+		prog = NULL;
+	}
+
+	free(options);
+
+	*dst = prog;
 
 	return DELUGE_SUCCESS;
- err_partsums:
-	free(this->partsums);
- err_queue:
-	clReleaseCommandQueue(this->queue);
- err_output:
-	clReleaseMemObject(this->output);
- err_input:
-	clReleaseMemObject(this->input);
- err_initial:
-	clReleaseMemObject(this->initial);
- err_hashsum:
-	clReleaseKernel(this->hashsum);
+ err_prog:
+	clReleaseProgram(prog);
+ err_options:
+	free(options);
  err:
 	return err;
 }
 
-static void finlz_station(struct station *this)
+/*
+ * Get the default width program built for `key`, building it the first time.
+ * Set `dst` to `NULL` if the device has no such program.
+ */
+static int get_keyed_program(struct highway_program *this,
+			     const uint64_t key[4], cl_program *dst)
 {
-	clFinish(this->queue);
-	free(this->partsums);
-	clReleaseCommandQueue(this->queue);
-	clReleaseMemObject(this->output);
-	clReleaseMemObject(this->input);
-	clReleaseMemObject(this->initial);
-	clReleaseKernel(this->hashsum);
+	struct highway_keyed *keyed;
+	struct list *elem;
+	int err;
+
+	*dst = NULL;
+
+	if (is_host_device(this->dev))
+		return DELUGE_SUCCESS;
+
+	pthread_mutex_lock(&this->lock);
+
+	for (elem = this->keyed.next; elem != &this->keyed;
+	     elem = elem->next) {
+		keyed = list_item(elem, struct highway_keyed, list);
+		if (memcmp(keyed->key, key, sizeof (keyed->key)) == 0) {
+			*dst = keyed->prog;
+			err = DELUGE_SUCCESS;
+			goto out;
+		}
+	}
+
+	keyed = malloc(sizeof (*keyed));
+	if (keyed == NULL) {
+		err = deluge_c_error();
+		goto out;
+	}
+
+	err = build_keyed_program(this, key, &keyed->prog);
+	if (err != DELUGE_SUCCESS) {
+		free(keyed);
+		goto out;
+	}
+
+	memcpy(keyed->key, key, sizeof (keyed->key));
+	list_push(&this->keyed, &keyed->list);
+
+	*dst = keyed->prog;
+ out:
+	pthread_mutex_unlock(&this->lock);
+	return err;
+}
+
+static int init_slot_kernel(const struct slot *this, cl_program prog,
+			    const char *kname, cl_kernel *dst)
+{
+	const struct station *st = this->station;
+	cl_kernel kern;
+	cl_int clret;
+
+	kern = clCreateKernel(prog, kname, &clret);
+	if (clret != CL_SUCCESS)
+		goto err;
+
+	clret = clSetKernelArg(kern, 1, sizeof (this->input), &this->input);
+	if (clret != CL_SUCCESS)
+		goto err_kernel;
+
+	clret = clSetKernelArg(kern, 2, sizeof (st->initial), &st->initial);
+	if (clret != CL_SUCCESS)
+		goto err_kernel;
+
+	clret = clSetKernelArg(kern, 3, sizeof (this->output), &this->output);
+	if (clret != CL_SUCCESS)
+		goto err_kernel;
+
+	clret = clSetKernelArg(kern, 4, st->prog->hashsum_lmem_size, NULL);
+	if (clret != CL_SUCCESS)
+		goto err_kernel;
+
+	*dst = kern;
+
+	return DELUGE_SUCCESS;
+ err_kernel:
+	clReleaseKernel(kern);
+ err:
+	return deluge_cl_error(clret);
+}
+
+/*
+ * Get the hash sum kernel of the slot for the elements of width `width`.
+ * The kernels of the other widths than the default one are created the first
+ * time the slot runs a job of their width, once the variant is built.
+ */
+static int get_slot_kernel(struct slot *this, size_t width, cl_kernel *dst)
+{
+	const struct highway_program *prog = this->station->prog;
+	int err;
+
+	if (this->hashsum[width] == NULL) {
+		err = init_slot_kernel(this, prog->variants[width].prog,
+				       HASHSUM_KNAME, &this->hashsum[width]);
+		if (err != DELUGE_SUCCESS)
+			return err;
+	}
+
+	*dst = this->hashsum[width];
+
+	return DELUGE_SUCCESS;
+}
+
+/*
+ * The reduction kernel sums the partial sums of the work-groups of the hash
+ * kernel in place, so only the total is read back.
+ */
+static int init_reduce_kernel(struct slot *this)
+{
+	const struct station *st = this->station;
+	cl_int clret;
+
+	this->reduce = clCreateKernel(st->prog->prog, REDUCE_KNAME, &clret);
+	if (clret != CL_SUCCESS)
+		goto err;
+
+	clret = clSetKernelArg(this->reduce, 1, sizeof (this->output),
+			       &this->output);
+	if (clret != CL_SUCCESS)
+		goto err_kernel;
+
+	clret = clSetKernelArg(this->reduce, 2, st->prog->hashsum_lmem_size,
+			       NULL);
+	if (clret != CL_SUCCESS)
+		goto err_kernel;
+
+	return DELUGE_SUCCESS;
+ err_kernel:
+	clReleaseKernel(this->reduce);
+ err:
+	return deluge_cl_error(clret);
+}
+
+static void finlz_slot_kernels(struct slot *this)
+{
+	size_t w;
+
+	for (w = 0; w < HIGHWAY_NWIDTH; w++)
+		if (this->hashsum[w] != NULL)
+			clReleaseKernel(this->hashsum[w]);
+}
+
+static int init_slot(struct slot *this, struct station *station)
+{
+	struct highway_program *prog = station->prog;
+	struct device *dev = prog->dev;
+	uint64_t nkey;
+	cl_int clret;
+	size_t w;
+	int err;
+
+	this->station = station;
+	this->hostbuf = NULL;
+	this->buffer.slot = this;
+	this->qnode = NULL;
+
+	this->ksums = malloc(station->nkey * sizeof (*this->ksums));
+	if (this->ksums == NULL) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	if (is_host_device(dev))
+		return DELUGE_SUCCESS;
+
+	/*
+	 * Let the driver allocate the input in pinned memory so it can be
+	 * mapped by `deluge_highway_acquire_buffer()` and transferred without
+	 * an intermediate copy.
+	 */
+	this->input = clCreateBuffer(dev->ctx,
+				     CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+				     prog->hashsum_gmem_input_size, NULL,
+				     &clret);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err_ksums;
+	}
+
+	this->output = clCreateBuffer(dev->ctx, CL_MEM_READ_WRITE,
+				      prog->hashsum_gmem_output_size, NULL,
+				      &clret);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err_input;
+	}
+
+	for (w = 0; w < HIGHWAY_NWIDTH; w++)
+		this->hashsum[w] = NULL;
+
+	err = init_slot_kernel(this, (station->keyed != NULL) ?
+			       station->keyed : prog->prog, HASHSUM_KNAME,
+			       &this->hashsum[HIGHWAY_DEFAULT_WIDTH]);
+	if (err != DELUGE_SUCCESS)
+		goto err_output;
+
+	err = init_slot_kernel(this, prog->prog, HASHBYTES_KNAME,
+			       &this->hashbytes);
+	if (err != DELUGE_SUCCESS)
+		goto err_hashsum;
+
+	err = init_slot_kernel(this, prog->prog, HASHBATCH_KNAME,
+			       &this->hashbatch);
+	if (err != DELUGE_SUCCESS)
+		goto err_hashbytes;
+
+	err = init_slot_kernel(this, prog->prog, HASHKEYS_KNAME,
+			       &this->hashkeys);
+	if (err != DELUGE_SUCCESS)
+		goto err_hashbatch;
+
+	nkey = station->nkey;
+	clret = clSetKernelArg(this->hashkeys, 5, sizeof (nkey), &nkey);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err_hashkeys;
+	}
+
+	err = init_reduce_kernel(this);
+	if (err != DELUGE_SUCCESS)
+		goto err_hashkeys;
+
+	/* the arguments are the stream of the job and the slot output */
+	this->accumulate = clCreateKernel(prog->prog, ACCUMULATE_KNAME,
+					  &clret);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err_reduce;
+	}
+
+	return DELUGE_SUCCESS;
+ err_reduce:
+	clReleaseKernel(this->reduce);
+ err_hashkeys:
+	clReleaseKernel(this->hashkeys);
+ err_hashbatch:
+	clReleaseKernel(this->hashbatch);
+ err_hashbytes:
+	clReleaseKernel(this->hashbytes);
+ err_hashsum:
+	finlz_slot_kernels(this);
+ err_output:
+	clReleaseMemObject(this->output);
+ err_input:
+	clReleaseMemObject(this->input);
+ err_ksums:
+	free(this->ksums);
+ err:
+	return err;
+}
+
+static void finlz_slot(struct slot *this)
+{
+	if (!is_host_device(this->station->prog->dev)) {
+		clReleaseKernel(this->accumulate);
+		clReleaseKernel(this->reduce);
+		clReleaseKernel(this->hashkeys);
+		clReleaseKernel(this->hashbatch);
+		clReleaseKernel(this->hashbytes);
+		finlz_slot_kernels(this);
+		clReleaseMemObject(this->output);
+		clReleaseMemObject(this->input);
+	}
+
+	free(this->hostbuf);
+	free(this->ksums);
+}
+
+static int init_station_slots(struct station *this)
+{
+	size_t i;
+	int err;
+
+	this->slots = malloc(this->depth * sizeof (*this->slots));
+	if (this->slots == NULL) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	for (i = 0; i < this->depth; i++) {
+		err = init_slot(&this->slots[i], this);
+		if (err != DELUGE_SUCCESS)
+			goto err_slots;
+	}
+
+	return DELUGE_SUCCESS;
+ err_slots:
+	while (i-- > 0)
+		finlz_slot(&this->slots[i]);
+	free(this->slots);
+ err:
+	return err;
+}
+
+static void finlz_station_slots(struct station *this)
+{
+	size_t i;
+
+	for (i = 0; i < this->depth; i++)
+		finlz_slot(&this->slots[i]);
+
+	free(this->slots);
+}
+
+static int init_host_station(struct station *this)
+{
+	int err;
+
+	err = init_station_slots(this);
+	if (err != DELUGE_SUCCESS)
+		goto err;
+
+	err = init_host_worker(&this->worker);
+	if (err != DELUGE_SUCCESS)
+		goto err_slots;
+
+	return DELUGE_SUCCESS;
+ err_slots:
+	finlz_station_slots(this);
+ err:
+	return err;
+}
+
+/*
+ * Build the initial states of every width under every key, the states of the
+ * key `k` starting at index `k * HIGHWAY_NWIDTH`.
+ */
+static highway_t *init_states(const uint64_t (*keys)[4], size_t nkey)
+{
+	uint256_t key256;
+	highway_t *ret;
+	size_t k, w;
+
+	ret = malloc(nkey * HIGHWAY_NWIDTH * sizeof (*ret));
+	if (ret == NULL) {
+		deluge_c_error();
+		return NULL;
+	}
+
+	for (k = 0; k < nkey; k++) {
+		uint256_init_le64(&key256, keys[k]);
+		for (w = 0; w < HIGHWAY_NWIDTH; w++) {
+			reset_state(&ret[k * HIGHWAY_NWIDTH + w], &key256);
+			prepare_state(&ret[k * HIGHWAY_NWIDTH + w],
+				      HIGHWAY_WIDTH_SIZE(w));
+		}
+	}
+
+	return ret;
+}
+
+static int init_station(struct station *this, struct highway_program *prog,
+			const uint64_t (*keys)[4], size_t nkey, size_t depth,
+			int specialized,
+			void (*profiler)(const struct deluge_highway_profile *,
+					 void *),
+			void *profiler_user)
+{
+	struct device *dev = prog->dev;
+	highway_t *initial;
+	cl_int clret;
+	int err;
+
+	initial = init_states(keys, nkey);
+	if (initial == NULL) {
+		err = DELUGE_FAILURE;
+		goto err;
+	}
+
+	this->prog = prog;
+	this->keyed = NULL;
+	this->nkey = nkey;
+	this->depth = depth;
+	list_init(&this->stqueue);
+	atomic_store_uint64(&this->done, 0);
+	this->profiler = profiler;
+	this->profiler_user = profiler_user;
+
+	if (is_host_device(dev)) {
+		this->states = initial;
+		err = init_host_station(this);
+		if (err != DELUGE_SUCCESS)
+			goto err_states;
+		return DELUGE_SUCCESS;
+	}
+
+	if (specialized) {
+		err = get_keyed_program(prog, keys[0], &this->keyed);
+		if (err != DELUGE_SUCCESS)
+			goto err_states;
+	}
+
+	this->initial = clCreateBuffer(dev->ctx,
+				       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				       nkey * HIGHWAY_NWIDTH *
+				       sizeof (*initial), initial, &clret);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err_states;
+	}
+
+	free(initial);
+
+	this->upload = create_queue(dev, profiler != NULL, &err);
+	if (err != DELUGE_SUCCESS)
+		goto err_initial;
+
+	this->compute = create_queue(dev, profiler != NULL, &err);
+	if (err != DELUGE_SUCCESS)
+		goto err_upload;
+
+	this->readback = create_queue(dev, profiler != NULL, &err);
+	if (err != DELUGE_SUCCESS)
+		goto err_compute;
+
+	err = init_station_slots(this);
+	if (err != DELUGE_SUCCESS)
+		goto err_readback;
+
+	return DELUGE_SUCCESS;
+ err_readback:
+	clReleaseCommandQueue(this->readback);
+ err_compute:
+	clReleaseCommandQueue(this->compute);
+ err_upload:
+	clReleaseCommandQueue(this->upload);
+ err_initial:
+	clReleaseMemObject(this->initial);
+	return err;
+ err_states:
+	free(initial);
+ err:
+	return err;
+}
+
+static void finlz_station(struct station *this)
+{
+	if (is_host_device(this->prog->dev)) {
+		finlz_host_worker(&this->worker);
+		finlz_station_slots(this);
+		free(this->states);
+		return;
+	}
+
+	clFinish(this->upload);
+	clFinish(this->compute);
+	clFinish(this->readback);
+	finlz_station_slots(this);
+	clReleaseCommandQueue(this->readback);
+	clReleaseCommandQueue(this->compute);
+	clReleaseCommandQueue(this->upload);
+	clReleaseMemObject(this->initial);
+}
+
+static int alloc_station(struct device *dev, const uint64_t (*keys)[4],
+			 size_t nkey, size_t depth, int specialized,
+			 void (*profiler)(const struct deluge_highway_profile *,
+					  void *),
+			 void *profiler_user, struct list *dst)
+{
+	struct station *station;
+	int err;
+
+	station = malloc(sizeof (*station));
+	if (station == NULL) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	err = init_station(station, &dev->highway, keys, nkey, depth,
+			   specialized, profiler, profiler_user);
+	if (err != DELUGE_SUCCESS)
+		goto err_station;
+
+	list_push(dst, &station->stqueue);
+
+	return DELUGE_SUCCESS;
+ err_station:
+	free(station);
+ err:
+	return err;
+}
+
+static void free_station(struct station *station)
+{
+	finlz_station(station);
+	free(station);
+}
+
+/*
+ * Give a result to its callback, or queue it in the context if there is none.
+ */
+static void report_result(struct deluge_highway *this,
+			  void (*cb)(int, uint64_t[5], void *), int status,
+			  uint64_t sum[5], void *user)
+{
+	struct deluge_highway_result result;
+
+	if (cb != NULL) {
+		cb(status, sum, user);
+		return;
+	}
+
+	result.user = user;
+	result.status = status;
+	memcpy(result.sum, sum, sizeof (result.sum));
+
+	ring_push(&this->results, &result);
+}
+
+static void put_thread_index(void *uindex)
+{
+	pthread_mutex_lock(&index_lock);
+	free_indexes[nfree_index++] = (uintptr_t) uindex;
+	pthread_mutex_unlock(&index_lock);
+}
+
+static void init_index_key(void)
+{
+	index_key_valid = (pthread_key_create(&index_key, put_thread_index)
+			   == 0);
+}
+
+/*
+ * Take a free index, or a new one as long as there are caches left. Without
+ * the key giving it back, the index is never reused.
+ */
+static uint64_t get_thread_index(void)
+{
+	uint64_t ret = JOB_NCACHE + 1;
+
+	pthread_once(&index_once, init_index_key);
+
+	pthread_mutex_lock(&index_lock);
+
+	if (nfree_index > 0)
+		ret = free_indexes[--nfree_index];
+	else if (nthread < JOB_NCACHE)
+		ret = ++nthread;
+
+	pthread_mutex_unlock(&index_lock);
+
+	if ((ret <= JOB_NCACHE) && index_key_valid &&
+	    (pthread_setspecific(index_key, (void *) (uintptr_t) ret) != 0)) {
+		put_thread_index((void *) (uintptr_t) ret);
+		ret = JOB_NCACHE + 1;
+	}
+
+	return ret;
+}
+
+/*
+ * Return the job cache of the current thread or `NULL` if it has none.
+ */
+static struct job_cache *get_job_cache(struct deluge_highway *this)
+{
+	if (thread_index == 0)
+		thread_index = get_thread_index();
+
+	if (thread_index > JOB_NCACHE)
+		return NULL;
+
+	return &this->caches[thread_index - 1];
+}
+
+/*
+ * Add `n` jobs to the pool, each with its own node of the job queue.
+ */
+static int grow_job_pool(struct deluge_highway *this, size_t n)
+{
+	struct job_slab *slab;
+	struct job *job;
+	size_t i;
+
+	slab = aligned_alloc(JOB_ALIGN, (n + 1) * JOB_STRIDE);
+	if (slab == NULL)
+		return deluge_c_error();
+
+	for (i = 0; i < n; i++) {
+		job = (struct job *) ((uint8_t *) slab + (i + 1) * JOB_STRIDE);
+		job->qnode = lf_queue_alloc_node(&this->jobqueue);
+		if (job->qnode == NULL)
+			goto err_nodes;
+	}
+
+	pthread_mutex_lock(&this->lock);
+	slab->next = this->slabs;
+	this->slabs = slab;
+	pthread_mutex_unlock(&this->lock);
+
+	for (i = 0; i < n; i++) {
+		job = (struct job *) ((uint8_t *) slab + (i + 1) * JOB_STRIDE);
+		lf_stack_push(&this->jobpool, &job->pool);
+	}
+
+	return DELUGE_SUCCESS;
+ err_nodes:
+	while (i-- > 0) {
+		job = (struct job *) ((uint8_t *) slab + (i + 1) * JOB_STRIDE);
+		lf_queue_free_node(&this->jobqueue, job->qnode);
+	}
+	free(slab);
+	return DELUGE_FAILURE;
+}
+
+static struct job *get_job(struct deluge_highway *this)
+{
+	struct job_cache *cache = get_job_cache(this);
+	struct lf_node *node;
+
+	if ((cache != NULL) && (cache->njob > 0))
+		return cache->jobs[--cache->njob];
+
+	while ((node = lf_stack_pop(&this->jobpool)) == NULL)
+		if (grow_job_pool(this, JOB_CACHE_SIZE) != DELUGE_SUCCESS)
+			return NULL;
+
+	return list_item(node, struct job, pool);
+}
+
+static void put_job(struct deluge_highway *this, struct job *job)
+{
+	struct job_cache *cache = get_job_cache(this);
+
+	if ((cache != NULL) && (cache->njob < JOB_CACHE_SIZE)) {
+		cache->jobs[cache->njob++] = job;
+		return;
+	}
+
+	lf_stack_push(&this->jobpool, &job->pool);
+}
+
+static void free_job(struct job *job)
+{
+	if (job->kind != JOB_BATCH) {
+		put_job(job->dispatch, job);
+		return;
+	}
+
+	lf_queue_free_node(&job->dispatch->jobqueue, job->qnode);
+	free(job);
+}
+
+/*
+ * Account the completion of a job of `chunk` and call the chunk callback once
+ * its last job completes. The stream only counts the job as completed after
+ * the callback, so a snapshot returns after the callbacks of the chunks.
+ */
+static void complete_chunk(struct stream_chunk *chunk, int status)
+{
+	struct deluge_highway_stream *stream = chunk->stream;
+	int last;
+
+	pthread_mutex_lock(&stream->lock);
+
+	if (status != DELUGE_SUCCESS) {
+		if (chunk->status == DELUGE_SUCCESS)
+			chunk->status = status;
+		if (stream->status == DELUGE_SUCCESS)
+			stream->status = status;
+	}
+
+	chunk->pending -= 1;
+	last = (chunk->pending == 0);
+
+	pthread_mutex_unlock(&stream->lock);
+
+	if (last) {
+		if (chunk->cb != NULL)
+			chunk->cb(chunk->status, chunk->user);
+		free(chunk);
+	}
+
+	pthread_mutex_lock(&stream->lock);
+	stream->pending -= 1;
+	if (stream->pending == 0)
+		pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+/*
+ * Report `status` for the results of a job which does not run.
+ */
+static void fail_job(struct job *job, int status)
+{
+	uint64_t dummy[5] = { 0, 0, 0, 0, 0 };
+	size_t i;
+
+	if (job->kind == JOB_BATCH) {
+		for (i = 0; i < job->ninput; i++)
+			report_result(job->dispatch, job->sets[i].cb,
+				      status, dummy, job->sets[i].user);
+	} else if (job->kind == JOB_KEYS) {
+		job->kcb(status, NULL, job->user);
+	} else if (job->chunk != NULL) {
+		complete_chunk(job->chunk, status);
+	} else {
+		report_result(job->dispatch, job->cb, status, dummy,
+			      job->user);
+	}
+
+	free_job(job);
+}
+
+/*
+ * Measure the device throughput with a completed job. The station runs its
+ * jobs in order, so the job started at the latest of its launch and of the
+ * completion of the previous job.
+ */
+static void account_job(struct job *job)
+{
+	struct station *st = job->slot->station;
+	uint64_t now, start, nelem;
+
+	now = get_time();
+	start = atomic_swap_uint64(&st->done, now);
+	if (start < job->start)
+		start = job->start;
+
+	if (job->kind == JOB_WORDS)
+		nelem = job->ninput + job->nremoved;
+	else if (job->kind == JOB_KEYS)
+		nelem = job->ninput * st->nkey;
+	else if (job->kind == JOB_BATCH)
+		nelem = ((const uint64_t *) job->input)[job->ninput];
+	else
+		return;  /* the cost of a string depends on its length */
+
+	update_device_rate(st->prog->dev, nelem, now - start);
+}
+
+/*
+ * Complete the `profile` of a job with its user and size. This must happen
+ * before the callbacks of the job, since the last slice of a split job frees
+ * its merge.
+ */
+static void describe_profile(const struct job *job,
+			     struct deluge_highway_profile *profile)
+{
+	if (job->kind == JOB_BATCH) {
+		profile->user = NULL;
+		profile->nelem = ((const uint64_t *) job->input)[job->ninput];
+	} else if ((job->cb == merge_slice) ||
+		   (job->kcb == merge_keys_slice)) {
+		profile->user = ((struct merge *) job->user)->user;
+		profile->nelem = job->ninput + job->nremoved;
+	} else {
+		profile->user = job->user;
+		profile->nelem = job->ninput + job->nremoved;
+	}
+}
+
+/*
+ * Report the results of a job, and its `profile` unless `NULL`.
+ */
+static void finish_job(struct job *job, struct deluge_highway_profile *profile)
+{
+	struct deluge_highway *dispatch = job->dispatch;
+	struct slot *slot = job->slot;
+	uint64_t result[5];
+	size_t i;
+
+	account_job(job);
+
+	if (profile != NULL)
+		describe_profile(job, profile);
+
+	if (job->kind == JOB_BATCH) {
+		for (i = 0; i < job->ninput; i++) {
+			memcpy(result, job->sums[i].arr, sizeof (result));
+			report_result(job->dispatch, job->sets[i].cb,
+				      DELUGE_SUCCESS, result,
+				      job->sets[i].user);
+		}
+	} else if (job->kind == JOB_KEYS) {
+		job->kcb(DELUGE_SUCCESS, slot->ksums, job->user);
+	} else if (job->chunk != NULL) {
+		if (is_host_device(slot->station->prog->dev)) {
+			pthread_mutex_lock(&job->chunk->stream->lock);
+			uint320_add(&job->chunk->stream->sum, &slot->sum);
+			pthread_mutex_unlock(&job->chunk->stream->lock);
+		}
+		complete_chunk(job->chunk, DELUGE_SUCCESS);
+	} else {
+		memcpy(result, slot->sum.arr, sizeof (result));
+		report_result(job->dispatch, job->cb, DELUGE_SUCCESS, result,
+			      job->user);
+	}
+
+	if (profile != NULL) {
+		profile->complete_end = get_time();
+		slot->station->profiler(profile,
+					slot->station->profiler_user);
+	}
+
+	/* the slot release may free the dispatcher */
+	free_job(job);
+
+	release_slot(dispatch, slot);
+}
+
+static void get_command_times(cl_event ev,
+			      struct deluge_highway_command_times *dst)
+{
+	static const cl_profiling_info params[] = {
+		CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+		CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END
+	};
+	cl_ulong times[ARRAY_SIZE(params)];
+	size_t i;
+
+	memset(dst, 0, sizeof (*dst));
+
+	if (ev == NULL)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(params); i++)
+		if (clGetEventProfilingInfo(ev, params[i], sizeof (times[i]),
+					    &times[i], NULL) != CL_SUCCESS)
+			return;
+
+	dst->queued = times[0];
+	dst->submit = times[1];
+	dst->start = times[2];
+	dst->end = times[3];
+}
+
+static void release_job_events(struct job *job)
+{
+	if (job->rdev != NULL)
+		clReleaseEvent(job->rdev);
+	if (job->exev != NULL)
+		clReleaseEvent(job->exev);
+	if (job->hsev != NULL)
+		clReleaseEvent(job->hsev);
+	clReleaseEvent(job->wrev);
+}
+
+static void complete_job(cl_event ev __attribute__ ((unused)),
+			 cl_int status __attribute__ ((unused)), void *ujob)
+{
+	struct deluge_highway_profile profile, *pprofile = NULL;
+	struct job *job = ujob;
+
+	if (job->slot->station->profiler != NULL) {
+		profile.complete_start = get_time();
+		get_command_times(job->wrev, &profile.upload);
+		if (job->hsev != NULL) {
+			get_command_times(job->hsev, &profile.compute);
+			get_command_times(job->exev, &profile.reduce);
+		} else {
+			get_command_times(job->exev, &profile.compute);
+			get_command_times(NULL, &profile.reduce);
+		}
+		get_command_times(job->rdev, &profile.readback);
+		pprofile = &profile;
+	}
+
+	release_job_events(job);
+
+	finish_job(job, pprofile);
+}
+
+/*
+ * Report the failure of a partly launched job once its last enqueued command
+ * completes, then release its slot.
+ */
+static void complete_failed_job(cl_event ev __attribute__ ((unused)),
+				cl_int status __attribute__ ((unused)),
+				void *ujob)
+{
+	struct job *job = ujob;
+	struct deluge_highway *dispatch = job->dispatch;
+	struct slot *slot = job->slot;
+
+	release_job_events(job);
+
+	/* the slot release may free the dispatcher */
+	fail_job(job, job->status);
+
+	release_slot(dispatch, slot);
+}
+
+static void run_host_job(void *ujob)
+{
+	struct deluge_highway_profile profile, *pprofile = NULL;
+	struct job *job = ujob;
+	struct slot *slot = job->slot;
+	struct station *st = slot->station;
+	size_t i, size = HIGHWAY_WIDTH_SIZE(job->width);
+	const uint64_t *offsets = job->input;
+	uint320_t part;
+
+	if (st->profiler != NULL) {
+		memset(&profile, 0, sizeof (profile));
+		profile.compute.queued = job->start;
+		profile.compute.submit = job->start;
+		profile.compute.start = get_time();
+		pprofile = &profile;
+	}
+
+	if (job->kind == JOB_BYTES) {
+		host_hash_sum_bytes(&st->states[job->width], job->input,
+				    job->bytes, job->ninput, &slot->sum);
+		goto out;
+	}
+
+	if (job->kind == JOB_BATCH) {
+		for (i = 0; i < job->ninput; i++)
+			host_hash_sum(&st->states[job->width],
+				      offsets + job->ninput + 1 + offsets[i],
+				      size, offsets[i + 1] - offsets[i],
+				      &job->sums[i]);
+		goto out;
+	}
+
+	if (job->kind == JOB_KEYS) {
+		for (i = 0; i < st->nkey; i++) {
+			host_hash_sum(&st->states[i * HIGHWAY_NWIDTH +
+						  job->width], job->input,
+				      size, job->ninput, &part);
+			memcpy(slot->ksums[i], part.arr, sizeof (part.arr));
+		}
+		goto out;
+	}
+
+	host_hash_sum(&st->states[job->width], job->input, size, job->ninput,
+		      &slot->sum);
+
+	if (job->nremoved > 0) {
+		host_hash_sum(&st->states[job->width], job->removed, size,
+			      job->nremoved, &part);
+		uint320_neg(&part);
+		uint320_add(&slot->sum, &part);
+	}
+ out:
+	if (pprofile != NULL) {
+		profile.compute.end = get_time();
+		profile.complete_start = profile.compute.end;
+	}
+
+	finish_job(job, pprofile);
+}
+
+static void launch_host_job(struct slot *this, struct job *job)
+{
+	job->slot = this;
+	job->task.run = run_host_job;
+	job->task.arg = job;
+
+	host_worker_push(&this->station->worker, &job->task);
+}
+
+/*
+ * Enqueue the transfer of the job input to the slot input buffer.
+ * The removed elements follow the added ones. The input of a byte strings job
+ * is its offsets followed by the bytes of its strings. A batch job is already
+ * packed.
+ */
+static cl_int upload_input(struct slot *this, struct job *job)
+{
+	const uint64_t *offsets = job->input;
+	struct station *st = this->station;
+	size_t osize, bsize;
+	cl_int clret;
+
+	if (job->mapped)
+		return clEnqueueUnmapMemObject(st->upload, this->input,
+					       this->buffer.elems, 0, NULL,
+					       &job->wrev);
+
+	if (job->kind == JOB_BATCH)
+		return clEnqueueWriteBuffer(st->upload, this->input, CL_FALSE,
+					    0, (job->ninput + 1 +
+						offsets[job->ninput]) *
+					    sizeof (*offsets), offsets, 0,
+					    NULL, &job->wrev);
+
+	if ((job->kind == JOB_WORDS) || (job->kind == JOB_KEYS)) {
+		osize = job->ninput * HIGHWAY_WIDTH_SIZE(job->width);
+		bsize = job->nremoved * HIGHWAY_WIDTH_SIZE(job->width);
+
+		if ((osize > 0) || (bsize == 0)) {
+			clret = clEnqueueWriteBuffer(st->upload, this->input,
+						     CL_FALSE, 0, osize,
+						     job->input, 0, NULL,
+						     (bsize == 0) ?
+						     &job->wrev : NULL);
+			if ((clret != CL_SUCCESS) || (bsize == 0))
+				return clret;
+		}
+
+		return clEnqueueWriteBuffer(st->upload, this->input, CL_FALSE,
+					    osize, bsize, job->removed, 0,
+					    NULL, &job->wrev);
+	}
+
+	osize = (job->ninput + 1) * sizeof (*offsets);
+	bsize = offsets[job->ninput] - offsets[0];
+
+	clret = clEnqueueWriteBuffer(st->upload, this->input, CL_FALSE, 0,
+				     osize, offsets, 0, NULL,
+				     (bsize == 0) ? &job->wrev : NULL);
+	if ((clret != CL_SUCCESS) || (bsize == 0))
+		return clret;
+
+	return clEnqueueWriteBuffer(st->upload, this->input, CL_FALSE, osize,
+				    bsize, job->bytes + offsets[0], 0, NULL,
+				    &job->wrev);
+}
+
+/*
+ * Enqueue the sum of the `ngrp` partial sums of each of the `nkey` keys of the
+ * hash kernel after it on the in-order compute queue.
+ */
+static int launch_reduce(struct slot *this, size_t ngrp, size_t nkey,
+			 cl_event *ev)
+{
+	struct station *st = this->station;
+	uint64_t n = ngrp, nk = nkey;
+	size_t lsize;
+	cl_int clret;
+
+	clret = clSetKernelArg(this->reduce, 0, sizeof (n), &n);
+	if (clret != CL_SUCCESS)
+		return deluge_cl_error(clret);
+
+	clret = clSetKernelArg(this->reduce, 3, sizeof (nk), &nk);
+	if (clret != CL_SUCCESS)
+		return deluge_cl_error(clret);
+
+	lsize = st->prog->reduce_wg_size;
+
+	clret = clEnqueueNDRangeKernel(st->compute, this->reduce, 1, NULL,
+				       &lsize, &lsize, 0, NULL, ev);
+	if (clret != CL_SUCCESS)
+		return deluge_cl_error(clret);
+
+	return DELUGE_SUCCESS;
+}
+
+/*
+ * Enqueue the addition of the job sum to the running sum of its stream on the
+ * device, after the previous addition which may run on another station.
+ */
+static int launch_accumulate(struct slot *this, struct job *job, cl_event *ev)
+{
+	struct deluge_highway_stream *stream = job->chunk->stream;
+	struct station *st = this->station;
+	struct device *dev = st->prog->dev;
+	struct stream_device *sdev;
+	size_t size = 1;
+	uint320_t zero;
+	cl_int clret;
+	int err;
+
+	sdev = &stream->devs[dev - stream->dispatch->root->devices];
+
+	pthread_mutex_lock(&stream->lock);
+
+	if (sdev->acc == NULL) {
+		memset(&zero, 0, sizeof (zero));
+		sdev->acc = clCreateBuffer(dev->ctx, CL_MEM_READ_WRITE |
+					   CL_MEM_COPY_HOST_PTR, sizeof (zero),
+					   &zero, &clret);
+		if (clret != CL_SUCCESS) {
+			sdev->acc = NULL;
+			err = deluge_cl_error(clret);
+			goto out;
+		}
+	}
+
+	clret = clSetKernelArg(this->accumulate, 0, sizeof (sdev->acc),
+			       &sdev->acc);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto out;
+	}
+
+	clret = clSetKernelArg(this->accumulate, 1, sizeof (this->output),
+			       &this->output);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto out;
+	}
+
+	clret = clEnqueueNDRangeKernel(st->compute, this->accumulate, 1, NULL,
+				       &size, &size,
+				       (sdev->last != NULL) ? 1 : 0,
+				       (sdev->last != NULL) ? &sdev->last :
+				       NULL, ev);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto out;
+	}
+
+	if (sdev->last != NULL)
+		clReleaseEvent(sdev->last);
+	clRetainEvent(*ev);
+	sdev->last = *ev;
+
+	err = DELUGE_SUCCESS;
+ out:
+	pthread_mutex_unlock(&stream->lock);
+	return err;
+}
+
+/*
+ * Fail with `status` a job whose launch stopped after enqueuing commands.
+ * These commands still use the slot buffers, so the job only fails, and the
+ * slot is only released, once the last of them completes.
+ * Return `DELUGE_SUCCESS` if the failure is deferred this way.
+ */
+static int abort_launch(struct slot *this, struct job *job, int status)
+{
+	struct station *st = this->station;
+	cl_event last;
+	cl_int clret;
+
+	if (job->rdev != NULL)
+		last = job->rdev;
+	else if (job->exev != NULL)
+		last = job->exev;
+	else if (job->hsev != NULL)
+		last = job->hsev;
+	else
+		last = job->wrev;
+
+	job->slot = this;
+	job->status = status;
+
+	clret = clSetEventCallback(last, CL_COMPLETE, complete_failed_job,
+				   job);
+	if (clret == CL_SUCCESS) {
+		clFlush(st->upload);
+		clFlush(st->compute);
+		clFlush(st->readback);
+		return DELUGE_SUCCESS;
+	}
+
+	deluge_cl_error(clret);
+
+	/* the caller reuses the slot once its commands are done */
+	clWaitForEvents(1, &last);
+	release_job_events(job);
+
+	return status;
+}
+
+/*
+ * Launch `job` on the slot, which the job completion releases.
+ * On failure, the job results are not reported and the slot is not released.
+ */
+static int launch_job(struct slot *this, struct job *job)
+{
+	struct station *st = this->station;
+	size_t gsize, lsize, ngrp, dsize, wi_nelem = 1, nkey = 1;
+	uint64_t n, nsub;
+	cl_kernel kern;
+	cl_event *kev;
+	void *dst;
+	cl_int clret;
+	int err;
+
+	job->start = get_time();
+
+	if (is_host_device(st->prog->dev)) {
+		launch_host_job(this, job);
+		return DELUGE_SUCCESS;
+	}
+
+	if (job->kind == JOB_BYTES) {
+		kern = this->hashbytes;
+		lsize = st->prog->hashbytes_wg_size;
+	} else if (job->kind == JOB_BATCH) {
+		kern = this->hashbatch;
+		lsize = st->prog->hashbatch_wg_size;
+	} else if (job->kind == JOB_KEYS) {
+		kern = this->hashkeys;
+		lsize = st->prog->variants[job->width].wg_size;
+		if (lsize > st->prog->hashkeys_wg_size)
+			lsize = st->prog->hashkeys_wg_size;
+		wi_nelem = st->prog->variants[job->width].wi_nelem;
+		nkey = st->nkey;
+	} else {
+		err = get_slot_kernel(this, job->width, &kern);
+		if (err != DELUGE_SUCCESS)
+			goto err;
+		lsize = st->prog->variants[job->width].wg_size;
+		wi_nelem = st->prog->variants[job->width].wi_nelem;
+	}
+
+	n = job->ninput + job->nremoved;
+	nsub = job->nremoved;
+
+	if (job->kind == JOB_BATCH) {
+		/* one work-group per set, their sums are not reduced */
+		ngrp = 1;
+		gsize = n * lsize;
+		dst = job->sums;
+		dsize = n * sizeof (*job->sums);
+	} else {
+		gsize = (n + wi_nelem - 1) / wi_nelem;
+		ngrp = gsize / lsize;
+		if ((gsize % lsize) != 0)
+			ngrp += 1;
+
+		/* the output holds the partial sums of every key */
+		if (ngrp > (st->prog->hashsum_gmem_output_size /
+			    sizeof (uint320_t)) / nkey)
+			ngrp = (st->prog->hashsum_gmem_output_size /
+				sizeof (uint320_t)) / nkey;
+
+		gsize = ngrp * lsize;
+
+		if (job->kind == JOB_KEYS) {
+			dst = this->ksums;
+			dsize = nkey * sizeof (*this->ksums);
+		} else {
+			dst = &this->sum;
+			dsize = sizeof (this->sum);
+		}
+	}
+
+	clret = upload_input(this, job);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err;
+	}
+
+	job->hsev = NULL;
+	job->exev = NULL;
+	job->rdev = NULL;
+
+	clret = clSetKernelArg(kern, 0, sizeof (n), &n);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err_abort;
+	}
+
+	if (job->kind == JOB_WORDS) {
+		clret = clSetKernelArg(kern, 5, sizeof (nsub), &nsub);
+		if (clret != CL_SUCCESS) {
+			err = deluge_cl_error(clret);
+			goto err_abort;
+		}
+	}
+
+	/* a failed reduce must still wait for the hash kernel */
+	kev = (ngrp > 1) ? &job->hsev : &job->exev;
+
+	clret = clEnqueueNDRangeKernel(st->compute, kern,
+				     1, NULL, &gsize, &lsize,
+				     1, &job->wrev, kev);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err_abort;
+	}
+
+	if (ngrp > 1) {
+		err = launch_reduce(this, ngrp, nkey, &job->exev);
+		if (err != DELUGE_SUCCESS)
+			goto err_abort;
+	}
+
+	/* the sum of a streamed job stays on the device */
+	if (job->chunk != NULL) {
+		err = launch_accumulate(this, job, &job->rdev);
+		if (err != DELUGE_SUCCESS)
+			goto err_abort;
+	} else {
+		clret = clEnqueueReadBuffer(st->readback, this->output,
+					    CL_FALSE, 0, dsize, dst, 1,
+					    &job->exev, &job->rdev);
+		if (clret != CL_SUCCESS) {
+			err = deluge_cl_error(clret);
+			goto err_abort;
+		}
+	}
+
+	job->slot = this;
+
+	clret = clSetEventCallback(job->rdev, CL_COMPLETE, complete_job, job);
+	if (clret != CL_SUCCESS) {
+		err = deluge_cl_error(clret);
+		goto err_abort;
+	}
+
+	/*
+	 * Commands waiting for events of other queues only progress once
+	 * these events are submitted to the device.
+	 */
+	clFlush(st->upload);
+	clFlush(st->compute);
+	clFlush(st->readback);
+
+	return DELUGE_SUCCESS;
+ err_abort:
+	return abort_launch(this, job, err);
+ err:
+	return err;
+}
+
+/*
+ * Map the slot input buffer in host memory.
+ * The host stations hash from a buffer allocated on the first mapping.
+ */
+static int map_slot(struct slot *this)
+{
+	struct station *st = this->station;
+	cl_int clret;
+
+	if (is_host_device(st->prog->dev)) {
+		if (this->hostbuf == NULL) {
+			this->hostbuf = malloc(HASHSUM_MAXLEN *
+					       sizeof (*this->hostbuf));
+			if (this->hostbuf == NULL)
+				return deluge_c_error();
+		}
+
+		this->buffer.elems = this->hostbuf;
+		return DELUGE_SUCCESS;
+	}
+
+	this->buffer.elems = clEnqueueMapBuffer(st->upload, this->input,
+						CL_TRUE,
+						CL_MAP_WRITE_INVALIDATE_REGION,
+						0,
+						st->prog->hashsum_gmem_input_size,
+						0, NULL, NULL, &clret);
+	if (clret != CL_SUCCESS)
+		return deluge_cl_error(clret);
+
+	return DELUGE_SUCCESS;
+}
+
+static void unmap_slot(struct slot *this)
+{
+	struct station *st = this->station;
+
+	if (is_host_device(st->prog->dev))
+		return;
+
+	clEnqueueUnmapMemObject(st->upload, this->input, this->buffer.elems,
+				0, NULL, NULL);
+}
+
+static int init_dispatch(struct deluge_highway *this, struct deluge *root,
+			 const uint64_t (*keys)[4], size_t nkey)
+{
+	size_t i;
+	int err;
+
+	/*
+	 * The devices build their programs at the same time in the background,
+	 * each one can have stations as soon as its own program is built.
+	 */
+	for (i = 0; i < root->ndevice; i++)
+		start_device_highway(&root->devices[i]);
+
+	this->keys = malloc(nkey * sizeof (*this->keys));
+	if (this->keys == NULL) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	memcpy(this->keys, keys, nkey * sizeof (*this->keys));
+	this->nkey = nkey;
+
+	err = init_ring(&this->results, RESULT_RING_SIZE);
+	if (err != DELUGE_SUCCESS)
+		goto err_keys;
+
+	this->devs = malloc(root->ndevice * sizeof (*this->devs));
+	if (this->devs == NULL) {
+		err = deluge_c_error();
+		goto err_results;
+	}
+
+	for (i = 0; i < root->ndevice; i++) {
+		err = init_lf_queue(&this->devs[i].freeslots);
+		if (err != DELUGE_SUCCESS)
+			goto err_devs;
+
+		this->devs[i].dev = &root->devices[i];
+		atomic_store_uint64(&this->devs[i].nstation, 0);
+	}
+
+	err = init_lf_queue(&this->jobqueue);
+	if (err != DELUGE_SUCCESS)
+		goto err_devs;
+
+	err = pthread_mutex_init(&this->lock, NULL);
+	if (err != 0) {
+		err = deluge_c_error();
+		goto err_jobqueue;
+	}
+
+	lf_stack_init(&this->jobpool);
+	this->slabs = NULL;
+
+	for (i = 0; i < JOB_NCACHE; i++)
+		this->caches[i].njob = 0;
+
+	for (i = 0; i < HIGHWAY_NWIDTH; i++)
+		atomic_store_uint64(&this->maxlens[i], 0);
+
+	this->depth = DEFAULT_DEPTH;
+	this->specialized = 0;
+	this->widths = 0;
+	this->profiler = NULL;
+	this->profiler_user = NULL;
+	list_init(&this->stations);
+	atomic_store_uint64(&this->stopping, 0);
+	atomic_store_uint64(&this->refcnt, 1);
+	atomic_store_uint64(&this->balance, 0);
+
+	this->root = retain_deluge(root);
+
+	return DELUGE_SUCCESS;
+ err_jobqueue:
+	finlz_lf_queue(&this->jobqueue);
+ err_devs:
+	while (i-- > 0)
+		finlz_lf_queue(&this->devs[i].freeslots);
+	free(this->devs);
+ err_results:
+	finlz_ring(&this->results);
+ err_keys:
+	free(this->keys);
+ err:
+	return err;
+}
+
+static void finlz_dispatch(struct deluge_highway *this)
+{
+	struct highway_program *prog;
+	struct station *station;
+	struct job_slab *slab;
+	struct list *elem;
+	size_t i, depth;
+
+	while ((slab = this->slabs) != NULL) {
+		this->slabs = slab->next;
+		free(slab);
+	}
+
+	while ((elem = list_pop(&this->stations)) != NULL) {
+		station = list_item(elem, struct station, stqueue);
+		prog = station->prog;
+		depth = station->depth;
+
+		free_station(station);
+		free_program(prog, depth);
+	}
+
+	for (i = 0; i < this->root->ndevice; i++)
+		finlz_lf_queue(&this->devs[i].freeslots);
+	free(this->devs);
+
+	release_deluge(this->root);
+	pthread_mutex_destroy(&this->lock);
+	finlz_lf_queue(&this->jobqueue);
+	finlz_ring(&this->results);
+	free(this->keys);
+}
+
+int deluge_highway_create(deluge_t deluge, deluge_highway_t *highway,
+			  const uint64_t key[4])
+{
+	return deluge_highway_create_keys(deluge, highway,
+					  (const uint64_t (*)[4]) key, 1);
+}
+
+int deluge_highway_create_keys(deluge_t deluge, deluge_highway_t *highway,
+			       const uint64_t (*keys)[4], size_t nkey)
+{
+	struct deluge_highway *this;
+	int err;
+
+	if ((nkey == 0) || (nkey > KEYS_MAX)) {
+		err = DELUGE_FAILURE;
+		goto err;
+	}
+
+	this = aligned_alloc(JOB_ALIGN, sizeof (*this));
+	if (this == NULL) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	err = init_dispatch(this, deluge, keys, nkey);
+	if (err != DELUGE_SUCCESS)
+		goto err_this;
+
+	*highway = this;
+
+	return DELUGE_SUCCESS;
+ err_this:
+	free(this);
+ err:
+	*highway = NULL;  /* make gcc happy */
+	return err;
+}
+
+void deluge_highway_destroy(deluge_highway_t highway)
+{
+	uint64_t balance;
+
+	/* nobody polls the results from now on */
+	ring_close(&highway->results);
+
+	atomic_store_uint64(&highway->stopping, 1);
+
+	/* cancel the queued jobs, claiming them as a free slot would */
+	balance = atomic_load_uint64(&highway->balance);
+	while ((int64_t) balance < 0) {
+		if (atomic_cas_uint64(&highway->balance, &balance,
+				      balance + 1)) {
+			fail_job(take_job(highway), DELUGE_CANCEL);
+			balance = atomic_load_uint64(&highway->balance);
+		}
+	}
+
+	put_dispatch(highway);
+}
+
+size_t deluge_highway_space(deluge_highway_t highway)
+{
+	struct deluge *root = highway->root;
+	size_t i, cap, depth;
+
+	pthread_mutex_lock(&highway->lock);
+	depth = highway->depth;
+	pthread_mutex_unlock(&highway->lock);
+
+	cap = 0;
+	for (i = 0; i < root->ndevice; i++) {
+		/* the cost of a station is only known once built */
+		if (wait_device_highway(&root->devices[i]) != DELUGE_SUCCESS)
+			continue;
+		cap += get_program_capacity(&root->devices[i].highway, depth);
+	}
+
+	return cap;
+}
+
+int deluge_highway_set_depth(deluge_highway_t highway, size_t depth)
+{
+	if (depth == 0)
+		return DELUGE_FAILURE;
+
+	pthread_mutex_lock(&highway->lock);
+	highway->depth = depth;
+	pthread_mutex_unlock(&highway->lock);
+
+	return DELUGE_SUCCESS;
+}
+
+int deluge_highway_specialize(deluge_highway_t highway)
+{
+	struct deluge *root = highway->root;
+	struct device *dev;
+	cl_program prog;
+	size_t i;
+	int err;
+
+	/* the devices still building get it with their first station */
+	for (i = 0; i < root->ndevice; i++) {
+		dev = &root->devices[i];
+		if (!has_device_highway(dev))
+			continue;
+
+		err = get_keyed_program(&dev->highway, highway->keys[0],
+					&prog);
+		if (err != DELUGE_SUCCESS)
+			return err;
+	}
+
+	pthread_mutex_lock(&highway->lock);
+	highway->specialized = 1;
+	pthread_mutex_unlock(&highway->lock);
+
+	return DELUGE_SUCCESS;
+}
+
+void deluge_highway_set_profiler(deluge_highway_t highway,
+				 void (*profiler)
+				 (const struct deluge_highway_profile *,
+				  void *),
+				 void *user)
+{
+	pthread_mutex_lock(&highway->lock);
+	highway->profiler = profiler;
+	highway->profiler_user = user;
+	pthread_mutex_unlock(&highway->lock);
+}
+
+int deluge_highway_alloc(deluge_highway_t highway, size_t len)
+{
+	struct deluge *root = highway->root;
+	struct dispatch_device *ddev;
+	struct list nlist, *elem;
+	void (*profiler)(const struct deluge_highway_profile *, void *);
+	struct device **devs, *dev;
+	struct station *station;
+	size_t i, devidx, depth;
+	void *profiler_user;
+	int err, specialized;
+
+	pthread_mutex_lock(&highway->lock);
+	depth = highway->depth;
+	specialized = highway->specialized;
+	profiler = highway->profiler;
+	profiler_user = highway->profiler_user;
+	pthread_mutex_unlock(&highway->lock);
+
+	devs = malloc(len * sizeof (*devs));
+	if (devs == NULL) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	/* only wait for the devices the stations go to */
+	devidx = 0;
+	for (i = 0; i < len; i++) {
+		err = DELUGE_NODEV;
+
+		while (devidx < root->ndevice) {
+			dev = &root->devices[devidx];
+			err = wait_device_highway(dev);
+			if (err == DELUGE_SUCCESS)
+				err = alloc_program(&dev->highway, depth);
+			if (err == DELUGE_SUCCESS) {
+				devs[i] = dev;
+				break;
+			} else {
+				devidx += 1;
+			}
+		}
+
+		if (devidx == root->ndevice)
+			goto err_program;
+	}
+
+	list_init(&nlist);
+
+	for (i = 0; i < len; i++) {
+		err = alloc_station(devs[i], highway->keys, highway->nkey,
+				    depth, specialized, profiler,
+				    profiler_user, &nlist);
+		if (err != DELUGE_SUCCESS)
+			goto err_station;
+	}
+
+	for (elem = nlist.next; elem != &nlist; elem = elem->next) {
+		station = list_item(elem, struct station, stqueue);
+		ddev = get_dispatch_device(highway, station->prog->dev);
+		for (i = 0; i < depth; i++) {
+			station->slots[i].qnode =
+				lf_queue_alloc_node(&ddev->freeslots);
+			if (station->slots[i].qnode == NULL) {
+				err = DELUGE_FAILURE;
+				goto err_nodes;
+			}
+		}
+	}
+
+	err = grow_job_pool(highway, JOBS_PER_SLOT * depth * len);
+	if (err != DELUGE_SUCCESS)
+		goto err_nodes;
+
+	pthread_mutex_lock(&highway->lock);
+
+	/* a new station runs the scheduled widths as soon as released */
+	for (elem = nlist.next; elem != &nlist; elem = elem->next) {
+		station = list_item(elem, struct station, stqueue);
+		for (i = 0; i < HIGHWAY_NWIDTH; i++) {
+			if ((highway->widths & (1u << i)) == 0)
+				continue;
+			err = init_highway_variant(station->prog, i);
+			if (err != DELUGE_SUCCESS) {
+				pthread_mutex_unlock(&highway->lock);
+				goto err_nodes;
+			}
+		}
+	}
+
+	for (elem = nlist.next; elem != &nlist; elem = elem->next) {
+		station = list_item(elem, struct station, stqueue);
+		ddev = get_dispatch_device(highway, station->prog->dev);
+		atomic_add_uint64(&ddev->nstation, 1);
+	}
+
+	/* the next jobs are sized with the devices of the new stations too */
+	for (i = 0; i < HIGHWAY_NWIDTH; i++)
+		atomic_store_uint64(&highway->maxlens[i], 0);
+
+	pthread_mutex_unlock(&highway->lock);
+
+	/* the new slots are released as if they were busy, so they pick the
+	 * jobs queued meanwhile */
+	for (i = 0; i < depth; i++) {
+		for (elem = nlist.next; elem != &nlist; elem = elem->next) {
+			station = list_item(elem, struct station, stqueue);
+			atomic_add_uint64(&highway->refcnt, 1);
+			release_slot(highway, &station->slots[i]);
+		}
+	}
+
+	pthread_mutex_lock(&highway->lock);
+	list_append(&highway->stations, &nlist);
+	pthread_mutex_unlock(&highway->lock);
+
+	free(devs);
+
+	return DELUGE_SUCCESS;
+ err_nodes:
+	for (elem = nlist.next; elem != &nlist; elem = elem->next) {
+		station = list_item(elem, struct station, stqueue);
+		ddev = get_dispatch_device(highway, station->prog->dev);
+		for (i = 0; i < depth; i++)
+			if (station->slots[i].qnode != NULL)
+				lf_queue_free_node(&ddev->freeslots,
+						   station->slots[i].qnode);
+	}
+ err_station:
+	while ((elem = list_pop(&nlist)) != NULL)
+		free_station(list_item(elem, struct station, stqueue));
+	i = len;
+ err_program:
+	while (i-- > 0)
+		free_program(&devs[i]->highway, depth);
+ err:
+	free(devs);
+	return err;
+}
+
+/*
+ * Take a free slot of an idle station.
+ * The station goes back at the other end of the idle list so that the next
+ * jobs go to the other stations before filling its pipeline.
+ */
+static void put_dispatch(struct deluge_highway *this)
+{
+	if (atomic_sub_uint64(&this->refcnt, 1) > 0)
+		return;
+
+	finlz_dispatch(this);
+	free(this);
+}
+
+static struct slot *pop_free_slot(struct dispatch_device *ddev)
+{
+	struct lf_qnode *node;
+	struct slot *slot;
+
+	slot = lf_queue_pop(&ddev->freeslots, &node);
+	if (slot != NULL)
+		slot->qnode = node;
+
+	return slot;
+}
+
+/*
+ * The devices are tried by decreasing throughput, the ones not measured yet
+ * first so that they get measured, and by index among equals.
+ */
+static uint64_t get_device_rank(struct dispatch_device *ddev)
+{
+	uint64_t rate = get_device_rate(ddev->dev);
+
+	return (rate == 0) ? UINT64_MAX : rate;
+}
+
+static int ranks_before(uint64_t arank, size_t aidx, uint64_t brank,
+			size_t bidx)
+{
+	return (arank > brank) || ((arank == brank) && (aidx < bidx));
+}
+
+/*
+ * Pop the free slot counted by the caller, from the `prefer` device if it has
+ * one, otherwise from the fastest device which has one. Wait for the release
+ * of the slot to push it if needed.
+ */
+static struct slot *take_slot(struct deluge_highway *this,
+			      struct dispatch_device *prefer)
+{
+	size_t i, idx, pidx, n = this->root->ndevice;
+	uint64_t rank, best = 0, prank = 0;
+	struct slot *slot;
+
+	while (1) {
+		if (prefer != NULL) {
+			slot = pop_free_slot(prefer);
+			if (slot != NULL)
+				return slot;
+		}
+
+		for (pidx = n; ; pidx = idx, prank = best) {
+			idx = n;
+
+			for (i = 0; i < n; i++) {
+				if (atomic_load_uint64(&this->devs[i].nstation)
+				    == 0)
+					continue;
+
+				rank = get_device_rank(&this->devs[i]);
+
+				/* already tried in this round */
+				if ((pidx < n) &&
+				    !ranks_before(prank, pidx, rank, i))
+					continue;
+
+				if ((idx == n) ||
+				    ranks_before(rank, i, best, idx)) {
+					idx = i;
+					best = rank;
+				}
+			}
+
+			if (idx == n)
+				break;
+
+			slot = pop_free_slot(&this->devs[idx]);
+			if (slot != NULL)
+				return slot;
+		}
+
+		sched_yield();
+	}
+}
+
+/*
+ * Pop the queued job counted by the caller, waiting for its submission to push
+ * it if needed.
+ */
+static struct job *take_job(struct deluge_highway *this)
+{
+	struct lf_qnode *node;
+	struct job *job;
+
+	while ((job = lf_queue_pop(&this->jobqueue, &node)) == NULL)
+		sched_yield();
+
+	job->qnode = node;
+
+	return job;
+}
+
+/*
+ * Take a free slot without queueing anything if there is none.
+ */
+static struct slot *acquire_slot(struct deluge_highway *this)
+{
+	uint64_t balance;
+
+	balance = atomic_load_uint64(&this->balance);
+
+	do {
+		if ((int64_t) balance <= 0)
+			return NULL;
+	} while (!atomic_cas_uint64(&this->balance, &balance, balance - 1));
+
+	atomic_add_uint64(&this->refcnt, 1);
+
+	return take_slot(this, NULL);
+}
+
+/*
+ * Give the slot to the next queued job, or make it free if there is none.
+ * The jobs still queued once the dispatcher is stopping are canceled.
+ */
+static void release_slot(struct deluge_highway *this, struct slot *slot)
+{
+	struct dispatch_device *ddev;
+	struct job *job;
+	int err;
+
+	while ((int64_t) atomic_add_uint64(&this->balance, 1) <= 0) {
+		job = take_job(this);
+
+		if (atomic_load_uint64(&this->stopping)) {
+			fail_job(job, DELUGE_CANCEL);
+			continue;
+		}
+
+		err = launch_job(slot, job);
+		if (err == DELUGE_SUCCESS)
+			return;
+
+		/* the slot is still free for the next queued job */
+		fail_job(job, err);
+	}
+
+	ddev = get_dispatch_device(this, slot->station->prog->dev);
+	lf_queue_push(&ddev->freeslots, slot->qnode, slot);
+
+	put_dispatch(this);
+}
+
+static void init_job(struct deluge_highway *this, struct job *job,
+		     size_t width, const void *elems, size_t nelem,
+		     void (*cb)(int, uint64_t[5], void *), void *user)
+{
+	job->kind = JOB_WORDS;
+	job->width = width;
+	job->input = elems;
+	job->bytes = NULL;
+	job->ninput = nelem;
+	job->removed = NULL;
+	job->nremoved = 0;
+	job->sets = NULL;
+	job->sums = NULL;
+	job->user = user;
+	job->cb = cb;
+	job->kcb = NULL;
+	job->chunk = NULL;
+	list_init(&job->queue);
+	job->dispatch = this;
+	job->target = NULL;
+	job->mapped = 0;
+}
+
+static struct job *alloc_job(struct deluge_highway *this, size_t width,
+			     const void *elems, size_t nelem,
+			     void (*cb)(int, uint64_t[5], void *), void *user)
+{
+	struct job *job;
+
+	job = get_job(this);
+	if (job == NULL)
+		return NULL;
+
+	init_job(this, job, width, elems, nelem, cb, user);
+
+	return job;
+}
+
+static void submit_job(struct deluge_highway *this, struct job *job)
+{
+	struct slot *slot;
+	int err;
+
+	if ((int64_t) atomic_sub_uint64(&this->balance, 1) < 0) {
+		lf_queue_push(&this->jobqueue, job->qnode, job);
+		return;
+	}
+
+	atomic_add_uint64(&this->refcnt, 1);
+
+	slot = take_slot(this, job->target);
+
+	err = launch_job(slot, job);
+	if (err != DELUGE_SUCCESS) {
+		fail_job(job, err);
+		release_slot(this, slot);
+	}
+}
+
+static struct merge *alloc_merge(struct deluge_highway *this,
+				  void (*cb)(int, uint64_t[5], void *),
+				  void *user)
+{
+	struct merge *merge;
+
+	merge = malloc(sizeof (*merge));
+	if (merge == NULL) {
+		deluge_c_error();
+		goto err;
+	}
+
+	if (pthread_mutex_init(&merge->lock, NULL) != 0) {
+		deluge_c_error();
+		goto err_merge;
+	}
+
+	merge->dispatch = this;
+	merge->pending = 0;
+	merge->status = DELUGE_SUCCESS;
+	memset(&merge->sum, 0, sizeof (merge->sum));
+	merge->ksums = NULL;
+	merge->nkey = 0;
+	merge->user = user;
+	merge->cb = cb;
+	merge->kcb = NULL;
+
+	return merge;
+ err_merge:
+	free(merge);
+ err:
+	return NULL;
+}
+
+/*
+ * Allocate a merge of the slices of a `JOB_KEYS` job, with a zero sum for
+ * each key of the dispatcher.
+ */
+static struct merge *alloc_keys_merge(struct deluge_highway *this,
+				       void (*kcb)(int, uint64_t (*)[5],
+						   void *),
+				       void *user)
+{
+	struct merge *merge;
+
+	merge = alloc_merge(this, NULL, user);
+	if (merge == NULL)
+		goto err;
+
+	merge->ksums = calloc(this->nkey, sizeof (*merge->ksums));
+	if (merge->ksums == NULL) {
+		deluge_c_error();
+		goto err_merge;
+	}
+
+	merge->nkey = this->nkey;
+	merge->kcb = kcb;
+
+	return merge;
+ err_merge:
+	pthread_mutex_destroy(&merge->lock);
+	free(merge);
+ err:
+	return NULL;
+}
+
+static void free_merge(struct merge *merge)
+{
+	pthread_mutex_destroy(&merge->lock);
+	free(merge->ksums);
+	free(merge);
+}
+
+static void merge_slice(int status, uint64_t result[5], void *umerge)
+{
+	struct merge *merge = umerge;
+	uint320_t part;
+	int last;
+
+	pthread_mutex_lock(&merge->lock);
+
+	if (status != DELUGE_SUCCESS) {
+		if (merge->status == DELUGE_SUCCESS)
+			merge->status = status;
+	} else {
+		uint320_init_le64(&part, result);
+		uint320_add(&merge->sum, &part);
+	}
+
+	merge->pending -= 1;
+	last = (merge->pending == 0);
+
+	pthread_mutex_unlock(&merge->lock);
+
+	if (!last)
+		return;
+
+	report_result(merge->dispatch, merge->cb, merge->status,
+		      merge->sum.arr, merge->user);
+
+	free_merge(merge);
+}
+
+static void merge_keys_slice(int status, uint64_t (*sums)[5], void *umerge)
+{
+	struct merge *merge = umerge;
+	uint320_t acc, part;
+	size_t k;
+	int last;
+
+	pthread_mutex_lock(&merge->lock);
+
+	if (status != DELUGE_SUCCESS) {
+		if (merge->status == DELUGE_SUCCESS)
+			merge->status = status;
+	} else {
+		for (k = 0; k < merge->nkey; k++) {
+			uint320_init_le64(&acc, merge->ksums[k]);
+			uint320_init_le64(&part, sums[k]);
+			uint320_add(&acc, &part);
+			memcpy(merge->ksums[k], acc.arr, sizeof (acc.arr));
+		}
+	}
+
+	merge->pending -= 1;
+	last = (merge->pending == 0);
+
+	pthread_mutex_unlock(&merge->lock);
+
+	if (!last)
+		return;
+
+	merge->kcb(merge->status, (merge->status == DELUGE_SUCCESS) ?
+		   merge->ksums : NULL, merge->user);
+
+	free_merge(merge);
+}
+
+static void submit_slices(struct deluge_highway *this, struct list *slices)
+{
+	struct list *elem;
+
+	while ((elem = list_pop(slices)) != NULL)
+		submit_job(this, list_item(elem, struct job, queue));
+}
+
+static void free_slices(struct list *slices)
+{
+	struct list *elem;
+
+	while ((elem = list_pop(slices)) != NULL)
+		free_job(list_item(elem, struct job, queue));
+}
+
+/*
+ * Cuts the elements of a large job in slices of at most `maxlen` elements.
+ * Every device gets a share of the elements in proportion of its throughput
+ * times its number of stations so that all the devices complete at about the
+ * same time. The devices not measured yet count as the average of the others.
+ */
+struct slicer
+{
+	struct deluge_highway  *dispatch;
+	size_t                 *shares;  /* elements left for every device */
+	size_t                  maxlen;
+	size_t                  dev;     /* device being sliced */
+	size_t                  nslice;  /* slices left for `dev` */
+};
+
+static void slice_device(struct slicer *this)
+{
+	struct dispatch_device *ddev = &this->dispatch->devs[this->dev];
+	size_t share = this->shares[this->dev];
+	size_t nslice, nstation;
+
+	/* enough slices to fit in the stations and to keep them all busy */
+	nslice = (share + this->maxlen - 1) / this->maxlen;
+	nstation = atomic_load_uint64(&ddev->nstation);
+	if (nstation > (share / SLICE_MINLEN))
+		nstation = share / SLICE_MINLEN;
+	if (nslice < nstation)
+		nslice = nstation;
+
+	this->nslice = nslice;
+}
+
+static int init_slicer(struct slicer *this, struct deluge_highway *dispatch,
+		       size_t nelem, size_t maxlen)
+{
+	size_t i, big, left, n = dispatch->root->ndevice;
+	uint64_t nstation, rate, avg, nrated;
+	unsigned __int128 total;
+
+	this->shares = malloc(n * sizeof (*this->shares));
+	if (this->shares == NULL)
+		return deluge_c_error();
+
+	avg = 0;
+	nrated = 0;
+	for (i = 0; i < n; i++) {
+		rate = get_device_rate(dispatch->devs[i].dev);
+		nstation = atomic_load_uint64(&dispatch->devs[i].nstation);
+		if ((rate != 0) && (nstation != 0)) {
+			avg += rate;
+			nrated += 1;
+		}
+	}
+
+	avg = (nrated == 0) ? 1 : (avg / nrated);
+
+	/* the shares hold the weights of the devices first */
+	total = 0;
+	big = 0;
+	for (i = 0; i < n; i++) {
+		rate = get_device_rate(dispatch->devs[i].dev);
+		nstation = atomic_load_uint64(&dispatch->devs[i].nstation);
+		this->shares[i] = ((rate == 0) ? avg : rate) * nstation;
+		total += this->shares[i];
+		if (this->shares[i] > this->shares[big])
+			big = i;
+	}
+
+	if (total == 0) {
+		/* no station yet, the slices go to the first ones allocated */
+		this->shares[0] = 1;
+		total = 1;
+	}
+
+	left = nelem;
+	for (i = 0; i < n; i++) {
+		this->shares[i] = (((unsigned __int128) nelem) *
+				   this->shares[i]) / total;
+		left -= this->shares[i];
+	}
+
+	this->shares[big] += left;
+
+	this->dispatch = dispatch;
+	this->maxlen = maxlen;
+	this->dev = 0;
+	slice_device(this);
+
+	return DELUGE_SUCCESS;
+}
+
+static void finlz_slicer(struct slicer *this)
+{
+	free(this->shares);
+}
+
+/*
+ * Get the length of the next slice and the device to run it on, or `0` once
+ * every element is sliced.
+ */
+static size_t next_slice(struct slicer *this, struct dispatch_device **target)
+{
+	size_t len;
+
+	while (this->nslice == 0) {
+		this->dev += 1;
+		if (this->dev == this->dispatch->root->ndevice)
+			return 0;
+		slice_device(this);
+	}
+
+	len = (this->shares[this->dev] + this->nslice - 1) / this->nslice;
+
+	this->shares[this->dev] -= len;
+	this->nslice -= 1;
+	*target = &this->dispatch->devs[this->dev];
+
+	return len;
+}
+
+/*
+ * Cut a job too large for a station input buffer into slices, sized by
+ * `struct slicer` for the devices to complete them together.
+ * Every slice is an independent job which prefers its device but goes to any
+ * idle station otherwise. The partial sums are added in `merge_slice()` which
+ * calls the user callback once the last slice completes.
+ */
+static int schedule_split(struct deluge_highway *this, size_t width,
+			  const void *elems, size_t nelem, size_t maxlen,
+			  void (*cb)(int, uint64_t[5], void *), void *user)
+{
+	size_t off, len, size = HIGHWAY_WIDTH_SIZE(width);
+	struct dispatch_device *target;
+	const uint8_t *bytes = elems;
+	struct slicer slicer;
+	struct merge *merge;
+	struct list slices;
+	struct job *job;
+
+	merge = alloc_merge(this, cb, user);
+	if (merge == NULL)
+		goto err;
+
+	if (init_slicer(&slicer, this, nelem, maxlen) != DELUGE_SUCCESS)
+		goto err_merge;
+
+	list_init(&slices);
+
+	for (off = 0; (len = next_slice(&slicer, &target)) > 0; off += len) {
+		job = alloc_job(this, width, bytes + off * size, len,
+				merge_slice, merge);
+		if (job == NULL)
+			goto err_slices;
+
+		job->target = target;
+		list_push(&slices, &job->queue);
+		merge->pending += 1;
+	}
+
+	finlz_slicer(&slicer);
+	submit_slices(this, &slices);
+
+	return DELUGE_SUCCESS;
+ err_slices:
+	free_slices(&slices);
+	finlz_slicer(&slicer);
+ err_merge:
+	free_merge(merge);
+ err:
+	return DELUGE_FAILURE;
+}
+
+/*
+ * Build the program variant of `width` on the devices with stations and get
+ * the number of elements of a job fitting in any of their stations. The first
+ * job of the width does it, the next ones only read the length it left until
+ * a station is allocated. A job sized before a device got stations is still
+ * correct there since every station has the same input buffer, its work-items
+ * only hash more elements each than tuned.
+ */
+static int prepare_width(struct deluge_highway *this, size_t width,
+			 size_t *maxlen)
+{
+	struct highway_program *prog;
+	size_t i;
+	int err;
+
+	*maxlen = atomic_load_uint64(&this->maxlens[width]);
+	if (*maxlen != 0)
+		return DELUGE_SUCCESS;
+
+	pthread_mutex_lock(&this->lock);
+
+	this->widths |= 1u << width;
+
+	*maxlen = HASHSUM_INSIZE / HIGHWAY_WIDTH_SIZE(width);
+	if (*maxlen > HASHSUM_MAXLEN)
+		*maxlen = HASHSUM_MAXLEN;
+
+	for (i = 0; i < this->root->ndevice; i++) {
+		if (atomic_load_uint64(&this->devs[i].nstation) == 0)
+			continue;
+
+		prog = &this->devs[i].dev->highway;
+
+		err = init_highway_variant(prog, width);
+		if (err != DELUGE_SUCCESS)
+			goto out;
+
+		if (prog->variants[width].maxlen < *maxlen)
+			*maxlen = prog->variants[width].maxlen;
+	}
+
+	atomic_store_uint64(&this->maxlens[width], *maxlen);
+
+	err = DELUGE_SUCCESS;
+ out:
+	pthread_mutex_unlock(&this->lock);
+	return err;
+}
+
+static int schedule_width(struct deluge_highway *this, size_t width,
+			  const void *elems, size_t nelem,
+			  void (*cb)(int, uint64_t[5], void *), void *user)
+{
+	uint64_t zero[5] = { 0, 0, 0, 0, 0 };
+	struct job *job;
+	size_t maxlen;
+	int err;
+
+	/* OpenCL rejects empty transfers, an empty job sums to zero */
+	if (nelem == 0) {
+		report_result(this, cb, DELUGE_SUCCESS, zero, user);
+		return DELUGE_SUCCESS;
+	}
+
+	err = prepare_width(this, width, &maxlen);
+	if (err != DELUGE_SUCCESS)
+		return err;
+
+	if (nelem > maxlen)
+		return schedule_split(this, width, elems, nelem, maxlen, cb,
+				      user);
+
+	job = alloc_job(this, width, elems, nelem, cb, user);
+	if (job == NULL)
+		return DELUGE_FAILURE;
+
+	submit_job(this, job);
+
+	return DELUGE_SUCCESS;
+}
+
+int deluge_highway_schedule(deluge_highway_t highway, const uint64_t *elems,
+			    size_t nelem, void (*cb)(int, uint64_t[5], void *),
+			    void *user)
+{
+	return schedule_width(highway, HIGHWAY_DEFAULT_WIDTH, elems, nelem, cb,
+			      user);
+}
+
+int deluge_highway_schedule32(deluge_highway_t highway, const uint32_t *elems,
+			      size_t nelem,
+			      void (*cb)(int, uint64_t[5], void *), void *user)
+{
+	return schedule_width(highway, 0, elems, nelem, cb, user);
+}
+
+int deluge_highway_schedule128(deluge_highway_t highway,
+			       const uint64_t *elems, size_t nelem,
+			       void (*cb)(int, uint64_t[5], void *),
+			       void *user)
+{
+	return schedule_width(highway, 2, elems, nelem, cb, user);
+}
+
+int deluge_highway_schedule256(deluge_highway_t highway,
+			       const uint64_t *elems, size_t nelem,
+			       void (*cb)(int, uint64_t[5], void *),
+			       void *user)
+{
+	return schedule_width(highway, 3, elems, nelem, cb, user);
+}
+
+static struct job *alloc_keys_job(struct deluge_highway *this,
+				  const uint64_t *elems, size_t nelem,
+				  void (*kcb)(int, uint64_t (*)[5], void *),
+				  void *user)
+{
+	struct job *job;
+
+	job = alloc_job(this, HIGHWAY_DEFAULT_WIDTH, elems, nelem, NULL, user);
+	if (job == NULL)
+		return NULL;
+
+	job->kind = JOB_KEYS;
+	job->kcb = kcb;
+
+	return job;
+}
+
+/*
+ * Like `schedule_split()` for a job hashed under every key, the sums of every
+ * key being added apart in `merge_keys_slice()`.
+ */
+static int schedule_keys_split(struct deluge_highway *this,
+			       const uint64_t *elems, size_t nelem,
+			       size_t maxlen,
+			       void (*kcb)(int, uint64_t (*)[5], void *),
+			       void *user)
+{
+	struct dispatch_device *target;
+	struct slicer slicer;
+	struct merge *merge;
+	struct list slices;
+	struct job *job;
+	size_t off, len;
+
+	merge = alloc_keys_merge(this, kcb, user);
+	if (merge == NULL)
+		goto err;
+
+	if (init_slicer(&slicer, this, nelem, maxlen) != DELUGE_SUCCESS)
+		goto err_merge;
+
+	list_init(&slices);
+
+	for (off = 0; (len = next_slice(&slicer, &target)) > 0; off += len) {
+		job = alloc_keys_job(this, elems + off, len, merge_keys_slice,
+				     merge);
+		if (job == NULL)
+			goto err_slices;
+
+		job->target = target;
+		list_push(&slices, &job->queue);
+		merge->pending += 1;
+	}
+
+	finlz_slicer(&slicer);
+	submit_slices(this, &slices);
+
+	return DELUGE_SUCCESS;
+ err_slices:
+	free_slices(&slices);
+	finlz_slicer(&slicer);
+ err_merge:
+	free_merge(merge);
+ err:
+	return DELUGE_FAILURE;
 }
 
-static int alloc_station(struct device *dev, uint64_t key[4], struct list *dst)
+/*
+ * The kernel hashes the elements under every key in turn, so the keys after
+ * the first mostly read them from the device caches.
+ */
+int deluge_highway_schedule_keys(deluge_highway_t highway,
+				 const uint64_t *elems, size_t nelem,
+				 void (*cb)(int, uint64_t (*)[5], void *),
+				 void *user)
 {
-	struct station *station;
+	uint64_t zero[KEYS_MAX][5];
+	struct job *job;
+	size_t maxlen;
 	int err;
 
-	station = malloc(sizeof (*station));
-	if (station == NULL) {
-		err = deluge_c_error();
-		goto err;
+	if (cb == NULL)
+		return DELUGE_FAILURE;
+
+	if (nelem == 0) {
+		memset(zero, 0, sizeof (zero));
+		cb(DELUGE_SUCCESS, zero, user);
+		return DELUGE_SUCCESS;
 	}
 
-	err = init_station(station, &dev->highway, key);
+	err = prepare_width(highway, HIGHWAY_DEFAULT_WIDTH, &maxlen);
 	if (err != DELUGE_SUCCESS)
-		goto err_station;
+		return err;
 
-	list_push(dst, &station->stqueue);
+	if (nelem > maxlen)
+		return schedule_keys_split(highway, elems, nelem, maxlen, cb,
+					   user);
+
+	job = alloc_keys_job(highway, elems, nelem, cb, user);
+	if (job == NULL)
+		return DELUGE_FAILURE;
+
+	submit_job(highway, job);
 
 	return DELUGE_SUCCESS;
- err_station:
-	free(station);
- err:
-	return err;
 }
 
-static void free_station(struct station *station)
+/*
+ * Allocate a job for the `nset` sets of `sets` holding `nelem` elements in
+ * total. The copy of the sets, their sums and their packed input follow the
+ * job in the same allocation.
+ */
+static struct job *alloc_batch_job(struct deluge_highway *this,
+				   const struct deluge_highway_set *sets,
+				   size_t nset, size_t nelem)
 {
-	finlz_station(station);
-	free(station);
+	struct deluge_highway_set *copy;
+	uint64_t *input, off;
+	struct job *job;
+	uint320_t *sums;
+	size_t i;
+
+	job = malloc(sizeof (*job) + nset * sizeof (*sets) +
+		     nset * sizeof (uint320_t) +
+		     (nset + 1 + nelem) * sizeof (uint64_t));
+	if (job == NULL) {
+		deluge_c_error();
+		return NULL;
+	}
+
+	copy = (struct deluge_highway_set *) (job + 1);
+	sums = (uint320_t *) (copy + nset);
+	input = (uint64_t *) (sums + nset);
+
+	for (i = 0, off = 0; i < nset; off += sets[i++].nelem) {
+		input[i] = off;
+		memcpy(input + nset + 1 + off, sets[i].elems,
+		       sets[i].nelem * sizeof (uint64_t));
+	}
+
+	input[nset] = off;
+
+	memcpy(copy, sets, nset * sizeof (*sets));
+
+	job->qnode = lf_queue_alloc_node(&this->jobqueue);
+	if (job->qnode == NULL) {
+		free(job);
+		return NULL;
+	}
+
+	init_job(this, job, HIGHWAY_DEFAULT_WIDTH, input, nset, NULL, NULL);
+
+	job->kind = JOB_BATCH;
+	job->sets = copy;
+	job->sums = sums;
+
+	return job;
 }
 
-static void cancel_job(struct job *job)
+/*
+ * Get the number of sets, from the first of `sets`, which fit in a station
+ * input buffer along with their offsets, and whose sums fit in its output
+ * buffer whatever the device.
+ */
+static size_t get_batch_slice(const struct deluge_highway_set *sets,
+			      size_t nset, size_t *nelem)
 {
-	uint64_t dummy[5];
+	size_t n;
 
-	job->cb(DELUGE_CANCEL, dummy, job->user);
+	*nelem = 0;
 
-	free(job);
+	for (n = 0; (n < nset) && (n < HASHBATCH_MAXSET); n++) {
+		if ((n + 2 + *nelem + sets[n].nelem) > HASHSUM_MAXLEN)
+			break;
+		*nelem += sets[n].nelem;
+	}
+
+	return n;
 }
 
-static void complete_job(cl_event ev __attribute__ ((unused)),
-			 cl_int status __attribute__ ((unused)), void *ujob)
+int deluge_highway_schedule_batch(deluge_highway_t highway,
+				  const struct deluge_highway_set *sets,
+				  size_t nset)
 {
-	struct job *job = ujob;
-	struct station *st = job->station;
-	uint64_t result[5];
+	size_t i, off, len, nelem;
+	struct list slices;
+	struct job *job;
 
-	uint320_sum(st->partsums, job->npart);
+	for (i = 0; i < nset; i++)
+		if ((sets[i].nelem + 2) > HASHSUM_MAXLEN)
+			return DELUGE_FAILURE;
 
-	memcpy(result, st->partsums[0].arr, sizeof (result));
+	list_init(&slices);
 
-	clReleaseEvent(job->rdev);
-	clReleaseEvent(job->exev);
-	clReleaseEvent(job->wrev);
+	for (off = 0; off < nset; off += len) {
+		len = get_batch_slice(sets + off, nset - off, &nelem);
 
-	job->cb(DELUGE_SUCCESS, result, job->user);
+		job = alloc_batch_job(highway, sets + off, len, nelem);
+		if (job == NULL)
+			goto err_slices;
 
-	release_station(job->dispatch, st);
+		list_push(&slices, &job->queue);
+	}
 
-	free(job);
+	submit_slices(highway, &slices);
+
+	return DELUGE_SUCCESS;
+ err_slices:
+	free_slices(&slices);
+	return DELUGE_FAILURE;
 }
 
-static int launch_job(struct station *this, struct job *job)
+/*
+ * Cut the added elements followed by the removed ones in `maxlen` slices.
+ * The slice across both lists hashes the end of the added elements and the
+ * start of the removed ones in one job. The merge starts from `prev`.
+ */
+static int schedule_update_split(struct deluge_highway *this,
+				 const uint64_t prev[5],
+				 const uint64_t *added, size_t nadded,
+				 const uint64_t *removed, size_t nremoved,
+				 size_t maxlen,
+				 void (*cb)(int, uint64_t[5], void *),
+				 void *user)
 {
-	size_t gsize, lsize, ngrp;
-	cl_int clret;
-	int err;
-
-	lsize = this->prog->hashsum_wg_size;
-	gsize = job->ninput;
-	ngrp = gsize / lsize;
-	if ((gsize % lsize) != 0) {
-		ngrp += 1;
-		gsize = ngrp * lsize;
-	}
+	size_t off, len, nadd, nelem = nadded + nremoved;
+	struct dispatch_device *target;
+	struct slicer slicer;
+	struct merge *merge;
+	struct list slices;
+	struct job *job;
 
-	clret = clEnqueueWriteBuffer(this->queue, this->input, CL_FALSE, 0,
-				     job->ninput * sizeof (*job->input),
-				     job->input, 0, NULL, &job->wrev);
- 	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
+	merge = alloc_merge(this, cb, user);
+	if (merge == NULL)
 		goto err;
-	}
 
-	clret = clSetKernelArg(this->hashsum, 0, sizeof (job->ninput),
-			       &job->ninput);
-	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
-		goto err_wrev;
-	}
+	if (init_slicer(&slicer, this, nelem, maxlen) != DELUGE_SUCCESS)
+		goto err_merge;
 
-	clret = clEnqueueNDRangeKernel(this->queue, this->hashsum,
-				     1, NULL, &gsize, &lsize,
-				     1, &job->wrev, &job->exev);
-	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
-		goto err_wrev;
-	}
+	uint320_init_le64(&merge->sum, prev);
+	list_init(&slices);
 
-	clret = clEnqueueReadBuffer(this->queue, this->output, CL_FALSE,
-				    0, ngrp * sizeof (uint320_t),
-				    this->partsums, 1, &job->exev, &job->rdev);
-	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
-		goto err_exev;
-	}
+	for (off = 0; (len = next_slice(&slicer, &target)) > 0; off += len) {
+		nadd = (off < nadded) ? (nadded - off) : 0;
+		if (nadd > len)
+			nadd = len;
 
-	job->station = this;
-	job->npart = ngrp;
+		job = alloc_job(this, HIGHWAY_DEFAULT_WIDTH,
+				(nadd > 0) ? (added + off) : NULL, nadd,
+				merge_slice, merge);
+		if (job == NULL)
+			goto err_slices;
 
-	clret = clSetEventCallback(job->rdev, CL_COMPLETE, complete_job, job);
-	if (clret != CL_SUCCESS) {
-		err = deluge_cl_error(clret);
-		goto err_rdev;
+		if (nadd < len) {
+			job->removed = removed + (off + nadd - nadded);
+			job->nremoved = len - nadd;
+		}
+
+		job->target = target;
+		list_push(&slices, &job->queue);
+		merge->pending += 1;
 	}
 
+	finlz_slicer(&slicer);
+	submit_slices(this, &slices);
+
 	return DELUGE_SUCCESS;
- err_rdev:
-	clReleaseEvent(job->rdev);
- err_exev:
-	clReleaseEvent(job->exev);
- err_wrev:
-	clReleaseEvent(job->wrev);
+ err_slices:
+	free_slices(&slices);
+	finlz_slicer(&slicer);
+ err_merge:
+	free_merge(merge);
  err:
-	return err;
+	return DELUGE_FAILURE;
 }
 
-static int init_dispatch(struct deluge_highway *this, struct deluge *root,
-			 const uint64_t key[4])
+int deluge_highway_update(deluge_highway_t highway, const uint64_t prev[5],
+			  const uint64_t *added, size_t nadded,
+			  const uint64_t *removed, size_t nremoved,
+			  void (*cb)(int, uint64_t[5], void *), void *user)
 {
-	size_t i;
+	uint64_t result[5];
+	size_t maxlen;
 	int err;
 
-	for (i = 0; i < root->ndevice; i++) {
-		if (has_device_highway(&root->devices[i]))
-			continue;
+	if ((nadded + nremoved) == 0) {
+		memcpy(result, prev, sizeof (result));
+		report_result(highway, cb, DELUGE_SUCCESS, result, user);
+		return DELUGE_SUCCESS;
+	}
 
-		err = init_device_highway(&root->devices[i]);
-		if (err != DELUGE_SUCCESS)
-			goto err;
+	err = prepare_width(highway, HIGHWAY_DEFAULT_WIDTH, &maxlen);
+	if (err != DELUGE_SUCCESS)
+		return err;
+
+	return schedule_update_split(highway, prev, added, nadded, removed,
+				     nremoved, maxlen, cb, user);
+}
+
+int deluge_highway_stream_open(deluge_highway_t highway,
+			       deluge_highway_stream_t *stream)
+{
+	struct deluge_highway_stream *this;
+	int err;
+
+	this = malloc(sizeof (*this));
+	if (this == NULL) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	this->devs = calloc(highway->root->ndevice, sizeof (*this->devs));
+	if (this->devs == NULL) {
+		err = deluge_c_error();
+		goto err_this;
 	}
 
-	memcpy(this->key, key, sizeof (this->key));
+	err = pthread_mutex_init(&this->lock, NULL);
+	if (err != 0) {
+		err = deluge_c_error();
+		goto err_devs;
+	}
 
-	err = pthread_mutex_init(&this->qlock, NULL);
+	err = pthread_cond_init(&this->cond, NULL);
 	if (err != 0) {
 		err = deluge_c_error();
-		goto err;
+		goto err_lock;
 	}
 
-	this->stopping = 0;
-	list_init(&this->stidle);
-	list_init(&this->stbusy);
-	list_init(&this->jobqueue);
+	this->dispatch = highway;
+	this->pending = 0;
+	this->status = DELUGE_SUCCESS;
+	memset(&this->sum, 0, sizeof (this->sum));
 
-	this->root = retain_deluge(root);
+	*stream = this;
 
 	return DELUGE_SUCCESS;
+ err_lock:
+	pthread_mutex_destroy(&this->lock);
+ err_devs:
+	free(this->devs);
+ err_this:
+	free(this);
  err:
+	*stream = NULL;
 	return err;
 }
 
-static void finlz_dispatch(struct deluge_highway *this)
+static struct job *alloc_stream_job(struct stream_chunk *chunk,
+				    const uint64_t *elems, size_t nelem)
 {
-	struct list *elem;
+	struct job *job;
 
-	while ((elem = list_pop(&this->stidle)) != NULL)
-		free_station(list_item(elem, struct station, stqueue));
+	job = alloc_job(chunk->stream->dispatch, HIGHWAY_DEFAULT_WIDTH, elems,
+			nelem, NULL, chunk->user);
+	if (job == NULL)
+		return NULL;
 
-	release_deluge(this->root);
-	pthread_mutex_destroy(&this->qlock);
+	job->chunk = chunk;
+
+	return job;
 }
 
-int deluge_highway_create(deluge_t deluge, deluge_highway_t *highway,
-			  const uint64_t key[4])
+/*
+ * The chunks larger than a station are sliced as by `schedule_split()`, every
+ * slice adding to the running sum of the device it runs on.
+ */
+int deluge_highway_stream_append(deluge_highway_stream_t stream,
+				 const uint64_t *elems, size_t nelem,
+				 void (*cb)(int, void *), void *user)
 {
-	struct deluge_highway *this;
+	struct deluge_highway *dispatch = stream->dispatch;
+	struct dispatch_device *target;
+	struct stream_chunk *chunk;
+	struct slicer slicer;
+	struct list slices;
+	size_t off, len, maxlen, njob;
+	struct job *job;
 	int err;
 
-	this = malloc(sizeof (*this));
-	if (this == NULL) {
+	if (nelem == 0) {
+		if (cb != NULL)
+			cb(DELUGE_SUCCESS, user);
+		return DELUGE_SUCCESS;
+	}
+
+	err = prepare_width(dispatch, HIGHWAY_DEFAULT_WIDTH, &maxlen);
+	if (err != DELUGE_SUCCESS)
+		return err;
+
+	chunk = malloc(sizeof (*chunk));
+	if (chunk == NULL) {
 		err = deluge_c_error();
 		goto err;
 	}
 
-	err = init_dispatch(this, deluge, key);
-	if (err != DELUGE_SUCCESS)
-		goto err_this;
+	chunk->stream = stream;
+	chunk->status = DELUGE_SUCCESS;
+	chunk->user = user;
+	chunk->cb = cb;
+
+	list_init(&slices);
+	njob = 0;
+	err = DELUGE_FAILURE;
+
+	if (nelem <= maxlen) {
+		job = alloc_stream_job(chunk, elems, nelem);
+		if (job == NULL)
+			goto err_chunk;
+
+		list_push(&slices, &job->queue);
+		njob = 1;
+	} else {
+		if (init_slicer(&slicer, dispatch, nelem, maxlen) !=
+		    DELUGE_SUCCESS)
+			goto err_chunk;
+
+		for (off = 0; (len = next_slice(&slicer, &target)) > 0;
+		     off += len) {
+			job = alloc_stream_job(chunk, elems + off, len);
+			if (job == NULL) {
+				finlz_slicer(&slicer);
+				goto err_slices;
+			}
 
-	*highway = this;
+			job->target = target;
+			list_push(&slices, &job->queue);
+			njob += 1;
+		}
+
+		finlz_slicer(&slicer);
+	}
+
+	pthread_mutex_lock(&stream->lock);
+	chunk->pending = njob;
+	stream->pending += njob;
+	pthread_mutex_unlock(&stream->lock);
+
+	submit_slices(dispatch, &slices);
 
 	return DELUGE_SUCCESS;
- err_this:
-	free(this);
+ err_slices:
+	free_slices(&slices);
+ err_chunk:
+	free(chunk);
  err:
-	*highway = NULL;  /* make gcc happy */
 	return err;
 }
 
-void deluge_highway_destroy(deluge_highway_t highway)
+/*
+ * Read the running sum of the stream on every device once its jobs completed.
+ * Called with the stream lock held.
+ */
+static int read_stream_sum(struct deluge_highway_stream *this,
+			   uint320_t *dst)
 {
-	struct list *elem;
-	int idle;
+	struct deluge *root = this->dispatch->root;
+	struct stream_device *sdev;
+	cl_command_queue queue;
+	uint320_t part;
+	cl_int clret;
+	size_t i;
+	int err;
+
+	*dst = this->sum;
+
+	for (i = 0; i < root->ndevice; i++) {
+		sdev = &this->devs[i];
+		if (sdev->acc == NULL)
+			continue;
+
+		queue = create_queue(&root->devices[i], 0, &err);
+		if (err != DELUGE_SUCCESS)
+			return err;
+
+		clret = clEnqueueReadBuffer(queue, sdev->acc, CL_TRUE, 0,
+					    sizeof (part), &part,
+					    (sdev->last != NULL) ? 1 : 0,
+					    (sdev->last != NULL) ?
+					    &sdev->last : NULL, NULL);
+		clReleaseCommandQueue(queue);
+		if (clret != CL_SUCCESS)
+			return deluge_cl_error(clret);
+
+		uint320_add(dst, &part);
+	}
+
+	return DELUGE_SUCCESS;
+}
+
+int deluge_highway_stream_snapshot(deluge_highway_stream_t stream,
+				   uint64_t sum[5])
+{
+	uint320_t total;
+	int err;
+
+	pthread_mutex_lock(&stream->lock);
 
-	pthread_mutex_lock(&highway->qlock);
+	while (stream->pending > 0)
+		pthread_cond_wait(&stream->cond, &stream->lock);
 
-	highway->stopping = 1;
+	err = read_stream_sum(stream, &total);
+	if (err == DELUGE_SUCCESS)
+		err = stream->status;
 
-	while ((elem = list_pop(&highway->jobqueue)) != NULL)
-		cancel_job(list_item(elem, struct job, queue));
+	pthread_mutex_unlock(&stream->lock);
 
-	idle = list_empty(&highway->stbusy);
+	memcpy(sum, total.arr, sizeof (total.arr));
 
-	pthread_mutex_unlock(&highway->qlock);
+	return err;
+}
+
+int deluge_highway_stream_finalize(deluge_highway_stream_t stream,
+				   uint64_t sum[5])
+{
+	struct deluge *root = stream->dispatch->root;
+	size_t i;
+	int err;
 
-	if (idle) {
-		finlz_dispatch(highway);
-		free(highway);
+	err = deluge_highway_stream_snapshot(stream, sum);
+
+	for (i = 0; i < root->ndevice; i++) {
+		if (stream->devs[i].last != NULL)
+			clReleaseEvent(stream->devs[i].last);
+		if (stream->devs[i].acc != NULL)
+			clReleaseMemObject(stream->devs[i].acc);
 	}
+
+	pthread_cond_destroy(&stream->cond);
+	pthread_mutex_destroy(&stream->lock);
+	free(stream->devs);
+	free(stream);
+
+	return err;
 }
 
-size_t deluge_highway_space(deluge_highway_t highway)
+size_t deluge_highway_poll(deluge_highway_t highway,
+			   struct deluge_highway_result *results, size_t max)
 {
-	struct deluge *root = highway->root;
-	size_t i, cap;
+	size_t n;
 
-	cap = 0;
-	for (i = 0; i < root->ndevice; i++)
-		cap += get_program_capacity(&root->devices[i].highway);
+	for (n = 0; n < max; n++)
+		if (!ring_pop(&highway->results, &results[n]))
+			break;
 
-	return cap;
+	return n;
 }
 
-int deluge_highway_alloc(deluge_highway_t highway, size_t len)
+int deluge_highway_acquire_buffer(deluge_highway_t highway,
+				  deluge_highway_buffer_t *buffer,
+				  uint64_t **elems, size_t *cap)
 {
-	struct deluge *root = highway->root;
-	struct list nlist, *elem;
-	struct device **devs;
-	size_t i, devidx;
+	struct slot *slot;
+	struct job *job;
 	int err;
 
-	devs = malloc(len * sizeof (*devs));
-	if (devs == NULL) {
-		err = deluge_c_error();
+	slot = acquire_slot(highway);
+	if (slot == NULL) {
+		err = DELUGE_AGAIN;
 		goto err;
 	}
 
-	devidx = 0;
-	for (i = 0; i < len; i++) {
-		err = DELUGE_NODEV;
-
-		while (devidx < root->ndevice) {
-			err = alloc_program(&root->devices[devidx].highway);
-			if (err == DELUGE_SUCCESS) {
-				devs[i] = &root->devices[devidx];
-				break;
-			} else {
-				devidx += 1;
-			}
-		}
-
-		if (devidx == root->ndevice)
-			goto err_program;
+	job = alloc_job(highway, HIGHWAY_DEFAULT_WIDTH, NULL, 0, NULL, NULL);
+	if (job == NULL) {
+		err = DELUGE_FAILURE;
+		goto err_slot;
 	}
 
-	list_init(&nlist);
-
-	for (i = 0; i < len; i++) {
-		err = alloc_station(devs[i], highway->key, &nlist);
-		if (err != DELUGE_SUCCESS)
-			goto err_station;
-	}
+	err = map_slot(slot);
+	if (err != DELUGE_SUCCESS)
+		goto err_job;
 
-	pthread_mutex_lock(&highway->qlock);
-	list_append(&highway->stidle, &nlist);
-	pthread_mutex_unlock(&highway->qlock);
+	slot->buffer.job = job;
 
-	free(devs);
+	*buffer = &slot->buffer;
+	*elems = slot->buffer.elems;
+	*cap = HASHSUM_MAXLEN;
 
 	return DELUGE_SUCCESS;
- err_station:
-	while ((elem = list_pop(&nlist)) != NULL)
-		free_station(list_item(elem, struct station, stqueue));
-	i = len;
- err_program:
-	while (i-- > 0)
-		free_program(&devs[i]->highway);
+ err_job:
+	free_job(job);
+ err_slot:
+	release_slot(highway, slot);
  err:
-	free(devs);
 	return err;
 }
 
-static struct station *acquire_station(struct deluge_highway *this)
+int deluge_highway_submit_buffer(deluge_highway_buffer_t buffer, size_t nelem,
+				 void (*cb)(int, uint64_t[5], void *),
+				 void *user)
 {
-	struct list *elem = NULL;
+	uint64_t zero[5] = { 0, 0, 0, 0, 0 };
+	struct job *job = buffer->job;
+	int err;
 
-	pthread_mutex_lock(&this->qlock);
+	if (nelem > HASHSUM_MAXLEN)
+		return DELUGE_FAILURE;
 
-	elem = list_pop(&this->stidle);
-	if (elem == NULL)
-		goto out;
+	if (nelem == 0) {
+		report_result(job->dispatch, cb, DELUGE_SUCCESS, zero, user);
+		deluge_highway_release_buffer(buffer);
+		return DELUGE_SUCCESS;
+	}
 
-	list_push(&this->stbusy, elem);
+	job->input = buffer->elems;
+	job->ninput = nelem;
+	job->user = user;
+	job->cb = cb;
+	job->mapped = 1;
 
- out:
-	pthread_mutex_unlock(&this->qlock);
+	err = launch_job(buffer->slot, job);
+	if (err != DELUGE_SUCCESS) {
+		/* the launch failed before unmapping the buffer */
+		deluge_highway_release_buffer(buffer);
+		return err;
+	}
 
-	if (elem == NULL)
-		return NULL;
-	return list_item(elem, struct station, stqueue);
+	return DELUGE_SUCCESS;
 }
 
-static void release_station(struct deluge_highway *this, struct station *s)
+void deluge_highway_release_buffer(deluge_highway_buffer_t buffer)
 {
-	struct list *ejob;
-	int idle;
+	struct deluge_highway *dispatch = buffer->job->dispatch;
 
-	pthread_mutex_lock(&this->qlock);
+	unmap_slot(buffer->slot);
+	free_job(buffer->job);
+	release_slot(dispatch, buffer->slot);
+}
 
-	if (this->stopping)
-		ejob = NULL;
-	else
-		ejob = list_pop(&this->jobqueue);
+/*
+ * Get the number of strings, from the first of `offsets`, which fit in a
+ * station input buffer along with their offsets.
+ */
+static size_t get_bytes_slice(const uint64_t *offsets, size_t nstr)
+{
+	size_t n;
 
-	if (ejob == NULL) {
-		list_remove(&s->stqueue);
-		list_push(&this->stidle, &s->stqueue);		
+	for (n = 0; n < nstr; n++) {
+		if (((n + 2) * sizeof (uint64_t) + offsets[n + 1] - offsets[0])
+		    > HASHSUM_INSIZE)
+			break;
 	}
 
-	idle = list_empty(&this->stbusy);
-
-	pthread_mutex_unlock(&this->qlock);
-
-	if (this->stopping && idle) {
-		finlz_dispatch(this);
-		free(this);
-	} else if (ejob != NULL) {
-		launch_job(s, list_item(ejob, struct job, queue));
-	}
+	return n;
 }
 
-static void enqueue_job(struct deluge_highway *this, struct job *job)
+static struct job *alloc_bytes_job(struct deluge_highway *this,
+				   const uint64_t *offsets,
+				   const uint8_t *bytes, size_t nstr,
+				   void (*cb)(int, uint64_t[5], void *),
+				   void *user)
 {
-	pthread_mutex_lock(&this->qlock);
-	list_push(&this->jobqueue, &job->queue);
-	pthread_mutex_unlock(&this->qlock);
+	struct job *job;
+
+	job = alloc_job(this, HIGHWAY_BYTES_WIDTH, offsets, nstr, cb, user);
+	if (job == NULL)
+		return NULL;
+
+	job->kind = JOB_BYTES;
+	job->bytes = bytes;
+
+	return job;
 }
 
-int deluge_highway_schedule(deluge_highway_t highway, const uint64_t *elems,
-			    size_t nelem, void (*cb)(int, uint64_t[5], void *),
-			    void *user)
+/*
+ * Cut the strings in as many slices as needed to fit in the station input
+ * buffers, as `schedule_split()` does for elements.
+ */
+static int schedule_bytes_split(struct deluge_highway *this,
+				const uint64_t *offsets, const uint8_t *bytes,
+				size_t nstr,
+				void (*cb)(int, uint64_t[5], void *),
+				void *user)
 {
-	struct station *station;
+	struct merge *merge;
+	struct list slices;
+	size_t off, len;
 	struct job *job;
 	int err;
 
-	job = malloc(sizeof (*job));
-	if (job == NULL) {
-		err = deluge_c_error();
+	merge = alloc_merge(this, cb, user);
+	if (merge == NULL) {
+		err = DELUGE_FAILURE;
 		goto err;
 	}
 
-	job->input = elems;
-	job->ninput = nelem;
-	job->user = user;
-	job->cb = cb;
-	list_init(&job->queue);
-	job->dispatch = highway;
+	list_init(&slices);
 
-	station = acquire_station(highway);
-	if (station == NULL) {
-		enqueue_job(highway, job);
-		goto out;
+	for (off = 0; off < nstr; off += len) {
+		len = get_bytes_slice(offsets + off, nstr - off);
+		if (len == 0) {
+			err = DELUGE_FAILURE;
+			goto err_slices;
+		}
+
+		job = alloc_bytes_job(this, offsets + off, bytes, len,
+				      merge_slice, merge);
+		if (job == NULL) {
+			err = DELUGE_FAILURE;
+			goto err_slices;
+		}
+
+		list_push(&slices, &job->queue);
+		merge->pending += 1;
 	}
 
-	launch_job(station, job);
- out:
+	submit_slices(this, &slices);
+
 	return DELUGE_SUCCESS;
+ err_slices:
+	free_slices(&slices);
+	free_merge(merge);
  err:
 	return err;
 }
+
+int deluge_highway_schedule_bytes(deluge_highway_t highway,
+				  const uint64_t *offsets, const void *bytes,
+				  size_t nstr,
+				  void (*cb)(int, uint64_t[5], void *),
+				  void *user)
+{
+	uint64_t zero[5] = { 0, 0, 0, 0, 0 };
+	struct job *job;
+
+	if (nstr == 0) {
+		report_result(highway, cb, DELUGE_SUCCESS, zero, user);
+		return DELUGE_SUCCESS;
+	}
+
+	if (get_bytes_slice(offsets, nstr) < nstr)
+		return schedule_bytes_split(highway, offsets, bytes, nstr, cb,
+					    user);
+
+	job = alloc_bytes_job(highway, offsets, bytes, nstr, cb, user);
+	if (job == NULL)
+		return DELUGE_FAILURE;
+
+	submit_job(highway, job);
+
+	return DELUGE_SUCCESS;
+}
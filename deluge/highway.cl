@@ -2,6 +2,33 @@
 #include "deluge/uint.h"
 
 
+/*
+ * Size in bytes of the `hash_sum` elements, set by the program variant.
+ */
+#ifndef ELEM_SIZE
+#  define ELEM_SIZE  8
+#endif
+
+#if ELEM_SIZE == 4
+#  define ELEM_WIDTH  0
+#elif ELEM_SIZE == 8
+#  define ELEM_WIDTH  1
+#elif ELEM_SIZE == 16
+#  define ELEM_WIDTH  2
+#elif ELEM_SIZE == 32
+#  define ELEM_WIDTH  3
+#else
+#  error "unsupported ELEM_SIZE"
+#endif
+
+/*
+ * Set by the host to build `hash_sum` for a single key, see `update_first()`.
+ */
+#if defined (KEY_FIRST) && (ELEM_SIZE > 8)
+#  error "KEY_FIRST needs the packets to only fill the lane 0"
+#endif
+
+
 static void zipper_merge_and_add(const uint64_t v1, const uint64_t v0,
                                  uint64_t *restrict add1,
 				 uint64_t *restrict add0)
@@ -80,15 +107,68 @@ static void finalize_256(highway_t *restrict st, generic uint64_t hash[4])
                           &hash[3], &hash[2]);
 }
 
-static void hash(highway_t *restrict st, uint256_t *restrict h, uint64_t d)
+/*
+ * Load the packet of the element `gid`.
+ * The length dependent part of the remainder update is already applied to
+ * the initial state, so the packet is the only part depending on the element.
+ */
+static void load_elem(uint64_t lanes[4], global const uint64_t *gin,
+		      size_t gid)
 {
-        uint64_t lanes[4];
-
-	lanes[0] = d;
+#if ELEM_SIZE == 4
+	lanes[0] = ((global const uint32_t *) gin)[gid];
+	lanes[1] = 0;
+	lanes[2] = 0;
+	lanes[3] = 0;
+#elif ELEM_SIZE == 8
+	lanes[0] = gin[gid];
 	lanes[1] = 0;
 	lanes[2] = 0;
 	lanes[3] = 0;
+#elif ELEM_SIZE == 16
+	lanes[0] = gin[2 * gid];
+	lanes[1] = gin[2 * gid + 1];
+	lanes[2] = 0;
+	lanes[3] = gin[2 * gid + 1] & 0xffffffff00000000ull;
+#else
+	lanes[0] = gin[4 * gid];
+	lanes[1] = gin[4 * gid + 1];
+	lanes[2] = gin[4 * gid + 2];
+	lanes[3] = gin[4 * gid + 3];
+#endif
+}
+
+#if defined (KEY_FIRST)
+
+/*
+ * State of the key the program is built for, with the part of the first
+ * update that does not depend on the element already applied: the lanes 2 and
+ * 3 are fully updated and the lane 1 stops before its zipper merge with the
+ * lane 0.
+ */
+constant highway_t key_first = KEY_FIRST;
 
+/*
+ * First update of a reset state with a packet only filling the lane 0.
+ */
+static void update_first(const uint64_t lanes[4], highway_t *restrict st)
+{
+	*st = key_first;
+
+	st->v1[0] += st->mul0[0] + lanes[0];
+	st->mul0[0] ^= (st->v1[0] & 0xffffffff) * (st->v0[0] >> 32);
+	st->v0[0] += st->mul1[0];
+	st->mul1[0] ^= (st->v0[0] & 0xffffffff) * (st->v1[0] >> 32);
+
+	zipper_merge_and_add(st->v1[1], st->v1[0], &st->v0[1], &st->v0[0]);
+	zipper_merge_and_add(st->v0[1], st->v0[0], &st->v1[1], &st->v1[0]);
+}
+
+#endif  /* defined (KEY_FIRST) */
+
+static void hash(highway_t *restrict st, uint256_t *restrict h,
+		 const uint64_t lanes[4])
+{
         update(lanes, st);
 
 	finalize_256(st, h->arr);
@@ -101,39 +181,313 @@ static void reduction_320(size_t n, local uint320_t *mem,
 {
 	size_t last_group = get_num_groups(0) - 1;
 	size_t group_size = get_local_size(0);
+	private uint320_t acc;
 
-	uint320_init_be64(&mem[get_local_id(0)], val);
+	uint320_init_be64(&acc, val);
 
 	if (get_group_id(0) == last_group)
 		n = n - last_group * group_size;
 	else
 		n = group_size;
 
-	uint320_sum(mem, n);
+	uint320_reduce(mem, &acc, n);
 }
 
+/*
+ * Every work-item adds the digests of the elements `gid`, `gid + gsize`, ...
+ * in registers with deferred carries, so the carries and the work-group
+ * reduction are paid once for all of them.
+ * The host launches fewer work-items than elements, each group starting
+ * before the `n`th element.
+ * The `initial_st` array holds the initial state of every element width, it
+ * is not read when the program is built for a single key.
+ * The digests of the `nsub` last elements are subtracted from the sum.
+ */
 kernel void hash_sum(uint64_t n, global const uint64_t *gin,
 		     constant const highway_t *restrict initial_st,
-		     global uint320_t *gout, local uint320_t *lmem)
+		     global uint320_t *gout, local uint320_t *lmem,
+		     uint64_t nsub)
 {
-	private uint64_t elem, h[5];
+	size_t gsize = get_global_size(0);
+	size_t lsize = get_local_size(0);
+	private uint64_t lanes[4], h[5];
+	private uint320_t acc, part;
+	private uint320_acc_t sum;
 	private uint256_t digest;
 	private highway_t st;
 	size_t gid;
 
-	gid = get_global_id(0);
-	if (gid >= n)
+	uint320_acc_init(&sum);
+
+	for (gid = get_global_id(0); gid < n; gid += gsize) {
+		/* compute highway hash */
+		load_elem(lanes, gin, gid);
+#if defined (KEY_FIRST)
+		update_first(lanes, &st);
+		finalize_256(&st, digest.arr);
+#else
+		st = initial_st[ELEM_WIDTH];
+		hash(&st, &digest, lanes);
+#endif
+
+		h[0] = 0;
+		h[1] = digest.arr[0];
+		h[2] = digest.arr[1];
+		h[3] = digest.arr[2];
+		h[4] = digest.arr[3];
+
+		uint320_init_be64(&part, h);
+		if (gid >= (n - nsub))
+			uint320_neg(&part);
+		uint320_acc_add(&sum, &part);
+	}
+
+	uint320_acc_norm(&acc, &sum);
+
+	/* the work-items past the elements hold zero, no need to add them */
+	n -= get_group_id(0) * lsize;
+	if (n > lsize)
+		n = lsize;
+
+	uint320_reduce(lmem, &acc, n);
+
+	if (get_local_id(0) != 0)
 		return;
 
-	/* compute highway hash */
-	st = *initial_st;
-	hash(&st, &digest, gin[gid]);
+	gout[get_group_id(0)] = lmem[0];
+}
+
+#if (ELEM_SIZE == 8) && !defined (KEY_FIRST)
 
-	h[0] = 0;
-	h[1] = digest.arr[0];
-	h[2] = digest.arr[1];
-	h[3] = digest.arr[2];
-	h[4] = digest.arr[3];
+
+/*
+ * The kernels below do not depend on the element width or the key, they are
+ * only built in the default variant.
+ */
+
+/*
+ * Sum the `n` partial sums of every key `k` of `gio`, from `gio[k * n]`, into
+ * `gio[k]` with a single work-group. The sums of a key are only written over
+ * the partial sums of the keys already reduced.
+ */
+kernel void reduce_sum(uint64_t n, global uint320_t *gio,
+		       local uint320_t *lmem, uint64_t nkey)
+{
+	size_t lid = get_local_id(0);
+	size_t lsize = get_local_size(0);
+	size_t nact = (n > lsize) ? lsize : n;
+	private uint320_acc_t sum;
+	private uint320_t acc;
+	uint64_t i, k;
+
+	for (k = 0; k < nkey; k++) {
+		uint320_acc_init(&sum);
+
+		for (i = lid; i < n; i += lsize)
+			uint320_acc_add(&sum, &gio[k * n + i]);
+
+		uint320_acc_norm(&acc, &sum);
+
+		uint320_reduce(lmem, &acc, nact);
+
+		if (lid == 0)
+			gio[k] = lmem[0];
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+/*
+ * Add the sum `gin[0]` to the running sum `gio[0]` of a stream, with a single
+ * work-item. The additions to the same running sum are ordered by the host.
+ */
+kernel void accumulate_sum(global uint320_t *gio, global const uint320_t *gin)
+{
+	private uint320_t acc, part;
+
+	acc = gio[0];
+	part = gin[0];
+
+	uint320_add(&acc, &part);
+
+	gio[0] = acc;
+}
+
+/*
+ * Like `hash_sum` once for every key, the `initial_st` array holding the
+ * states of every width of the key `k` from `k * HIGHWAY_NWIDTH`. The partial
+ * sum of the key `k` goes to `gout[k * get_num_groups(0) + group]`.
+ */
+kernel void hash_sum_keys(uint64_t n, global const uint64_t *gin,
+			  constant const highway_t *restrict initial_st,
+			  global uint320_t *gout, local uint320_t *lmem,
+			  uint64_t nkey)
+{
+	size_t gsize = get_global_size(0);
+	size_t lsize = get_local_size(0);
+	size_t grp = get_group_id(0);
+	private uint64_t lanes[4], h[5];
+	private uint320_t acc, part;
+	private uint320_acc_t sum;
+	private uint256_t digest;
+	private highway_t st;
+	size_t gid, nact;
+	uint64_t k;
+
+	nact = n - grp * lsize;
+	if (nact > lsize)
+		nact = lsize;
+
+	for (k = 0; k < nkey; k++) {
+		uint320_acc_init(&sum);
+
+		for (gid = get_global_id(0); gid < n; gid += gsize) {
+			load_elem(lanes, gin, gid);
+			st = initial_st[k * HIGHWAY_NWIDTH + ELEM_WIDTH];
+			hash(&st, &digest, lanes);
+
+			h[0] = 0;
+			h[1] = digest.arr[0];
+			h[2] = digest.arr[1];
+			h[3] = digest.arr[2];
+			h[4] = digest.arr[3];
+
+			uint320_init_be64(&part, h);
+			uint320_acc_add(&sum, &part);
+		}
+
+		uint320_acc_norm(&acc, &sum);
+
+		uint320_reduce(lmem, &acc, nact);
+
+		if (get_local_id(0) == 0)
+			gout[k * get_num_groups(0) + grp] = lmem[0];
+
+		/* the next reduction reuses the local memory */
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+static uint64_t load_le64(global const uint8_t *bytes)
+{
+	uint64_t ret = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		ret = (ret << 8) | bytes[i];
+
+	return ret;
+}
+
+static void update_packet(global const uint8_t *bytes, highway_t *restrict st)
+{
+	uint64_t lanes[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		lanes[i] = load_le64(bytes + 8 * i);
+
+	update(lanes, st);
+}
+
+static void rotate_32_by(uint64_t count, uint64_t lanes[4])
+{
+	uint32_t half0, half1;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		half0 = lanes[i] & 0xffffffff;
+		half1 = (lanes[i] >> 32);
+		lanes[i] = (half0 << count) | (half0 >> (32 - count));
+		lanes[i] |= (uint64_t) ((half1 << count) |
+					(half1 >> (32 - count))) << 32;
+	}
+}
+
+static void set_packet_byte(uint64_t packet[4], size_t idx, uint8_t byte)
+{
+	packet[idx / 8] |= ((uint64_t) byte) << (8 * (idx % 8));
+}
+
+static void update_remainder(global const uint8_t *bytes, size_t size_mod32,
+			     highway_t *restrict st)
+{
+	size_t size_mod4 = size_mod32 & 3;
+	size_t i, size_div4 = size_mod32 & ~3;
+	global const uint8_t *remainder = bytes + size_div4;
+	uint64_t packet[4] = { 0, 0, 0, 0 };
+
+	for (i = 0; i < 4; i++)
+		st->v0[i] += (((uint64_t) size_mod32) << 32) + size_mod32;
+
+	rotate_32_by(size_mod32, st->v1);
+
+	for (i = 0; i < size_div4; i++)
+		set_packet_byte(packet, i, bytes[i]);
+
+	if (size_mod32 & 16) {
+		for (i = 0; i < 4; i++)
+			set_packet_byte(packet, 28 + i,
+					remainder[i + size_mod4 - 4]);
+	} else if (size_mod4) {
+		set_packet_byte(packet, 16, remainder[0]);
+		set_packet_byte(packet, 17, remainder[size_mod4 >> 1]);
+		set_packet_byte(packet, 18, remainder[size_mod4 - 1]);
+	}
+
+	update(packet, st);
+}
+
+/*
+ * Full highway hash of `size` bytes from a freshly reset state.
+ */
+static void hash_bytes(highway_t *restrict st, uint256_t *restrict h,
+		       global const uint8_t *bytes, size_t size)
+{
+	size_t i;
+
+	for (i = 0; (i + 32) <= size; i += 32)
+		update_packet(bytes + i, st);
+
+	if ((size & 31) != 0)
+		update_remainder(bytes + i, size & 31, st);
+
+	finalize_256(st, h->arr);
+}
+
+
+/*
+ * The input holds the `n + 1` offsets of the strings followed by the strings
+ * bytes. String `i` spans from `gin[i]` to `gin[i + 1]`, relative to `gin[0]`
+ * at the start of the bytes.
+ */
+kernel void hash_sum_bytes(uint64_t n, global const uint64_t *gin,
+			   constant const highway_t *restrict initial_st,
+			   global uint320_t *gout, local uint320_t *lmem)
+{
+	global const uint8_t *bytes;
+	private uint256_t digest;
+	private highway_t st;
+	private uint64_t h[5];
+	size_t gid, i;
+
+	gid = get_global_id(0);
+	bytes = (global const uint8_t *) (gin + n + 1);
+
+	for (i = 0; i < 5; i++)
+		h[i] = 0;
+
+	/* the work-items past the strings take part in the reduction */
+	if (gid < n) {
+		st = initial_st[HIGHWAY_BYTES_WIDTH];
+		hash_bytes(&st, &digest, bytes + (gin[gid] - gin[0]),
+			   gin[gid + 1] - gin[gid]);
+
+		h[1] = digest.arr[0];
+		h[2] = digest.arr[1];
+		h[3] = digest.arr[2];
+		h[4] = digest.arr[3];
+	}
 
 	reduction_320(n, lmem, h);
 
@@ -142,3 +496,60 @@ kernel void hash_sum(uint64_t n, global const uint64_t *gin,
 
 	gout[get_group_id(0)] = lmem[0];
 }
+
+
+/*
+ * The input holds the `n + 1` offsets of the sets followed by their elements.
+ * Set `i` spans from element `gin[i]` to `gin[i + 1]` and its sum is computed
+ * by the work-group `i` into `gout[i]`.
+ */
+kernel void hash_sum_batch(uint64_t n, global const uint64_t *gin,
+			   constant const highway_t *restrict initial_st,
+			   global uint320_t *gout, local uint320_t *lmem)
+{
+	size_t lid = get_local_id(0);
+	size_t lsize = get_local_size(0);
+	size_t grp = get_group_id(0);
+	global const uint64_t *elems;
+	private uint64_t lanes[4], h[5];
+	private uint256_t digest;
+	private uint320_t acc, part;
+	private uint320_acc_t sum;
+	private highway_t st;
+	uint64_t i, start, end;
+
+	elems = gin + n + 1;
+	start = gin[grp];
+	end = gin[grp + 1];
+
+	uint320_acc_init(&sum);
+
+	for (i = start + lid; i < end; i += lsize) {
+		load_elem(lanes, elems, i);
+		st = initial_st[ELEM_WIDTH];
+		hash(&st, &digest, lanes);
+
+		h[0] = 0;
+		h[1] = digest.arr[0];
+		h[2] = digest.arr[1];
+		h[3] = digest.arr[2];
+		h[4] = digest.arr[3];
+
+		uint320_init_be64(&part, h);
+		uint320_acc_add(&sum, &part);
+	}
+
+	uint320_acc_norm(&acc, &sum);
+
+	if ((end - start) < lsize)
+		lsize = (end > start) ? (end - start) : 1;
+
+	uint320_reduce(lmem, &acc, lsize);
+
+	if (lid != 0)
+		return;
+
+	gout[grp] = lmem[0];
+}
+
+#endif  /* (ELEM_SIZE == 8) && !defined (KEY_FIRST) */
@@ -27,20 +27,60 @@ typedef struct {
 } highway_t;
 
 
+/*
+ * Element widths of the hash sum kernels.
+ * Width `w` has elements of `HIGHWAY_WIDTH_SIZE(w)` bytes. Each width has its
+ * own initial state and the byte strings use the one of the widest elements,
+ * which is the state reset with the key only.
+ */
+#define HIGHWAY_NWIDTH             4
+#define HIGHWAY_WIDTH_SIZE(_w)     (4ul << (_w))
+#define HIGHWAY_DEFAULT_WIDTH      1
+#define HIGHWAY_BYTES_WIDTH        (HIGHWAY_NWIDTH - 1)
+
+
 #if !defined (__OPENCL_VERSION__)
 
 
 #include "deluge/atomic.h"
+#include "deluge/list.h"
+#include <pthread.h>
 
 
 struct device;
 
+/*
+ * The hash sum kernel compiled for an element width.
+ * A job holds at most `maxlen` elements of this width. The kernel runs in
+ * work-groups of `wg_size` work-items which hash `wi_nelem` elements each,
+ * both tuned for the device. The variant is built under the program lock and
+ * never changes once `ready` is set, so it is then read without the lock.
+ */
+struct highway_variant
+{
+	atomic_uint64_t ready;
+	cl_program      prog;
+	size_t          wg_size;
+	size_t          wi_nelem;
+	size_t          maxlen;
+};
+
 struct highway_program
 {
 	struct device  *dev;
 	cl_program      prog;
+	const char     *options;           /* compile options of the programs */
+	int             subgroups;         /* reduce one value per sub-group */
+	pthread_mutex_t lock;
+	struct highway_variant variants[HIGHWAY_NWIDTH]; /* built under lock */
+	struct list     keyed;             /* protected by lock */
 	size_t          hashsum_wg_size;
 	size_t          hashsum_wg_max;
+	size_t          hashbytes_wg_size;
+	size_t          hashbytes_wg_max;
+	size_t          hashbatch_wg_size;
+	size_t          hashkeys_wg_size;
+	size_t          reduce_wg_size;
 	size_t          hashsum_gmem_input_size;
 	size_t          hashsum_gmem_output_size;
 	size_t          hashsum_lmem_size;
@@ -50,6 +90,12 @@ int init_highway_program(struct highway_program *this, struct device *dev);
 
 void finlz_highway_program(struct highway_program *this);
 
+/*
+ * Build the program variant for the elements of width `width` if not done
+ * yet. The default width is built by `init_highway_program()`.
+ */
+int init_highway_variant(struct highway_program *this, size_t width);
+
 
 #endif  /* !defined (__OPENCL_VERSION__) */
 
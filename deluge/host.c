@@ -0,0 +1,320 @@
+#include <deluge.h>
+#include "deluge/error.h"
+#include "deluge/highway.h"
+#include "deluge/host.h"
+#include "deluge/list.h"
+#include "deluge/uint.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined (__x86_64__)
+#  include <immintrin.h>
+#endif
+
+
+/*
+ * Set by `finlz_host_worker()` when called from a task of the worker running
+ * on the current thread, since the worker memory is freed once it returns.
+ */
+static __thread int worker_released;
+
+
+static void *worker_main(void *uthis)
+{
+	struct host_worker *this = uthis;
+	struct host_task *task;
+	struct list *elem;
+
+	pthread_mutex_lock(&this->lock);
+
+	while (1) {
+		if (list_empty(&this->tasks)) {
+			if (this->stopping)
+				break;
+			pthread_cond_wait(&this->cond, &this->lock);
+			continue;
+		}
+
+		elem = this->tasks.next;
+		list_remove(elem);
+		task = list_item(elem, struct host_task, queue);
+
+		pthread_mutex_unlock(&this->lock);
+
+		task->run(task->arg);
+
+		if (worker_released)
+			return NULL;
+
+		pthread_mutex_lock(&this->lock);
+	}
+
+	pthread_mutex_unlock(&this->lock);
+
+	return NULL;
+}
+
+int init_host_worker(struct host_worker *this)
+{
+	int err;
+
+	err = pthread_mutex_init(&this->lock, NULL);
+	if (err != 0) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	err = pthread_cond_init(&this->cond, NULL);
+	if (err != 0) {
+		err = deluge_c_error();
+		goto err_lock;
+	}
+
+	list_init(&this->tasks);
+	this->stopping = 0;
+
+	err = pthread_create(&this->thread, NULL, worker_main, this);
+	if (err != 0) {
+		err = deluge_c_error();
+		goto err_cond;
+	}
+
+	return DELUGE_SUCCESS;
+ err_cond:
+	pthread_cond_destroy(&this->cond);
+ err_lock:
+	pthread_mutex_destroy(&this->lock);
+ err:
+	return err;
+}
+
+void finlz_host_worker(struct host_worker *this)
+{
+	pthread_mutex_lock(&this->lock);
+	this->stopping = 1;
+	pthread_cond_signal(&this->cond);
+	pthread_mutex_unlock(&this->lock);
+
+	if (pthread_equal(pthread_self(), this->thread)) {
+		worker_released = 1;
+		pthread_detach(this->thread);
+	} else {
+		pthread_join(this->thread, NULL);
+	}
+
+	pthread_cond_destroy(&this->cond);
+	pthread_mutex_destroy(&this->lock);
+}
+
+void host_worker_push(struct host_worker *this, struct host_task *task)
+{
+	pthread_mutex_lock(&this->lock);
+	list_push(&this->tasks, &task->queue);
+	pthread_cond_signal(&this->cond);
+	pthread_mutex_unlock(&this->lock);
+}
+
+
+/*
+ * Store in `dst` the sum of digests accumulated as 32-bit halves.
+ * The digest word `i` has the weight 2^(64 * (3 - i)) in the 320-bit sum, as
+ * in the `hash_sum` kernel.
+ */
+static void host_sum_halves(uint320_t *dst, const uint64_t lo[4],
+			    const uint64_t hi[4])
+{
+	uint320_acc_t sum;
+	size_t i, limb;
+
+	uint320_acc_init(&sum);
+
+	for (i = 0; i < 4; i++) {
+		limb = 3 - i;
+		sum.arr[2 * limb] = lo[i];
+		sum.arr[2 * limb + 1] = hi[i];
+	}
+
+	uint320_acc_norm(dst, &sum);
+}
+
+
+typedef uint64_t vec1_t __attribute__ ((vector_size (8)));
+
+#define SIMD_VEC            vec1_t
+#define SIMD_NAME(_n)       _n ## _generic
+#define SIMD_MUL32(_a, _b)  (((_a) & 0xffffffff) * ((_b) >> 32))
+#include "deluge/simd.h"
+#undef SIMD_MUL32
+#undef SIMD_NAME
+#undef SIMD_VEC
+
+
+/*
+ * The strings have different lengths so they are hashed one at a time with the
+ * single lane functions of the generic kernel.
+ */
+static uint64_t load_le64(const uint8_t *bytes)
+{
+	uint64_t ret = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		ret = (ret << 8) | bytes[i];
+
+	return ret;
+}
+
+static void rotate_32_by(uint64_t count, vec1_t lanes[4])
+{
+	uint32_t half0, half1;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		half0 = lanes[i][0] & 0xffffffff;
+		half1 = (lanes[i][0] >> 32);
+		lanes[i][0] = (half0 << count) | (half0 >> (32 - count));
+		lanes[i][0] |= (uint64_t) ((half1 << count) |
+					   (half1 >> (32 - count))) << 32;
+	}
+}
+
+static void set_packet_byte(vec1_t packet[4], size_t idx, uint8_t byte)
+{
+	packet[idx / 8][0] |= ((uint64_t) byte) << (8 * (idx % 8));
+}
+
+static void update_remainder(const uint8_t *bytes, size_t size_mod32,
+			     highway_t_generic *restrict st)
+{
+	size_t size_mod4 = size_mod32 & 3;
+	size_t i, size_div4 = size_mod32 & ~3;
+	const uint8_t *remainder = bytes + size_div4;
+	vec1_t packet[4] = { {}, {}, {}, {} };
+
+	for (i = 0; i < 4; i++)
+		st->v0[i] += (((uint64_t) size_mod32) << 32) + size_mod32;
+
+	rotate_32_by(size_mod32, st->v1);
+
+	for (i = 0; i < size_div4; i++)
+		set_packet_byte(packet, i, bytes[i]);
+
+	if (size_mod32 & 16) {
+		for (i = 0; i < 4; i++)
+			set_packet_byte(packet, 28 + i,
+					remainder[i + size_mod4 - 4]);
+	} else if (size_mod4) {
+		set_packet_byte(packet, 16, remainder[0]);
+		set_packet_byte(packet, 17, remainder[size_mod4 >> 1]);
+		set_packet_byte(packet, 18, remainder[size_mod4 - 1]);
+	}
+
+	update_generic(packet, st);
+}
+
+static void hash_bytes(highway_t_generic *restrict st, vec1_t digest[4],
+		       const uint8_t *bytes, size_t size)
+{
+	vec1_t lanes[4];
+	size_t i, j;
+
+	for (i = 0; (i + 32) <= size; i += 32) {
+		for (j = 0; j < 4; j++)
+			lanes[j][0] = load_le64(bytes + i + 8 * j);
+		update_generic(lanes, st);
+	}
+
+	if ((size & 31) != 0)
+		update_remainder(bytes + i, size & 31, st);
+
+	finalize_256_generic(st, digest);
+}
+
+void host_hash_sum_bytes(const highway_t *initial, const uint64_t *offsets,
+			 const uint8_t *bytes, size_t n, uint320_t *dst)
+{
+	highway_t_generic reset, st;
+	uint64_t lo[4], hi[4];
+	vec1_t digest[4];
+	size_t i, j;
+
+	for (i = 0; i < 4; i++) {
+		reset.v0[i][0] = initial->v0[i];
+		reset.v1[i][0] = initial->v1[i];
+		reset.mul0[i][0] = initial->mul0[i];
+		reset.mul1[i][0] = initial->mul1[i];
+		lo[i] = 0;
+		hi[i] = 0;
+	}
+
+	for (j = 0; j < n; j++) {
+		st = reset;
+		hash_bytes(&st, digest, bytes + offsets[j],
+			   offsets[j + 1] - offsets[j]);
+
+		for (i = 0; i < 4; i++) {
+			lo[i] += digest[i][0] & 0xffffffff;
+			hi[i] += digest[i][0] >> 32;
+		}
+	}
+
+	host_sum_halves(dst, lo, hi);
+}
+
+
+#if defined (__x86_64__)
+
+
+typedef uint64_t vec4_t __attribute__ ((vector_size (32)));
+
+#pragma GCC push_options
+#pragma GCC target ("avx2")
+#define SIMD_VEC            vec4_t
+#define SIMD_NAME(_n)       _n ## _avx2
+#define SIMD_MUL32(_a, _b)					\
+	((vec4_t) _mm256_mul_epu32((__m256i) (_a), (__m256i) ((_b) >> 32)))
+#include "deluge/simd.h"
+#undef SIMD_MUL32
+#undef SIMD_NAME
+#undef SIMD_VEC
+#pragma GCC pop_options
+
+
+typedef uint64_t vec8_t __attribute__ ((vector_size (64)));
+
+#pragma GCC push_options
+#pragma GCC target ("avx512f")
+#define SIMD_VEC            vec8_t
+#define SIMD_NAME(_n)       _n ## _avx512
+#define SIMD_MUL32(_a, _b)					\
+	((vec8_t) _mm512_mul_epu32((__m512i) (_a), (__m512i) ((_b) >> 32)))
+#include "deluge/simd.h"
+#undef SIMD_MUL32
+#undef SIMD_NAME
+#undef SIMD_VEC
+#pragma GCC pop_options
+
+
+void host_hash_sum(const highway_t *initial, const void *elems, size_t size,
+		   size_t n, uint320_t *dst)
+{
+	if (__builtin_cpu_supports("avx512f"))
+		hash_sum_avx512(initial, elems, size, n, dst);
+	else if (__builtin_cpu_supports("avx2"))
+		hash_sum_avx2(initial, elems, size, n, dst);
+	else
+		hash_sum_generic(initial, elems, size, n, dst);
+}
+
+
+#else  /* !defined (__x86_64__) */
+
+
+void host_hash_sum(const highway_t *initial, const void *elems, size_t size,
+		   size_t n, uint320_t *dst)
+{
+	hash_sum_generic(initial, elems, size, n, dst);
+}
+
+
+#endif  /* !defined (__x86_64__) */
@@ -0,0 +1,67 @@
+#ifndef _DELUGE_HOST_H_
+#define _DELUGE_HOST_H_
+
+
+#include "deluge/highway.h"
+#include "deluge/list.h"
+#include "deluge/uint.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * A task run by a host worker thread.
+ * The task memory is owned by the caller of `host_worker_push()` and must stay
+ * valid until `run` is called.
+ */
+struct host_task
+{
+	struct list   queue;
+	void        (*run)(void *arg);
+	void         *arg;
+};
+
+/*
+ * A thread running host tasks in submission order.
+ * Host workers back the compute stations of the host device.
+ */
+struct host_worker
+{
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+	struct list      tasks;
+	int              stopping;
+};
+
+int init_host_worker(struct host_worker *this);
+
+/*
+ * Stop the worker thread once its pending tasks are done.
+ * This can be called from a task run by the worker itself, in which case the
+ * thread exits as soon as the task returns.
+ */
+void finlz_host_worker(struct host_worker *this);
+
+void host_worker_push(struct host_worker *this, struct host_task *task);
+
+
+/*
+ * Compute the sum mod 2^320 of the highway hashes of `n` elements of `size`
+ * bytes, with `initial` the state prepared for this size.
+ * Use the widest vector instructions supported by the running CPU.
+ */
+void host_hash_sum(const highway_t *initial, const void *elems, size_t size,
+		   size_t n, uint320_t *dst);
+
+/*
+ * Compute the sum mod 2^320 of the highway hashes of `n` byte strings.
+ * String `i` spans from `bytes + offsets[i]` to `bytes + offsets[i + 1]` and
+ * `initial` is the state reset with the key only.
+ */
+void host_hash_sum_bytes(const highway_t *initial, const uint64_t *offsets,
+			 const uint8_t *bytes, size_t n, uint320_t *dst);
+
+
+#endif
@@ -0,0 +1,167 @@
+#include <deluge.h>
+#include "deluge/atomic.h"
+#include "deluge/error.h"
+#include "deluge/lfqueue.h"
+#include "deluge/list.h"
+#include <stdlib.h>
+
+
+void lf_stack_init(struct lf_stack *this)
+{
+	atomic_store_tagged(&this->top, NULL, 0);
+}
+
+void lf_stack_push(struct lf_stack *this, struct lf_node *node)
+{
+	tagged_ptr_t top;
+
+	do {
+		top = atomic_load_tagged(&this->top);
+		__atomic_store_n(&node->next, top.ptr, __ATOMIC_SEQ_CST);
+	} while (!atomic_cas_tagged(&this->top, top, node));
+}
+
+struct lf_node *lf_stack_pop(struct lf_stack *this)
+{
+	struct lf_node *node, *next;
+	tagged_ptr_t top;
+
+	do {
+		top = atomic_load_tagged(&this->top);
+		node = top.ptr;
+		if (node == NULL)
+			return NULL;
+
+		/* the node may be popped and pushed again meanwhile, then the
+		 * tag makes the swap fail */
+		next = __atomic_load_n(&node->next, __ATOMIC_SEQ_CST);
+	} while (!atomic_cas_tagged(&this->top, top, next));
+
+	return node;
+}
+
+
+struct lf_qnode *lf_queue_alloc_node(struct lf_queue *this)
+{
+	struct lf_qnode *node;
+	struct lf_node *link;
+
+	link = lf_stack_pop(&this->free);
+	if (link != NULL)
+		return list_item(link, struct lf_qnode, link);
+
+	node = malloc(sizeof (*node));
+	if (node == NULL) {
+		deluge_c_error();
+		return NULL;
+	}
+
+	atomic_store_tagged(&node->next, NULL, 0);
+
+	node->all = __atomic_load_n(&this->all, __ATOMIC_SEQ_CST);
+	while (!__atomic_compare_exchange_n(&this->all, &node->all, node, 0,
+					    __ATOMIC_SEQ_CST,
+					    __ATOMIC_SEQ_CST))
+		;
+
+	return node;
+}
+
+void lf_queue_free_node(struct lf_queue *this, struct lf_qnode *node)
+{
+	lf_stack_push(&this->free, &node->link);
+}
+
+int init_lf_queue(struct lf_queue *this)
+{
+	struct lf_qnode *dummy;
+
+	lf_stack_init(&this->free);
+	this->all = NULL;
+
+	dummy = lf_queue_alloc_node(this);
+	if (dummy == NULL)
+		return DELUGE_FAILURE;
+
+	atomic_store_tagged(&this->head, dummy, 0);
+	atomic_store_tagged(&this->tail, dummy, 0);
+
+	return DELUGE_SUCCESS;
+}
+
+void finlz_lf_queue(struct lf_queue *this)
+{
+	struct lf_qnode *node, *next;
+
+	for (node = this->all; node != NULL; node = next) {
+		next = node->all;
+		free(node);
+	}
+}
+
+void lf_queue_push(struct lf_queue *this, struct lf_qnode *node, void *val)
+{
+	tagged_ptr_t tail, next;
+	struct lf_qnode *last;
+
+	__atomic_store_n(&node->val, val, __ATOMIC_SEQ_CST);
+	next = atomic_load_tagged(&node->next);
+	atomic_store_tagged(&node->next, NULL, next.tag);
+
+	while (1) {
+		tail = atomic_load_tagged(&this->tail);
+		last = tail.ptr;
+		next = atomic_load_tagged(&last->next);
+
+		if (tail.raw != atomic_load_tagged(&this->tail).raw)
+			continue;
+
+		if (next.ptr != NULL) {
+			/* help a push which linked its node but did not move
+			 * the tail yet */
+			atomic_cas_tagged(&this->tail, tail, next.ptr);
+			continue;
+		}
+
+		if (atomic_cas_tagged(&last->next, next, node))
+			break;
+	}
+
+	atomic_cas_tagged(&this->tail, tail, node);
+}
+
+void *lf_queue_pop(struct lf_queue *this, struct lf_qnode **node)
+{
+	tagged_ptr_t head, tail, next;
+	struct lf_qnode *first;
+	void *val;
+
+	while (1) {
+		head = atomic_load_tagged(&this->head);
+		tail = atomic_load_tagged(&this->tail);
+		first = head.ptr;
+		next = atomic_load_tagged(&first->next);
+
+		if (head.raw != atomic_load_tagged(&this->head).raw)
+			continue;
+
+		if (head.ptr == tail.ptr) {
+			if (next.ptr == NULL)
+				return NULL;
+			atomic_cas_tagged(&this->tail, tail, next.ptr);
+			continue;
+		}
+
+		/* read before the swap, the node can be recycled after */
+		val = __atomic_load_n(&((struct lf_qnode *) next.ptr)->val,
+				      __ATOMIC_SEQ_CST);
+
+		if (atomic_cas_tagged(&this->head, head, next.ptr))
+			break;
+	}
+
+	/* the popped value is now in the new dummy node */
+	*node = first;
+
+	return val;
+}
@@ -0,0 +1,80 @@
+#ifndef _DELUGE_LFQUEUE_H_
+#define _DELUGE_LFQUEUE_H_
+
+
+#include "deluge/atomic.h"
+
+
+/*
+ * A lock-free stack of nodes (Treiber stack).
+ * The nodes must not be freed while other threads may still pop them, so they
+ * are recycled rather than freed.
+ */
+struct lf_node
+{
+	struct lf_node       *next;
+};
+
+struct lf_stack
+{
+	atomic_tagged_ptr_t   top;
+};
+
+void lf_stack_init(struct lf_stack *this);
+
+void lf_stack_push(struct lf_stack *this, struct lf_node *node);
+
+/*
+ * Return NULL if the stack is empty.
+ */
+struct lf_node *lf_stack_pop(struct lf_stack *this);
+
+
+/*
+ * A lock-free FIFO queue of values (Michael and Scott queue).
+ * A value is pushed with a node owned by the caller and popping a value gives
+ * back the ownership of another node. The nodes are allocated from and
+ * recycled to a free list of the queue, and only freed with the queue, even
+ * those still owned by someone.
+ */
+struct lf_qnode
+{
+	atomic_tagged_ptr_t   next;
+	void                 *val;
+	struct lf_node        link;    /* in the free list */
+	struct lf_qnode      *all;
+};
+
+struct lf_queue
+{
+	atomic_tagged_ptr_t   head;
+	atomic_tagged_ptr_t   tail;
+	struct lf_stack       free;
+	struct lf_qnode      *all;     /* every node ever allocated */
+};
+
+int init_lf_queue(struct lf_queue *this);
+
+/*
+ * Free every node of the queue.
+ */
+void finlz_lf_queue(struct lf_queue *this);
+
+/*
+ * Get a node from the free list, or allocate one if it is empty.
+ * Return NULL if the allocation fails.
+ */
+struct lf_qnode *lf_queue_alloc_node(struct lf_queue *this);
+
+void lf_queue_free_node(struct lf_queue *this, struct lf_qnode *node);
+
+void lf_queue_push(struct lf_queue *this, struct lf_qnode *node, void *val);
+
+/*
+ * Pop the oldest value and set `node` to a node now owned by the caller.
+ * Return NULL if the queue is empty.
+ */
+void *lf_queue_pop(struct lf_queue *this, struct lf_qnode **node);
+
+
+#endif
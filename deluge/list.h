@@ -27,6 +27,11 @@ static inline void list_push(struct list *this, struct list *elem)
 	elem->prev->next = elem;
 }
 
+static inline void list_push_front(struct list *this, struct list *elem)
+{
+	list_push(this->next, elem);
+}
+
 static inline struct list *list_pop(struct list *this)
 {
 	struct list *ret = this->prev;
@@ -64,6 +64,7 @@ const char *opencl_errstr(cl_int err)
         __ERR_STRING(CL_INVALID_COMPILER_OPTIONS       )
         __ERR_STRING(CL_INVALID_LINKER_OPTIONS         )
         __ERR_STRING(CL_INVALID_DEVICE_PARTITION_COUNT )
+        __ERR_STRING(CL_PLATFORM_NOT_FOUND_KHR         )
         default: return "Unknown OpenCL error code";
         }
 }
@@ -43,6 +43,11 @@ typedef unsigned long  uint64_t;
 #include <stdio.h>
 
 
+#ifndef CL_PLATFORM_NOT_FOUND_KHR
+#  define CL_PLATFORM_NOT_FOUND_KHR  -1001
+#endif
+
+
 const char *opencl_errstr(cl_int ret);
 
 
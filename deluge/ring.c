@@ -0,0 +1,219 @@
+#include <deluge.h>
+#include "deluge/atomic.h"
+#include "deluge/error.h"
+#include "deluge/ring.h"
+#include <stdlib.h>
+
+
+#define OVERFLOW_MINCAP  64
+
+
+int init_ring(struct ring *this, size_t size)
+{
+	size_t i;
+	int err;
+
+	this->entries = malloc(size * sizeof (*this->entries));
+	if (this->entries == NULL) {
+		err = deluge_c_error();
+		goto err;
+	}
+
+	err = pthread_mutex_init(&this->lock, NULL);
+	if (err != 0) {
+		err = deluge_c_error();
+		goto err_entries;
+	}
+
+	for (i = 0; i < size; i++)
+		atomic_store_uint64(&this->entries[i].seq, i);
+
+	this->mask = size - 1;
+	atomic_store_uint64(&this->head, 0);
+	atomic_store_uint64(&this->tail, 0);
+	atomic_store_uint64(&this->closed, 0);
+	atomic_store_uint64(&this->noverflow, 0);
+	this->overflow = NULL;
+	this->ofirst = 0;
+	this->ocap = 0;
+
+	return DELUGE_SUCCESS;
+ err_entries:
+	free(this->entries);
+ err:
+	return err;
+}
+
+void finlz_ring(struct ring *this)
+{
+	pthread_mutex_destroy(&this->lock);
+	free(this->overflow);
+	free(this->entries);
+}
+
+/*
+ * Push a result in the entries. Return 0 if they are full.
+ */
+static int push_entry(struct ring *this,
+		      const struct deluge_highway_result *result)
+{
+	struct ring_entry *entry;
+	uint64_t pos, seq;
+	int64_t diff;
+
+	pos = atomic_load_uint64(&this->tail);
+
+	while (1) {
+		entry = &this->entries[pos & this->mask];
+		seq = atomic_load_uint64(&entry->seq);
+		diff = (int64_t) (seq - pos);
+
+		if (diff == 0) {
+			if (atomic_cas_uint64(&this->tail, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			/* full, the entry still holds a result of the
+			 * previous round */
+			return 0;
+		} else {
+			pos = atomic_load_uint64(&this->tail);
+		}
+	}
+
+	entry->result = *result;
+	atomic_store_uint64(&entry->seq, pos + 1);
+
+	return 1;
+}
+
+/*
+ * Double the capacity of the overflow, keeping its results in order.
+ * Called with the lock held.
+ */
+static int grow_overflow(struct ring *this, size_t len)
+{
+	struct deluge_highway_result *arr;
+	size_t i, cap;
+
+	cap = (this->ocap == 0) ? OVERFLOW_MINCAP : (2 * this->ocap);
+
+	arr = malloc(cap * sizeof (*arr));
+	if (arr == NULL)
+		return deluge_c_error();
+
+	for (i = 0; i < len; i++)
+		arr[i] = this->overflow[(this->ofirst + i) % this->ocap];
+
+	free(this->overflow);
+	this->overflow = arr;
+	this->ofirst = 0;
+	this->ocap = cap;
+
+	return DELUGE_SUCCESS;
+}
+
+/*
+ * A result which cannot be stored for lack of memory is lost, as the pushing
+ * thread is completing a job and cannot wait.
+ */
+static void push_overflow(struct ring *this,
+			  const struct deluge_highway_result *result)
+{
+	size_t len;
+
+	pthread_mutex_lock(&this->lock);
+
+	len = atomic_load_uint64(&this->noverflow);
+
+	if ((len == this->ocap) && (grow_overflow(this, len) != DELUGE_SUCCESS))
+		goto out;
+
+	this->overflow[(this->ofirst + len) % this->ocap] = *result;
+	atomic_add_uint64(&this->noverflow, 1);
+ out:
+	pthread_mutex_unlock(&this->lock);
+}
+
+static int pop_overflow(struct ring *this,
+			struct deluge_highway_result *result)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&this->lock);
+
+	if (atomic_load_uint64(&this->noverflow) > 0) {
+		*result = this->overflow[this->ofirst];
+		this->ofirst = (this->ofirst + 1) % this->ocap;
+		atomic_sub_uint64(&this->noverflow, 1);
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(&this->lock);
+
+	return ret;
+}
+
+void ring_push(struct ring *this, const struct deluge_highway_result *result)
+{
+	if (atomic_load_uint64(&this->closed))
+		return;
+
+	/* once a result overflows, the next ones queue after it */
+	if ((atomic_load_uint64(&this->noverflow) == 0) &&
+	    push_entry(this, result))
+		return;
+
+	push_overflow(this, result);
+}
+
+/*
+ * Pop a result from the entries. Return 0 if they are empty.
+ */
+static int pop_entry(struct ring *this, struct deluge_highway_result *result)
+{
+	struct ring_entry *entry;
+	uint64_t pos, seq;
+	int64_t diff;
+
+	pos = atomic_load_uint64(&this->head);
+
+	while (1) {
+		entry = &this->entries[pos & this->mask];
+		seq = atomic_load_uint64(&entry->seq);
+		diff = (int64_t) (seq - (pos + 1));
+
+		if (diff == 0) {
+			if (atomic_cas_uint64(&this->head, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = atomic_load_uint64(&this->head);
+		}
+	}
+
+	*result = entry->result;
+	atomic_store_uint64(&entry->seq, pos + this->mask + 1);
+
+	return 1;
+}
+
+/*
+ * The overflow only holds results pushed after the ones of the entries, so it
+ * is only popped once they are empty.
+ */
+int ring_pop(struct ring *this, struct deluge_highway_result *result)
+{
+	if (pop_entry(this, result))
+		return 1;
+
+	if (atomic_load_uint64(&this->noverflow) == 0)
+		return 0;
+
+	return pop_overflow(this, result);
+}
+
+void ring_close(struct ring *this)
+{
+	atomic_store_uint64(&this->closed, 1);
+}
@@ -0,0 +1,65 @@
+#ifndef _DELUGE_RING_H_
+#define _DELUGE_RING_H_
+
+
+#include <deluge.h>
+#include "deluge/atomic.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct ring_entry
+{
+	atomic_uint64_t               seq;
+	struct deluge_highway_result  result;
+};
+
+/*
+ * A lock-free queue of job results.
+ * Any thread can push or pop. A position is claimed by moving `tail` or `head`
+ * forward and the entry sequence number tells whether it is written yet, so a
+ * reader never sees a half written result.
+ * The results pushed while the entries are full go to a growing `overflow`
+ * under `lock` instead, and so do the next ones until it is emptied, so the
+ * results are still popped in order.
+ */
+struct ring
+{
+	struct ring_entry  *entries;
+	uint64_t            mask;
+	atomic_uint64_t     head;
+	atomic_uint64_t     tail;
+	atomic_uint64_t     closed;
+	atomic_uint64_t     noverflow;
+	pthread_mutex_t     lock;
+	struct deluge_highway_result *overflow;  /* circular, protected by lock */
+	size_t              ofirst;
+	size_t              ocap;
+};
+
+/*
+ * Initialize a ring of `size` entries, which must be a power of two.
+ */
+int init_ring(struct ring *this, size_t size);
+
+void finlz_ring(struct ring *this);
+
+/*
+ * Push a result without ever waiting, growing the overflow if needed.
+ * Once the ring is closed, results are discarded instead.
+ */
+void ring_push(struct ring *this, const struct deluge_highway_result *result);
+
+/*
+ * Pop the oldest result. Return 0 if the ring is empty.
+ */
+int ring_pop(struct ring *this, struct deluge_highway_result *result);
+
+/*
+ * Discard the results from now on, as nobody pops anymore.
+ */
+void ring_close(struct ring *this);
+
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Host hash sum kernel template.
+ * This file is included by `deluge/host.c` once per vector width with the
+ * following macros defined:
+ *   SIMD_VEC          a vector type of 64-bit lanes, one lane per element
+ *   SIMD_NAME(_n)     the name of the `_n` symbol for this width
+ *   SIMD_MUL32(_a,_b) the 64-bit product of the low halves of `_a` and the
+ *                     high halves of `_b`
+ * The highway state is kept as a structure of arrays: every field of the
+ * scalar `highway_t` becomes a vector holding the field for each element.
+ */
+
+
+typedef struct
+{
+	SIMD_VEC v0[4];
+	SIMD_VEC v1[4];
+	SIMD_VEC mul0[4];
+	SIMD_VEC mul1[4];
+} SIMD_NAME(highway_t);
+
+
+static inline void SIMD_NAME(zipper_merge_and_add)(const SIMD_VEC v1,
+						   const SIMD_VEC v0,
+						   SIMD_VEC *restrict add1,
+						   SIMD_VEC *restrict add0)
+{
+	*add0 += (((v0 & 0xff000000ull) | (v1 & 0xff00000000ull)) >> 24) |
+		(((v0 & 0xff0000000000ull) |
+		  (v1 & 0xff000000000000ull)) >> 16) |
+		(v0 & 0xff0000ull) | ((v0 & 0xff00ull) << 32) |
+		((v1 & 0xff00000000000000ull) >> 8) | (v0 << 56);
+	*add1 += (((v1 & 0xff000000ull) | (v0 & 0xff00000000ull)) >> 24) |
+		(v1 & 0xff0000ull) | ((v1 & 0xff0000000000ull) >> 16) |
+		((v1 & 0xff00ull) << 24) |
+		((v0 & 0xff000000000000ull) >> 8) |
+		((v1 & 0xffull) << 48) | (v0 & 0xff00000000000000ull);
+}
+
+static inline void SIMD_NAME(update)(const SIMD_VEC lanes[4],
+				     SIMD_NAME(highway_t) *restrict st)
+{
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		st->v1[i] += st->mul0[i] + lanes[i];
+		st->mul0[i] ^= SIMD_MUL32(st->v1[i], st->v0[i]);
+		st->v0[i] += st->mul1[i];
+		st->mul1[i] ^= SIMD_MUL32(st->v0[i], st->v1[i]);
+	}
+
+	SIMD_NAME(zipper_merge_and_add)(st->v1[1], st->v1[0],
+					&st->v0[1], &st->v0[0]);
+	SIMD_NAME(zipper_merge_and_add)(st->v1[3], st->v1[2],
+					&st->v0[3], &st->v0[2]);
+	SIMD_NAME(zipper_merge_and_add)(st->v0[1], st->v0[0],
+					&st->v1[1], &st->v1[0]);
+	SIMD_NAME(zipper_merge_and_add)(st->v0[3], st->v0[2],
+					&st->v1[3], &st->v1[2]);
+}
+
+static inline void SIMD_NAME(permute_and_update)(SIMD_NAME(highway_t)
+						 *restrict st)
+{
+	SIMD_VEC permuted[4];
+
+	permuted[0] = (st->v0[2] >> 32) | (st->v0[2] << 32);
+	permuted[1] = (st->v0[3] >> 32) | (st->v0[3] << 32);
+	permuted[2] = (st->v0[0] >> 32) | (st->v0[0] << 32);
+	permuted[3] = (st->v0[1] >> 32) | (st->v0[1] << 32);
+
+	SIMD_NAME(update)(permuted, st);
+}
+
+static inline void SIMD_NAME(modular_reduction)(SIMD_VEC a3_unmasked,
+						SIMD_VEC a2, SIMD_VEC a1,
+						SIMD_VEC a0,
+						SIMD_VEC *restrict m1,
+						SIMD_VEC *restrict m0)
+{
+	SIMD_VEC a3 = a3_unmasked & 0x3fffffffffffffffull;
+
+	*m1 = a1 ^ ((a3 << 1) | (a2 >> 63)) ^ ((a3 << 2) | (a2 >> 62));
+	*m0 = a0 ^ (a2 << 1) ^ (a2 << 2);
+}
+
+static inline void SIMD_NAME(finalize_256)(SIMD_NAME(highway_t) *restrict st,
+					   SIMD_VEC hash[4])
+{
+	int i;
+
+	for (i = 0; i < 10; i++)
+		SIMD_NAME(permute_and_update)(st);
+
+	SIMD_NAME(modular_reduction)(st->v1[1] + st->mul1[1],
+				     st->v1[0] + st->mul1[0],
+				     st->v0[1] + st->mul0[1],
+				     st->v0[0] + st->mul0[0],
+				     &hash[1], &hash[0]);
+	SIMD_NAME(modular_reduction)(st->v1[3] + st->mul1[3],
+				     st->v1[2] + st->mul1[2],
+				     st->v0[3] + st->mul0[3],
+				     st->v0[2] + st->mul0[2],
+				     &hash[3], &hash[2]);
+}
+
+/*
+ * Hash the elements of `lanes[0]` and add their digests to the accumulators,
+ * ignoring the lanes which are not set in `mask`.
+ * The accumulators hold the low and high 32-bit halves of each digest word so
+ * that no carry has to be propagated between the additions.
+ */
+static inline void SIMD_NAME(hash_add)(const SIMD_NAME(highway_t) *initial,
+				       const SIMD_VEC lanes[4], SIMD_VEC mask,
+				       SIMD_VEC acclo[4], SIMD_VEC acchi[4])
+{
+	SIMD_NAME(highway_t) st = *initial;
+	SIMD_VEC digest[4];
+	int i;
+
+	SIMD_NAME(update)(lanes, &st);
+	SIMD_NAME(finalize_256)(&st, digest);
+
+	for (i = 0; i < 4; i++) {
+		digest[i] &= mask;
+		acclo[i] += digest[i] & 0xffffffff;
+		acchi[i] += digest[i] >> 32;
+	}
+}
+
+/*
+ * Load the packets of `count` elements of `size` bytes, as the `load_elem()`
+ * function of the `hash_sum` kernel, and clear the lanes of the others.
+ */
+static inline void SIMD_NAME(load_lanes)(SIMD_VEC lanes[4],
+					 const uint8_t *elems, size_t size,
+					 size_t count)
+{
+	uint32_t half;
+	uint64_t word;
+	size_t i, j;
+
+	for (i = 0; i < 4; i++)
+		lanes[i] = (SIMD_VEC) {};
+
+	switch (size) {
+	case 4:
+		for (j = 0; j < count; j++) {
+			memcpy(&half, elems + 4 * j, sizeof (half));
+			lanes[0][j] = half;
+		}
+		break;
+	case 8:
+		memcpy(&lanes[0], elems, count * sizeof (uint64_t));
+		break;
+	case 16:
+		for (j = 0; j < count; j++) {
+			for (i = 0; i < 2; i++) {
+				memcpy(&word, elems + 16 * j + 8 * i,
+				       sizeof (word));
+				lanes[i][j] = word;
+			}
+		}
+		lanes[3] = lanes[1] & 0xffffffff00000000ull;
+		break;
+	default:
+		for (j = 0; j < count; j++) {
+			for (i = 0; i < 4; i++) {
+				memcpy(&word, elems + 32 * j + 8 * i,
+				       sizeof (word));
+				lanes[i][j] = word;
+			}
+		}
+		break;
+	}
+}
+
+static void SIMD_NAME(hash_sum)(const highway_t *initial, const void *elems,
+				size_t size, size_t n, uint320_t *dst)
+{
+	const size_t width = sizeof (SIMD_VEC) / sizeof (uint64_t);
+	SIMD_VEC lanes[4], acclo[4], acchi[4], index, mask;
+	const uint8_t *bytes = elems;
+	SIMD_NAME(highway_t) st;
+	uint64_t lo[4], hi[4];
+	size_t i, j;
+
+	for (i = 0; i < 4; i++) {
+		st.v0[i] = (SIMD_VEC) {} + initial->v0[i];
+		st.v1[i] = (SIMD_VEC) {} + initial->v1[i];
+		st.mul0[i] = (SIMD_VEC) {} + initial->mul0[i];
+		st.mul1[i] = (SIMD_VEC) {} + initial->mul1[i];
+		acclo[i] = (SIMD_VEC) {};
+		acchi[i] = (SIMD_VEC) {};
+	}
+
+	mask = ~((SIMD_VEC) {});
+
+	for (i = 0; (i + width) <= n; i += width) {
+		SIMD_NAME(load_lanes)(lanes, bytes + i * size, size, width);
+		SIMD_NAME(hash_add)(&st, lanes, mask, acclo, acchi);
+	}
+
+	if (i < n) {
+		for (j = 0; j < width; j++)
+			index[j] = j;
+		mask = (SIMD_VEC) (index < (n - i));
+
+		SIMD_NAME(load_lanes)(lanes, bytes + i * size, size, n - i);
+		SIMD_NAME(hash_add)(&st, lanes, mask, acclo, acchi);
+	}
+
+	for (i = 0; i < 4; i++) {
+		lo[i] = 0;
+		hi[i] = 0;
+		for (j = 0; j < width; j++) {
+			lo[i] += acclo[i][j];
+			hi[i] += acchi[i][j];
+		}
+	}
+
+	host_sum_halves(dst, lo, hi);
+}
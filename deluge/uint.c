@@ -15,6 +15,34 @@ void uint320_add(uint320_t *restrict dst, const uint320_t *restrict src)
 	}
 }
 
+void uint320_neg(uint320_t *restrict dst)
+{
+	uint64_t carry = 1;
+	size_t i;
+
+	for (i = 0; i < 5; i++) {
+		dst->arr[i] = ~dst->arr[i] + carry;
+		carry = carry && (dst->arr[i] == 0);
+	}
+}
+
+void uint320_acc_norm(uint320_t *restrict dst,
+		      const uint320_acc_t *restrict src)
+{
+	uint64_t limb, carry = 0;
+	size_t i;
+
+	for (i = 0; i < 5; i++) {
+		limb = src->arr[2 * i] + carry;
+		dst->arr[i] = limb & 0xffffffff;
+		carry = limb >> 32;
+
+		limb = src->arr[2 * i + 1] + carry;
+		dst->arr[i] |= limb << 32;
+		carry = limb >> 32;
+	}
+}
+
 void uint320_sum(uint320_t *restrict arr, size_t n)
 {
 	size_t i;
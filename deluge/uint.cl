@@ -21,6 +21,34 @@ void uint320_add(uint320_t *restrict dst, const uint320_t *restrict src)
 	}
 }
 
+void uint320_neg(uint320_t *restrict dst)
+{
+	uint64_t carry = 1;
+	size_t i;
+
+	for (i = 0; i < ARR_SIZE; i++) {
+		dst->arr[i] = ~dst->arr[i] + carry;
+		carry = carry && (dst->arr[i] == 0);
+	}
+}
+
+void uint320_acc_norm(uint320_t *restrict dst,
+		      const uint320_acc_t *restrict src)
+{
+	uint64_t limb, carry = 0;
+	size_t i;
+
+	for (i = 0; i < 5; i++) {
+		limb = src->arr[2 * i] + carry;
+		dst->arr[i] = limb & 0xffffffff;
+		carry = limb >> 32;
+
+		limb = src->arr[2 * i + 1] + carry;
+		dst->arr[i] |= limb << 32;
+		carry = limb >> 32;
+	}
+}
+
 static void uint320_add_local(local uint320_t *restrict arr, size_t n,
 			      size_t stride)
 {
@@ -48,3 +76,79 @@ void uint320_sum(local uint320_t *restrict arr, size_t n)
 		stride /= 2;
 	}
 }
+
+#if defined (SUBGROUP_REDUCE)
+
+/*
+ * Add to `val` the one of the work-item `lane ^ mask` of the sub-group, moved
+ * one limb at a time. The partners past the end of a partial sub-group add
+ * nothing, which still leaves the sum of the whole sub-group in lane 0.
+ */
+static void uint320_add_xor(uint320_t *restrict val, uint mask)
+{
+	uint other = get_sub_group_local_id() ^ mask;
+	uint320_t peer;
+	size_t i;
+
+	for (i = 0; i < ARR_SIZE; i++)
+		peer.arr[i] = sub_group_shuffle_xor(val->arr[i], mask);
+
+	if (other < get_sub_group_size())
+		uint320_add(val, &peer);
+}
+
+static void uint320_sum_sub_group(uint320_t *restrict val)
+{
+	uint mask;
+
+	for (mask = 1; mask < get_max_sub_group_size(); mask <<= 1)
+		uint320_add_xor(val, mask);
+}
+
+/*
+ * Each sub-group sums in registers and stores one value, then the first
+ * sub-group sums these. Only `get_num_sub_groups()` slots of `arr` are used
+ * and every work-item takes part, so `n` is not needed.
+ */
+void uint320_reduce(local uint320_t *restrict arr,
+		    const uint320_t *restrict val,
+		    size_t n __attribute__ ((unused)))
+{
+	size_t i, lane = get_sub_group_local_id();
+	size_t sgid = get_sub_group_id();
+	uint320_t acc = *val;
+
+	uint320_sum_sub_group(&acc);
+
+	if (lane == 0)
+		arr[sgid] = acc;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (sgid == 0) {
+		for (i = 0; i < ARR_SIZE; i++)
+			acc.arr[i] = 0;
+
+		for (i = lane; i < get_num_sub_groups();
+		     i += get_sub_group_size())
+			uint320_add(&acc, &arr[i]);
+
+		uint320_sum_sub_group(&acc);
+
+		if (lane == 0)
+			arr[0] = acc;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+#else  /* !defined (SUBGROUP_REDUCE) */
+
+void uint320_reduce(local uint320_t *restrict arr,
+		    const uint320_t *restrict val, size_t n)
+{
+	arr[get_local_id(0)] = *val;
+	uint320_sum(arr, n);
+}
+
+#endif  /* !defined (SUBGROUP_REDUCE) */
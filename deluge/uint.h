@@ -60,8 +60,59 @@ static inline void uint320_init_le64(uint320_t *restrict dst,
 
 void uint320_add(uint320_t *restrict dst, const uint320_t *restrict src);
 
+/*
+ * Replace `dst` by its opposite modulo 2^320.
+ */
+void uint320_neg(uint320_t *restrict dst);
+
 void uint320_sum(local uint320_t *restrict arr, size_t n);
 
+/*
+ * Sum the `val` of every work-item of the work-group into `arr[0]`, as read
+ * by the work-item 0. Every work-item must call it and the ones past the `n`
+ * first must pass zero.
+ * With `SUBGROUP_REDUCE` defined, `arr` needs one slot per sub-group instead
+ * of one per work-item.
+ */
+void uint320_reduce(local uint320_t *restrict arr,
+		    const uint320_t *restrict val, size_t n);
+
+
+/*
+ * A sum of 320-bit values with deferred carries. The limb `i` holds the sum of
+ * the 32-bit halves of weight 2^(32 * i) in a 64-bit word, so an addition has
+ * no carry chain. Up to 2^32 values can be added before `uint320_acc_norm()`.
+ */
+typedef struct
+{
+	uint64_t arr[10];
+} uint320_acc_t;
+
+static inline void uint320_acc_init(uint320_acc_t *restrict dst)
+{
+	size_t i;
+
+	for (i = 0; i < 10; i++)
+		dst->arr[i] = 0;
+}
+
+static inline void uint320_acc_add(uint320_acc_t *restrict dst,
+				   const uint320_t *restrict src)
+{
+	size_t i;
+
+	for (i = 0; i < 5; i++) {
+		dst->arr[2 * i] += src->arr[i] & 0xffffffff;
+		dst->arr[2 * i + 1] += src->arr[i] >> 32;
+	}
+}
+
+/*
+ * Propagate the carries of `src` into `dst`, modulo 2^320.
+ */
+void uint320_acc_norm(uint320_t *restrict dst,
+		      const uint320_acc_t *restrict src);
+
 
 /* #if !defined (__OPENCL_VERSION__) */
 
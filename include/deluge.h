@@ -12,6 +12,7 @@
 #define DELUGE_OUT_OF_GMEM  -3  /* Not enough device global memory */
 #define DELUGE_OUT_OF_LMEM  -4  /* Not enough device local memory */
 #define DELUGE_CANCEL       -5  /* Job canceled */
+#define DELUGE_AGAIN        -6  /* No resource available now, try again */
 
 
 struct deluge;
@@ -21,10 +22,72 @@ typedef struct deluge *deluge_t;
 /*
  * Create a new deluge context.
  * Allocate resources for an empty deluge context.
+ * Discover the OpenCL devices, followed by the host device which computes on
+ * CPU threads and is the only one available when OpenCL finds no device.
  * Return `DELUGE_SUCCESS` in case of success.
  */
 int deluge_create(deluge_t *deluge);
 
+/*
+ * Kinds of devices, to select in `struct deluge_options`.
+ */
+#define DELUGE_DEVICE_CPU          0x01  /* OpenCL CPU device */
+#define DELUGE_DEVICE_GPU          0x02
+#define DELUGE_DEVICE_ACCELERATOR  0x04
+#define DELUGE_DEVICE_OTHER        0x08  /* any other OpenCL device */
+#define DELUGE_DEVICE_HOST         0x10  /* CPU threads without OpenCL */
+
+/*
+ * Device filters of a deluge context. A zero or `NULL` field does not filter,
+ * so a zeroed structure selects every device.
+ */
+struct deluge_options
+{
+	unsigned int  types;        /* mask of `DELUGE_DEVICE_*` to use */
+	const char   *platform;     /* substring of the OpenCL platform name */
+	const char   *vendor;       /* substring of the OpenCL device vendor */
+	size_t        min_gmem;     /* min global memory of an OpenCL device */
+	size_t        max_devices;  /* max OpenCL devices, first found first */
+};
+
+/*
+ * Create a new deluge context on the devices selected by `options`, or on
+ * every device if `options` is `NULL`.
+ * The devices are only queried at creation: the OpenCL context of a device is
+ * created when a highway context first uses it.
+ * Return `DELUGE_SUCCESS` in case of success, or `DELUGE_NODEV` if no device
+ * passes the filters.
+ */
+int deluge_create_with_options(deluge_t *deluge,
+			       const struct deluge_options *options);
+
+/*
+ * Description of a device of a deluge context. The strings are truncated to
+ * fit and empty for the host device, whose name is "host".
+ */
+struct deluge_device_info
+{
+	unsigned int  type;         /* one of `DELUGE_DEVICE_*` */
+	char          name[256];
+	char          vendor[256];
+	char          driver[256];
+	size_t        gmem;         /* total global memory */
+};
+
+/*
+ * Get the number of devices of a deluge context. The devices are numbered in
+ * the order the compute stations go to them.
+ */
+size_t deluge_device_count(deluge_t deluge);
+
+/*
+ * Describe the device `idx` of a deluge context in `info`.
+ * Return `DELUGE_SUCCESS` in case of success, or `DELUGE_NODEV` if `idx` is
+ * not lower than `deluge_device_count()`.
+ */
+int deluge_describe_device(deluge_t deluge, size_t idx,
+			   struct deluge_device_info *info);
+
 /*
  * Destroy a deluge context.
  * Make the deluge context unusable.
@@ -40,21 +103,293 @@ typedef struct deluge_highway *deluge_highway_t;
 
 /*
  * Create a new deluge highway context.
- * Compile the highway kernel program on all deluge devices.
+ * Start compiling the highway kernel program on all deluge devices at the same
+ * time, in the background. A device takes compute stations as soon as its own
+ * program is built: `deluge_highway_alloc()` only waits for the devices it
+ * allocates on, and `deluge_highway_space()` waits for all of them.
  * Return 0 in case of success, otherwise set the deluge error appropriately.
  */
 int deluge_highway_create(deluge_t deluge, deluge_highway_t *highway,
 			  const uint64_t key[4]);
 
+/*
+ * Create a hash sum context for the `nkey` keys of `keys`, at most 64, to be
+ * used by `deluge_highway_schedule_keys()`. The other functions hash with the
+ * first key.
+ * Return 0 in case of success, otherwise set the deluge error appropriately.
+ */
+int deluge_highway_create_keys(deluge_t deluge, deluge_highway_t *highway,
+			       const uint64_t (*keys)[4], size_t nkey);
+
 void deluge_highway_destroy(deluge_highway_t highway);
 
 size_t deluge_highway_space(deluge_highway_t highway);
 
+/*
+ * Set the pipeline depth of the compute stations allocated from now on.
+ * A station of depth N holds up to N jobs at once, so the input upload and
+ * the result readback of a job overlap with the computation of another.
+ * Each job in the pipeline needs its own device buffers. The default depth
+ * is 2.
+ */
+int deluge_highway_set_depth(deluge_highway_t highway, size_t depth);
+
+/*
+ * Build on every device a hash sum kernel for the 8-byte elements with the key
+ * of `highway` compiled in, and use it in the compute stations allocated from
+ * now on. The part of the first hash round that only depends on the key is
+ * then computed once, when building. The programs are built once per key and
+ * device and only kept in memory: the key derived state never reaches the
+ * program cache, so each process builds them again.
+ * Return 0 in case of success, otherwise set the deluge error appropriately.
+ */
+int deluge_highway_specialize(deluge_highway_t highway);
+
 int deluge_highway_alloc(deluge_highway_t highway, size_t len);
 
+/*
+ * Schedule the hash sum of `nelem` elements.
+ * Jobs larger than a compute station are split over many stations and the
+ * partial sums are merged before `cb` is called, exactly once.
+ * The `elems` array must stay valid until `cb` is called.
+ */
 int deluge_highway_schedule(deluge_highway_t highway, const uint64_t *elems,
 			    size_t nelem, void (*cb)(int, uint64_t[5], void *),
 			    void *user);
 
+/*
+ * Schedule the hash sum of `nelem` elements of 32, 128 or 256 bits.
+ * An element is hashed as its little endian bytes. The 128 and 256 bits
+ * elements are given as 2 and 4 consecutive words, least significant first.
+ * The kernel of each width is compiled the first time it is scheduled.
+ */
+int deluge_highway_schedule32(deluge_highway_t highway, const uint32_t *elems,
+			      size_t nelem,
+			      void (*cb)(int, uint64_t[5], void *), void *user);
+
+int deluge_highway_schedule128(deluge_highway_t highway,
+			       const uint64_t *elems, size_t nelem,
+			       void (*cb)(int, uint64_t[5], void *),
+			       void *user);
+
+int deluge_highway_schedule256(deluge_highway_t highway,
+			       const uint64_t *elems, size_t nelem,
+			       void (*cb)(int, uint64_t[5], void *),
+			       void *user);
+
+/*
+ * Schedule the hash sum of `nstr` byte strings.
+ * String `i` spans from `bytes + offsets[i]` to `bytes + offsets[i + 1]` so
+ * `offsets` holds `nstr + 1` increasing offsets. Each string is hashed with
+ * the full highway hash, so the sum does not depend on how the strings are
+ * laid out in `bytes`.
+ * Return `DELUGE_FAILURE` if a string does not fit in a compute station input
+ * buffer, of about 2 MiB. The `offsets` and `bytes` arrays must stay valid
+ * until `cb` is called.
+ */
+int deluge_highway_schedule_bytes(deluge_highway_t highway,
+				  const uint64_t *offsets, const void *bytes,
+				  size_t nstr,
+				  void (*cb)(int, uint64_t[5], void *),
+				  void *user);
+
+/*
+ * Schedule the hash sums of `nelem` elements under every key of `highway`.
+ * The elements are transferred to a device once for all the keys. The `cb`
+ * callback is mandatory and is called exactly once with the sums of every key
+ * in the order of the keys, which are only valid during the call, or with
+ * `NULL` sums if the job failed or was canceled. Return `DELUGE_FAILURE`
+ * without scheduling anything if `cb` is `NULL`: the sums of every key cannot
+ * be polled with `deluge_highway_poll()`.
+ * The `elems` array must stay valid until `cb` is called.
+ */
+int deluge_highway_schedule_keys(deluge_highway_t highway,
+				 const uint64_t *elems, size_t nelem,
+				 void (*cb)(int, uint64_t (*)[5], void *),
+				 void *user);
+
+/*
+ * A set of elements of a batch and the callback of its hash sum.
+ */
+struct deluge_highway_set
+{
+	const uint64_t *elems;
+	size_t nelem;
+	void (*cb)(int, uint64_t[5], void *);
+	void *user;
+};
+
+/*
+ * Schedule the hash sums of `nset` sets at once.
+ * The sets are packed one after the other in the compute station input
+ * buffers, so many small sets are hashed by a single kernel launch. The
+ * callback of every set is called exactly once with the sum of its elements.
+ * The sets and their elements are copied before returning.
+ * Return `DELUGE_FAILURE` if a set does not fit alone in a compute station
+ * input buffer, in which case no set is scheduled.
+ */
+int deluge_highway_schedule_batch(deluge_highway_t highway,
+				  const struct deluge_highway_set *sets,
+				  size_t nset);
+
+/*
+ * Schedule the update of the hash sum `prev`, as given to a callback, when
+ * the `nadded` elements of `added` join the set and the `nremoved` elements
+ * of `removed` leave it.
+ * The sum is modulo 2^320 so the digests of the removed elements are
+ * subtracted and only the changed elements are hashed. Both lists are hashed
+ * by the same jobs. If there is no change, `cb` is called with `prev` before
+ * returning.
+ */
+int deluge_highway_update(deluge_highway_t highway, const uint64_t prev[5],
+			  const uint64_t *added, size_t nadded,
+			  const uint64_t *removed, size_t nremoved,
+			  void (*cb)(int, uint64_t[5], void *), void *user);
+
+
+
+struct deluge_highway_stream;
+
+typedef struct deluge_highway_stream *deluge_highway_stream_t;
+
+/*
+ * Open a stream summing the elements of every chunk appended to it.
+ * The sum of each job stays in the memory of the device which ran it, added
+ * to a running sum, and is only read back by a snapshot or the finalization.
+ * Every stream must be finalized before its highway context is destroyed.
+ * Return 0 in case of success, otherwise set the deluge error appropriately.
+ */
+int deluge_highway_stream_open(deluge_highway_t highway,
+			       deluge_highway_stream_t *stream);
+
+/*
+ * Schedule the hash sum of a chunk of `nelem` elements into the stream.
+ * The optional `cb` is called exactly once when the chunk is hashed, after
+ * which `elems` can be reused. Without callback, `elems` must stay valid until
+ * the next snapshot or the finalization.
+ */
+int deluge_highway_stream_append(deluge_highway_stream_t stream,
+				 const uint64_t *elems, size_t nelem,
+				 void (*cb)(int, void *), void *user);
+
+/*
+ * Wait for the chunks appended so far and store their sum in `sum`.
+ * Must not be called concurrently with an append to the same stream.
+ * Return 0 in case of success, otherwise the error of the first failed chunk.
+ */
+int deluge_highway_stream_snapshot(deluge_highway_stream_t stream,
+				   uint64_t sum[5]);
+
+/*
+ * Like `deluge_highway_stream_snapshot()`, then free the stream.
+ */
+int deluge_highway_stream_finalize(deluge_highway_stream_t stream,
+				   uint64_t sum[5]);
+
+
+/*
+ * The result of a job scheduled with a `NULL` callback.
+ */
+struct deluge_highway_result
+{
+	void *user;
+	int status;
+	uint64_t sum[5];
+};
+
+/*
+ * Move up to `max` results to `results` and return how many were moved.
+ * The functions scheduling a single sum, `deluge_highway_schedule()` and its
+ * variants, `deluge_highway_schedule_bytes()`, `deluge_highway_update()` and
+ * `deluge_highway_submit_buffer()`, as well as the sets of
+ * `deluge_highway_schedule_batch()`, accept a `NULL` callback, in which case
+ * the result is queued in the context, in completion order, instead of calling
+ * back on a driver or worker thread. `deluge_highway_schedule_keys()` rejects
+ * a `NULL` callback since its sums do not fit a result. Neither the
+ * completions nor the scheduling functions wait for the caller to poll: the
+ * queue grows while the results pile up.
+ */
+size_t deluge_highway_poll(deluge_highway_t highway,
+			   struct deluge_highway_result *results, size_t max);
+
+
+struct deluge_highway_buffer;
+
+typedef struct deluge_highway_buffer *deluge_highway_buffer_t;
+
+/*
+ * Acquire the input buffer of an idle compute station.
+ * Set `elems` to the buffer, mapped in host memory, and `cap` to the number of
+ * elements it can hold. The elements written in place are submitted without
+ * further copy.
+ * Return `DELUGE_AGAIN` if no station is idle.
+ */
+int deluge_highway_acquire_buffer(deluge_highway_t highway,
+				  deluge_highway_buffer_t *buffer,
+				  uint64_t **elems, size_t *cap);
+
+/*
+ * Schedule the hash sum of the `nelem` first elements of an acquired buffer.
+ * The buffer is given back to its station and `elems` must not be accessed
+ * anymore. Return `DELUGE_FAILURE` if `nelem` exceeds the buffer capacity, in
+ * which case the buffer stays acquired. If the sum fails to launch, the buffer
+ * is released, `cb` is not called and the error is returned.
+ */
+int deluge_highway_submit_buffer(deluge_highway_buffer_t buffer, size_t nelem,
+				 void (*cb)(int, uint64_t[5], void *),
+				 void *user);
+
+/*
+ * Give an acquired buffer back to its station without scheduling anything.
+ */
+void deluge_highway_release_buffer(deluge_highway_buffer_t buffer);
+
+
+/*
+ * Timestamps in nanoseconds of a command of a job, from the OpenCL profiling
+ * counters of the device. All zero for a command the job did not run.
+ */
+struct deluge_highway_command_times
+{
+	uint64_t  queued;
+	uint64_t  submit;
+	uint64_t  start;
+	uint64_t  end;
+};
+
+/*
+ * Timing breakdown of a completed job of `nelem` elements, strings or batched
+ * elements. The `upload` times the last transfer of the input, the `reduce`
+ * is the sum of the partial sums of the `compute` work-groups, if any. Jobs
+ * of the host device only have a `compute`, timed by the host monotonic clock.
+ * The `readback` of a streamed job times the addition to the running sum.
+ * The `complete_start` and `complete_end` host monotonic times frame the
+ * host-side completion, including the result callbacks.
+ */
+struct deluge_highway_profile
+{
+	void     *user;   /* of the job, `NULL` for a batch */
+	size_t    nelem;
+	struct deluge_highway_command_times upload;
+	struct deluge_highway_command_times compute;
+	struct deluge_highway_command_times reduce;
+	struct deluge_highway_command_times readback;
+	uint64_t  complete_start;
+	uint64_t  complete_end;
+};
+
+/*
+ * Call `profiler` with the timing breakdown of every job completed by the
+ * stations allocated after this call, whose queues are created with profiling
+ * enabled. The profiler is called after the result callbacks of the job, on
+ * the same thread. A `NULL` profiler disables profiling for the stations
+ * allocated later.
+ */
+void deluge_highway_set_profiler(deluge_highway_t highway,
+				 void (*profiler)
+				 (const struct deluge_highway_profile *,
+				  void *),
+				 void *user);
+
 
 #endif
@@ -0,0 +1,553 @@
+#include <deluge.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#ifndef DELUGE_VERSION
+#  define DELUGE_VERSION  "unknown"
+#endif
+
+#define DEFAULT_DEPTH     2
+#define DEFAULT_CHUNK     (1ul << 18)  /* elements, a station input buffer */
+#define CHUNKS_PER_SLOT   2     /* appended chunks in flight per slot */
+#define BUFFER_ALIGN      4096  /* page, for the reads into the buffers */
+
+#define ERR_IO            1     /* input error, see `errno` */
+#define ERR_SIZE          2     /* input not made of whole elements */
+
+
+struct options
+{
+	uint64_t     key[4];
+	size_t       nstation;      /* 0 for every available station */
+	size_t       depth;
+	size_t       chunk;         /* elements per appended chunk */
+	int          quiet;
+};
+
+/*
+ * The chunks appended to a stream and not hashed yet, at most `nchunk`.
+ * The chunks read from a pipe each own one of the `nchunk` buffers, given
+ * back to the `free` stack once hashed.
+ */
+struct window
+{
+	pthread_mutex_t    lock;
+	pthread_cond_t     cond;
+	size_t             nchunk;
+	size_t             inflight;
+	uint64_t         **buffers;     /* `NULL` for a mapped file */
+	size_t            *free;
+	size_t             nfree;
+	int                status;
+};
+
+struct chunk
+{
+	struct window     *win;
+	size_t             buffer;
+};
+
+
+static uint64_t get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int init_window(struct window *this, size_t nchunk, size_t chunk,
+		       int buffered)
+{
+	size_t i;
+
+	this->buffers = NULL;
+	this->free = NULL;
+	this->nfree = 0;
+
+	if (buffered) {
+		this->buffers = calloc(nchunk, sizeof (*this->buffers));
+		this->free = calloc(nchunk, sizeof (*this->free));
+		if ((this->buffers == NULL) || (this->free == NULL))
+			goto err;
+
+		for (i = 0; i < nchunk; i++) {
+			this->buffers[i] = aligned_alloc(BUFFER_ALIGN,
+							 chunk * sizeof
+							 (uint64_t));
+			if (this->buffers[i] == NULL)
+				goto err;
+			this->free[this->nfree++] = i;
+		}
+	}
+
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->cond, NULL);
+	this->nchunk = nchunk;
+	this->inflight = 0;
+	this->status = DELUGE_SUCCESS;
+
+	return 0;
+ err:
+	if (this->buffers != NULL)
+		for (i = 0; i < nchunk; i++)
+			free(this->buffers[i]);
+	free(this->buffers);
+	free(this->free);
+	return -1;
+}
+
+static void finlz_window(struct window *this)
+{
+	size_t i;
+
+	pthread_cond_destroy(&this->cond);
+	pthread_mutex_destroy(&this->lock);
+
+	if (this->buffers == NULL)
+		return;
+
+	for (i = 0; i < this->nchunk; i++)
+		free(this->buffers[i]);
+	free(this->buffers);
+	free(this->free);
+}
+
+static void chunk_done(int status, void *user)
+{
+	struct chunk *chunk = user;
+	struct window *win = chunk->win;
+
+	pthread_mutex_lock(&win->lock);
+	if ((status != DELUGE_SUCCESS) && (win->status == DELUGE_SUCCESS))
+		win->status = status;
+	if (win->buffers != NULL)
+		win->free[win->nfree++] = chunk->buffer;
+	win->inflight -= 1;
+	pthread_cond_signal(&win->cond);
+	pthread_mutex_unlock(&win->lock);
+
+	free(chunk);
+}
+
+/*
+ * Wait for room in the window and return a new chunk, holding a free buffer
+ * if the window has buffers.
+ */
+static struct chunk *get_chunk(struct window *win)
+{
+	struct chunk *chunk;
+
+	chunk = malloc(sizeof (*chunk));
+	if (chunk == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&win->lock);
+	while (win->inflight >= win->nchunk)
+		pthread_cond_wait(&win->cond, &win->lock);
+	win->inflight += 1;
+	if (win->buffers != NULL)
+		chunk->buffer = win->free[--win->nfree];
+	pthread_mutex_unlock(&win->lock);
+
+	chunk->win = win;
+
+	return chunk;
+}
+
+static int append_chunk(deluge_highway_stream_t stream, struct chunk *chunk,
+			const uint64_t *elems, size_t nelem)
+{
+	int err;
+
+	err = deluge_highway_stream_append(stream, elems, nelem, chunk_done,
+					   chunk);
+	if (err != DELUGE_SUCCESS)
+		chunk_done(err, chunk);
+
+	return err;
+}
+
+/*
+ * Append a mapped file in chunks, the kernel reading ahead of the stations.
+ */
+static int hash_mapped(deluge_highway_stream_t stream, struct window *win,
+		       const uint64_t *elems, size_t nelem, size_t size)
+{
+	struct chunk *chunk;
+	size_t off, len;
+	int err;
+
+	for (off = 0; off < nelem; off += len) {
+		len = nelem - off;
+		if (len > size)
+			len = size;
+
+		chunk = get_chunk(win);
+		if (chunk == NULL)
+			return DELUGE_FAILURE;
+
+		err = append_chunk(stream, chunk, elems + off, len);
+		if (err != DELUGE_SUCCESS)
+			return err;
+	}
+
+	return DELUGE_SUCCESS;
+}
+
+/*
+ * Fill `buf` with up to `size` bytes, less only at the end of the input.
+ */
+static ssize_t read_full(int fd, void *buf, size_t size)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < size) {
+		ret = read(fd, (char *) buf + done, size - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+/*
+ * Read the input in the buffers of the window, each appended once full.
+ */
+static int hash_read(deluge_highway_stream_t stream, struct window *win,
+		     int fd, size_t size, uint64_t *nbytes)
+{
+	struct chunk *chunk;
+	uint64_t *buf;
+	ssize_t len;
+	int err;
+
+	while (1) {
+		chunk = get_chunk(win);
+		if (chunk == NULL)
+			return DELUGE_FAILURE;
+
+		buf = win->buffers[chunk->buffer];
+
+		len = read_full(fd, buf, size * sizeof (*buf));
+		if (len < 0) {
+			chunk_done(DELUGE_SUCCESS, chunk);
+			return ERR_IO;
+		}
+
+		*nbytes += len;
+
+		if ((len % sizeof (*buf)) != 0) {
+			chunk_done(DELUGE_SUCCESS, chunk);
+			return ERR_SIZE;
+		}
+
+		err = append_chunk(stream, chunk, buf, len / sizeof (*buf));
+		if (err != DELUGE_SUCCESS)
+			return err;
+
+		if ((size_t) len < (size * sizeof (*buf)))
+			return DELUGE_SUCCESS;
+	}
+}
+
+/*
+ * Hash the elements of `fd` and store their sum in `sum` and the input size in
+ * `nbytes`. Regular files are mapped, other inputs are read.
+ * Return `DELUGE_SUCCESS`, a deluge error or an `ERR_*` input error.
+ */
+static int hash_fd(deluge_highway_t highway, const struct options *opts,
+		   size_t nslot, int fd, uint64_t sum[5], uint64_t *nbytes)
+{
+	deluge_highway_stream_t stream;
+	struct window win;
+	struct stat st;
+	void *map = NULL;
+	int err, ret;
+
+	*nbytes = 0;
+
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+		if ((st.st_size % sizeof (uint64_t)) != 0)
+			return ERR_SIZE;
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			map = NULL;
+		else
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	if (map == NULL)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (init_window(&win, nslot * CHUNKS_PER_SLOT, opts->chunk,
+			map == NULL) < 0) {
+		err = DELUGE_FAILURE;
+		goto err;
+	}
+
+	err = deluge_highway_stream_open(highway, &stream);
+	if (err != DELUGE_SUCCESS)
+		goto err_window;
+
+	if (map != NULL) {
+		*nbytes = st.st_size;
+		err = hash_mapped(stream, &win, map,
+				  st.st_size / sizeof (uint64_t),
+				  opts->chunk);
+	} else {
+		err = hash_read(stream, &win, fd, opts->chunk, nbytes);
+	}
+
+	/* the stream waits for the chunks in flight */
+	ret = deluge_highway_stream_finalize(stream, sum);
+	if (err == DELUGE_SUCCESS)
+		err = ret;
+	if (err == DELUGE_SUCCESS)
+		err = win.status;
+ err_window:
+	finlz_window(&win);
+ err:
+	if (map != NULL)
+		munmap(map, st.st_size);
+	return err;
+}
+
+static void print_sum(const uint64_t sum[5], const char *name)
+{
+	int i;
+
+	for (i = 4; i >= 0; i--)
+		printf("%016lx", (unsigned long) sum[i]);
+
+	printf("  %s\n", name);
+}
+
+static int hash_path(deluge_highway_t highway, const struct options *opts,
+		     size_t nslot, const char *path)
+{
+	uint64_t sum[5], nbytes, start, elapsed;
+	const char *name = path;
+	int fd, err;
+
+	if (strcmp(path, "-") == 0) {
+		fd = STDIN_FILENO;
+	} else {
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	start = get_time();
+	err = hash_fd(highway, opts, nslot, fd, sum, &nbytes);
+	elapsed = get_time() - start;
+
+	if (err == ERR_IO)
+		perror(name);
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	if (err == ERR_SIZE)
+		fprintf(stderr, "%s: size is not a multiple of %zu bytes\n",
+			name, sizeof (uint64_t));
+	else if ((err != DELUGE_SUCCESS) && (err != ERR_IO))
+		fprintf(stderr, "%s: hashing failed (%d)\n", name, err);
+
+	if (err != DELUGE_SUCCESS)
+		return -1;
+
+	print_sum(sum, name);
+
+	if (!opts->quiet)
+		fprintf(stderr, "%s: %lu elements in %.3f s, %.3f GB/s\n",
+			name, (unsigned long) (nbytes / sizeof (uint64_t)),
+			elapsed / 1e9, (elapsed == 0) ? 0.0 :
+			(double) nbytes / elapsed);
+
+	return 0;
+}
+
+
+static int parse_key(const char *str, uint64_t key[4])
+{
+	char *end;
+	size_t i;
+
+	for (i = 0; i < 4; i++) {
+		key[i] = strtoull(str, &end, 0);
+		if (end == str)
+			return -1;
+
+		if (i < 3) {
+			if (*end != ',')
+				return -1;
+			str = end + 1;
+		}
+	}
+
+	return (*end == '\0') ? 0 : -1;
+}
+
+static int parse_size(const char *str, size_t *dst)
+{
+	char *end;
+
+	*dst = strtoul(str, &end, 0);
+
+	return ((end == str) || (*end != '\0') || (*dst == 0)) ? -1 : 0;
+}
+
+static void usage(FILE *out, const char *prog)
+{
+	fprintf(out, "Usage: %s [options] [FILE...]\n"
+		"Print the deluge highway hash sum of the 64-bit elements of\n"
+		"each FILE, in native byte order, as 80 hex digits. With no\n"
+		"FILE, or when FILE is -, read the standard input.\n"
+		"\n"
+		"  -k KEY    key as 4 comma separated words (default 0,0,0,0)\n"
+		"  -s N      stations to allocate (default all available)\n"
+		"  -d DEPTH  jobs in the pipeline of a station (default %d)\n"
+		"  -c N      elements per appended chunk (default %lu)\n"
+		"  -q        do not report the throughput on stderr\n"
+		"  -v        print the version\n"
+		"  -h        print this message\n"
+		"\n"
+		"Regular files are mapped in memory, other inputs are read in\n"
+		"chunk sized buffers. Enough chunks stay in flight to keep\n"
+		"every station busy, so hashing runs at the lower of the\n"
+		"input and device speeds.\n", prog, DEFAULT_DEPTH,
+		DEFAULT_CHUNK);
+}
+
+static int parse_options(int argc, char **argv, struct options *opts)
+{
+	int c;
+
+	memset(opts->key, 0, sizeof (opts->key));
+	opts->nstation = 0;
+	opts->depth = DEFAULT_DEPTH;
+	opts->chunk = DEFAULT_CHUNK;
+	opts->quiet = 0;
+
+	while ((c = getopt(argc, argv, "k:s:d:c:qvh")) != -1) {
+		switch (c) {
+		case 'k':
+			if (parse_key(optarg, opts->key) < 0)
+				goto err;
+			break;
+		case 's':
+			if (parse_size(optarg, &opts->nstation) < 0)
+				goto err;
+			break;
+		case 'd':
+			if (parse_size(optarg, &opts->depth) < 0)
+				goto err;
+			break;
+		case 'c':
+			if (parse_size(optarg, &opts->chunk) < 0)
+				goto err;
+			break;
+		case 'q':
+			opts->quiet = 1;
+			break;
+		case 'v':
+			printf("deluge-hashsum %s\n", DELUGE_VERSION);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			usage(stdout, argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			goto err;
+		}
+	}
+
+	return 0;
+ err:
+	usage(stderr, argv[0]);
+	return -1;
+}
+
+
+int main(int argc, char **argv)
+{
+	deluge_highway_t highway;
+	struct options opts;
+	size_t nstation;
+	deluge_t deluge;
+	int i, err, ret;
+
+	if (parse_options(argc, argv, &opts) < 0)
+		return EXIT_FAILURE;
+
+	ret = EXIT_FAILURE;
+
+	err = deluge_create(&deluge);
+	if (err != DELUGE_SUCCESS) {
+		fprintf(stderr, "cannot create deluge context (%d)\n", err);
+		goto err;
+	}
+
+	err = deluge_highway_create(deluge, &highway, opts.key);
+	if (err != DELUGE_SUCCESS) {
+		fprintf(stderr, "cannot create highway context (%d)\n", err);
+		goto err_deluge;
+	}
+
+	err = deluge_highway_set_depth(highway, opts.depth);
+	if (err != DELUGE_SUCCESS)
+		goto err_highway;
+
+	nstation = deluge_highway_space(highway);
+	if ((opts.nstation != 0) && (opts.nstation < nstation))
+		nstation = opts.nstation;
+
+	if (nstation == 0) {
+		fprintf(stderr, "no device can hold a station\n");
+		goto err_highway;
+	}
+
+	err = deluge_highway_alloc(highway, nstation);
+	if (err != DELUGE_SUCCESS) {
+		fprintf(stderr, "cannot allocate stations (%d)\n", err);
+		goto err_highway;
+	}
+
+	ret = EXIT_SUCCESS;
+
+	if (optind == argc) {
+		if (hash_path(highway, &opts, nstation * opts.depth, "-") < 0)
+			ret = EXIT_FAILURE;
+	}
+
+	for (i = optind; i < argc; i++)
+		if (hash_path(highway, &opts, nstation * opts.depth,
+			      argv[i]) < 0)
+			ret = EXIT_FAILURE;
+ err_highway:
+	deluge_highway_destroy(highway);
+ err_deluge:
+	deluge_destroy(deluge);
+ err:
+	return ret;
+}